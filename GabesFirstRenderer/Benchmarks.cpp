@@ -0,0 +1,306 @@
+#include "Benchmarks.h"
+#include "DomainTransport.h"
+#include "FluidSolver.h"
+#include "KernelTable.h"
+#include "NumaTopology.h"
+#include "SPHKernels.h"
+#include "SlabSolver.h"
+#include <glm/common.hpp>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+static const unsigned SAMPLE_COUNT = 1 << 22;
+
+// Times fn over every sample, returning nanoseconds per lookup. The sum keeps the loop from being optimised out.
+template <typename Fn>
+static double timeLookups(const std::vector<float>& sqrDistances, Fn fn, glm::vec4& sum) {
+	auto start = std::chrono::high_resolution_clock::now();
+	for (float sqrDst : sqrDistances) {
+		sum += fn(sqrDst);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / sqrDistances.size();
+}
+
+// Density, near density and their derivatives, as the solver tabulates them
+template <class DensityKernel>
+static glm::vec4 evaluateKernels(float dst, float radius, float densityScale, float nearDensityScale) {
+	return glm::vec4(
+		kernelValue<DensityKernel>(dst, radius, densityScale),
+		kernelValue<SpikyPow3Kernel>(dst, radius, nearDensityScale),
+		kernelDerivative<DensityKernel>(dst, radius, densityScale),
+		kernelDerivative<SpikyPow3Kernel>(dst, radius, nearDensityScale));
+}
+
+template <class DensityKernel>
+static void benchmarkKernel(const std::vector<float>& sqrDistances, float radius, glm::vec4& sum) {
+	float densityScale = kernelScale<DensityKernel>(radius);
+	float nearDensityScale = kernelScale<SpikyPow3Kernel>(radius);
+	auto evaluate = [&](float dst) { return evaluateKernels<DensityKernel>(dst, radius, densityScale, nearDensityScale); };
+
+	double analyticTime = timeLookups(sqrDistances, [&](float sqrDst) { return evaluate(std::sqrt(sqrDst)); }, sum);
+
+	// Errors are relative to each kernel's largest magnitude over the support
+	glm::vec4 peak(0.0f);
+	for (int i = 0; i <= 1000; i++) {
+		peak = glm::max(peak, glm::abs(evaluate(radius * i / 1000)));
+	}
+
+	printf("%s\n", DensityKernel::name());
+	printf("%10s %10.2f %12s %12s %12s %12s\n", "analytic", analyticTime, "-", "-", "-", "-");
+
+	for (unsigned resolution = 64; resolution <= 65536; resolution *= 4) {
+		KernelTable table(radius, resolution, evaluate);
+		double tableTime = timeLookups(sqrDistances, [&](float sqrDst) { return table.sample(sqrDst); }, sum);
+
+		glm::vec4 maxError(0.0f);
+		for (float sqrDst : sqrDistances) {
+			glm::vec4 error = glm::abs(table.sample(sqrDst) - evaluate(std::sqrt(sqrDst)));
+			maxError = glm::max(maxError, error);
+		}
+		maxError /= peak;
+
+		printf("%10u %10.2f %12.2e %12.2e %12.2e %12.2e\n", resolution, tableTime, maxError.x, maxError.y, maxError.z, maxError.w);
+	}
+}
+
+void runKernelTableBenchmark(float smoothingRadius) {
+	float sqrRadius = smoothingRadius * smoothingRadius;
+
+	// Neighbours are spread evenly over the disc, so squared distances are uniform
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> distribution(0.0f, sqrRadius);
+	std::vector<float> sqrDistances(SAMPLE_COUNT);
+	for (float& sqrDst : sqrDistances) sqrDst = distribution(rng);
+
+	glm::vec4 sum(0.0f);
+	printf("Kernel tables, radius %.1f, %u lookups\n", smoothingRadius, SAMPLE_COUNT);
+	printf("%10s %10s %12s %12s %12s %12s\n", "resolution", "ns/lookup", "density", "near", "derivative", "near deriv");
+	benchmarkKernel<SpikyPow2Kernel>(sqrDistances, smoothingRadius, sum);
+	benchmarkKernel<Poly6Kernel>(sqrDistances, smoothingRadius, sum);
+	benchmarkKernel<WendlandC2Kernel>(sqrDistances, smoothingRadius, sum);
+	benchmarkKernel<CubicSplineKernel>(sqrDistances, smoothingRadius, sum);
+
+	printf("(checksum %f)\n", sum.x + sum.y + sum.z + sum.w);
+}
+
+// Milliseconds per step, after a few steps to let the hash settle. unpinned receives the workers the OS wouldn't pin.
+static double timeFluidSteps(unsigned threads, ThreadPinning pinning, bool firstTouch, const std::vector<glm::vec3>& positions, unsigned steps, unsigned& unpinned) {
+	//The calling thread only waits during static loops, so every thread counted is a worker
+	JobSystem* jobs = threads > 1 ? new JobSystem(threads, pinning) : nullptr;
+	unpinned = jobs ? jobs->unpinnedWorkers() : 0;
+	FluidSolver<3>* solver = new FluidSolver<3>((unsigned)positions.size(), jobs);
+	solver->gravity = glm::vec3(0.0f, -300.0f, 0.0f);
+
+	if (firstTouch) {
+		solver->addParticles(positions.data(), nullptr, (unsigned)positions.size());
+	}
+	else {
+		for (const glm::vec3& position : positions) solver->addParticle(position);
+	}
+
+	for (int i = 0; i < 3; i++) solver->step(1.0f / 240.0f);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned i = 0; i < steps; i++) solver->step(1.0f / 240.0f);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	delete solver;
+	delete jobs;
+	return std::chrono::duration<double, std::milli>(end - start).count() / steps;
+}
+
+void runNumaScalingBenchmark(unsigned particleCount, unsigned steps) {
+	const NumaTopology& topology = NumaTopology::system();
+	unsigned hardwareThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	printf("NUMA scaling, %u particles, %u steps, %u nodes, %u hardware threads\n", particleCount, steps, topology.nodeCount(), hardwareThreads);
+	for (unsigned i = 0; i < topology.nodeCount(); i++) {
+		printf("  node %u: %u cpus\n", topology.node(i).id, (unsigned)topology.node(i).cpus.size());
+	}
+
+	// A cube of fluid dropped in the corner of the tank
+	std::vector<glm::vec3> positions;
+	unsigned side = std::max((unsigned)std::ceil(std::cbrt((double)particleCount)), 1u);
+	for (unsigned i = 0; i < particleCount; i++) {
+		positions.push_back(glm::vec3(i % side, (i / side) % side, i / (side * side)) * 10.0f + 5.0f);
+	}
+
+	std::vector<unsigned> threadCounts;
+	for (unsigned threads = 1; threads < hardwareThreads; threads *= 2) threadCounts.push_back(threads);
+	threadCounts.push_back(hardwareThreads);
+
+	const char* pinningNames[] = { "none", "compact", "scatter" };
+	const ThreadPinning pinnings[] = { ThreadPinning::None, ThreadPinning::Compact, ThreadPinning::Scatter };
+	printf("%8s %8s %12s %10s %8s %8s\n", "threads", "pinning", "placement", "ms/step", "speedup", "unpinned");
+
+	unsigned unpinned = 0;
+	double baseline = timeFluidSteps(1, ThreadPinning::None, false, positions, steps, unpinned);
+	printf("%8u %8s %12s %10.2f %8.2f %8u\n", 1u, "-", "serial", baseline, 1.0, unpinned);
+	for (unsigned threads : threadCounts) {
+		if (threads == 1) continue;
+		for (int pinning = 0; pinning < 3; pinning++) {
+			for (int firstTouch = 0; firstTouch < 2; firstTouch++) {
+				double time = timeFluidSteps(threads, pinnings[pinning], firstTouch != 0, positions, steps, unpinned);
+				printf("%8u %8s %12s %10.2f %8.2f %8u\n", threads, pinningNames[pinning], firstTouch ? "first touch" : "main thread", time, baseline / time, unpinned);
+			}
+		}
+	}
+}
+
+// Totals over a fluid's particles. Runs order their particles differently, so they are compared by these.
+struct FluidSummary
+{
+	double count = 0;
+	double positionX = 0;
+	double positionY = 0;
+	double kineticEnergy = 0;
+	double density = 0;
+
+	void add(const glm::vec2* positions, const glm::vec2* velocities, const float* densities, unsigned n) {
+		for (unsigned i = 0; i < n; i++) {
+			count += 1;
+			positionX += positions[i].x;
+			positionY += positions[i].y;
+			kineticEnergy += 0.5 * glm::dot(velocities[i], velocities[i]);
+			density += densities[i];
+		}
+	}
+
+	void add(const FluidSummary& other) {
+		count += other.count;
+		positionX += other.positionX;
+		positionY += other.positionY;
+		kineticEnergy += other.kineticEnergy;
+		density += other.density;
+	}
+};
+
+static const glm::vec2 SLAB_TANK = glm::vec2(600.0f, 300.0f);
+
+// The tank every slab comparison steps, with a layer of fluid across its whole width so every slab has work
+template <class Solver>
+static void configureSlabTank(Solver& solver) {
+	solver.params.smoothingRadius = 8.0f;
+	solver.params.targetDensity = 0.1f;
+	solver.params.pressureMultiplier = 500.0f;
+	solver.params.nearPressureMultiplier = 100.0f;
+	solver.gravity = glm::vec2(0.0f, -300.0f);
+	solver.boundsMin = glm::vec2(0.0f);
+	solver.boundsMax = SLAB_TANK;
+}
+
+// Rank 0 collects every rank's summary into its own, the others send theirs
+static bool gatherSummary(DomainTransport* transport, FluidSummary& summary) {
+	std::vector<char> outgoing, incoming;
+	writeMessage(outgoing, &summary, 1);
+	if (transport->rank() != 0) return transport->exchange(0, outgoing, incoming);
+
+	for (int peer = 1; peer < transport->size(); peer++) {
+		if (!transport->exchange(peer, outgoing, incoming)) return false;
+		MessageReader reader(incoming);
+		FluidSummary part = reader.read<FluidSummary>();
+		if (reader.failed()) return false;
+		summary.add(part);
+	}
+	return true;
+}
+
+// Steps one rank's slab, summary holds the whole fluid on rank 0 afterwards
+static bool runSlabRank(DomainTransport* transport, const std::vector<glm::vec2>& positions, unsigned steps, FluidSummary& summary, double& milliseconds) {
+	SlabSolver<2> solver(transport);
+	configureSlabTank(solver);
+	solver.partitionEvenly();
+	for (const glm::vec2& position : positions) solver.addParticle(position);
+
+	bool linked = true;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned i = 0; i < steps && linked; i++) linked = solver.step(1.0f / 240.0f);
+	auto end = std::chrono::high_resolution_clock::now();
+	milliseconds = std::chrono::duration<double, std::milli>(end - start).count() / steps;
+
+	if (!linked) return false;
+	summary.add(solver.positions(), solver.velocities(), solver.densities(), solver.count());
+	return gatherSummary(transport, summary);
+}
+
+static void printSummary(const char* name, const FluidSummary& summary, double milliseconds, const FluidSummary& reference) {
+	double count = std::max(summary.count, 1.0);
+	double referenceCount = std::max(reference.count, 1.0);
+	double driftX = summary.positionX / count - reference.positionX / referenceCount;
+	double driftY = summary.positionY / count - reference.positionY / referenceCount;
+	printf("%8s %10.2f %10.0f %10.3f %10.3f %12.3f %10.5f %10.4f\n", name, milliseconds, summary.count,
+		summary.positionX / count, summary.positionY / count, summary.kineticEnergy / count, summary.density / count,
+		std::sqrt(driftX * driftX + driftY * driftY));
+}
+
+void runSlabComparison(unsigned particleCount, unsigned steps, int ranks) {
+	printf("Slab decomposition, %u particles, %u steps, %d ranks\n", particleCount, steps, ranks);
+
+	//Rows of particles spaced for the target density from the floor up, as wide as the tank
+	float spacing = std::sqrt(1.0f / 0.1f);
+	unsigned columns = std::max((unsigned)(SLAB_TANK.x / spacing), 1u);
+	std::vector<glm::vec2> positions;
+	for (unsigned i = 0; i < particleCount; i++) {
+		positions.push_back((glm::vec2((float)(i % columns), (float)(i / columns)) + 0.5f) * spacing);
+	}
+
+	printf("%8s %10s %10s %10s %10s %12s %10s %10s\n", "run", "ms/step", "particles", "mean x", "mean y", "kinetic", "density", "drift");
+
+	FluidSolver<2> single((unsigned)positions.size());
+	configureSlabTank(single);
+	single.addParticles(positions.data(), nullptr, (unsigned)positions.size());
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned i = 0; i < steps; i++) single.step(1.0f / 240.0f);
+	auto end = std::chrono::high_resolution_clock::now();
+	FluidSummary reference;
+	reference.add(single.positions(), single.velocities(), single.densities(), single.count());
+	printSummary("single", reference, std::chrono::duration<double, std::milli>(end - start).count() / steps, reference);
+
+	//Ranks as threads, the calling thread is rank 0
+	{
+		LocalTransportGroup group(ranks);
+		std::vector<std::thread> threads;
+		for (int rank = 1; rank < ranks; rank++) {
+			threads.emplace_back([&, rank]() {
+				FluidSummary summary;
+				double milliseconds;
+				runSlabRank(group.transport(rank), positions, steps, summary, milliseconds);
+			});
+		}
+		FluidSummary summary;
+		double milliseconds;
+		bool linked = runSlabRank(group.transport(0), positions, steps, summary, milliseconds);
+		for (std::thread& thread : threads) thread.join();
+		if (linked) printSummary("threads", summary, milliseconds, reference);
+		else printf("%8s failed\n", "threads");
+	}
+
+#ifndef _WIN32
+	//Ranks as processes, the children leave once they have sent their summary. Output is flushed first so
+	//the children don't inherit and print it again.
+	std::fflush(stdout);
+	SocketTransport* transport = SocketTransport::spawn(ranks);
+	if (!transport) {
+		printf("%8s failed\n", "sockets");
+		return;
+	}
+	FluidSummary summary;
+	double milliseconds;
+	bool linked = runSlabRank(transport, positions, steps, summary, milliseconds);
+	if (transport->rank() != 0) {
+		delete transport;
+		_exit(linked ? 0 : 1);
+	}
+	delete transport;
+	if (linked) printSummary("sockets", summary, milliseconds, reference);
+	else printf("%8s failed\n", "sockets");
+#else
+	printf("%8s unavailable on Windows\n", "sockets");
+#endif
+}
@@ -0,0 +1,18 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+// Compares the tabulated kernels against the analytic ones for every density kernel and a range of table
+// resolutions, printing the worst error and the cost per lookup of each
+void runKernelTableBenchmark(float smoothingRadius);
+
+// Steps a 3D tank of particleCount particles with 1, 2, 4... up to every hardware thread, for each pinning
+// policy and with the particles either added on the main thread or placed by the workers with first touch,
+// printing the time per step and the speedup over a single thread
+void runNumaScalingBenchmark(unsigned particleCount, unsigned steps);
+
+// Steps a 2D tank with a single FluidSolver, then split into slabs over ranks threads of one process and over
+// ranks forked processes, printing each run's time per step, its totals and how far its centre of mass drifted
+// from the single solver's
+void runSlabComparison(unsigned particleCount, unsigned steps, int ranks);
+
+#endif
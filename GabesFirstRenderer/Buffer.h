@@ -62,6 +62,20 @@ public:
         return output;
     }
 
+    // Copies into caller-owned memory instead of allocating
+    void readInto(void* output, size_t byteCount, size_t offset = 0) {
+        if (!_size || !byteCount) return;
+
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ID);
+
+        void* buff = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, offset, byteCount, GL_MAP_READ_BIT);
+        //Copy raw
+        memcpy(output, buff, byteCount);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    }
+
     void write(void* dataIn, size_t size, size_t offset = 0) {
         if (offset + size > _size) {
             throw std::runtime_error("Buffer overflow");
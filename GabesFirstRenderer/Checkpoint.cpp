@@ -0,0 +1,178 @@
+#include "Checkpoint.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char CHECKPOINT_MAGIC[4] = { 'G', 'R', 'C', 'K' };
+
+static unsigned long long alignOffset(unsigned long long offset) {
+	return (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+}
+
+void CheckpointWriter::add(const std::string& name, const void* data, unsigned long long size) {
+	if (name.empty() || name.size() > sizeof(CheckpointSection::name)) {
+		std::cout << "ERROR::CHECKPOINT::INVALID_SECTION_NAME: " << name << std::endl;
+		return;
+	}
+	_sections.push_back({ name, data, size });
+}
+
+bool CheckpointWriter::write(const std::string& path) const {
+	//Offsets are known up front, so the header and table go out first and the sections follow in one pass
+	std::vector<CheckpointSection> table(_sections.size());
+	unsigned long long offset = sizeof(CheckpointHeader) + table.size() * sizeof(CheckpointSection);
+	for (size_t i = 0; i < _sections.size(); i++) {
+		std::memset(table[i].name, 0, sizeof(table[i].name));
+		std::memcpy(table[i].name, _sections[i].name.data(), _sections[i].name.size());
+		offset = alignOffset(offset);
+		table[i].offset = offset;
+		table[i].size = _sections[i].size;
+		offset += _sections[i].size;
+	}
+
+	CheckpointHeader header;
+	std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.sectionCount = (unsigned)table.size();
+	header.reserved = 0;
+	header.fileSize = offset;
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)table.data(), table.size() * sizeof(CheckpointSection));
+
+	const char padding[CHECKPOINT_ALIGNMENT] = {};
+	unsigned long long written = sizeof(CheckpointHeader) + table.size() * sizeof(CheckpointSection);
+	for (size_t i = 0; i < _sections.size(); i++) {
+		file.write(padding, (std::streamsize)(table[i].offset - written));
+		file.write((const char*)_sections[i].data, (std::streamsize)_sections[i].size);
+		written = table[i].offset + table[i].size;
+	}
+
+	if (!file) {
+		std::cout << "ERROR::CHECKPOINT::NOT_WRITTEN: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+CheckpointReader::~CheckpointReader() {
+	close();
+}
+
+bool CheckpointReader::open(const std::string& path) {
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = nullptr;
+	void* view = nullptr;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0) mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping) view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		std::cout << "ERROR::CHECKPOINT::NOT_MAPPED: " << path << std::endl;
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	_file = file;
+	_mapping = mapping;
+	_data = (const char*)view;
+	_size = (unsigned long long)size.QuadPart;
+#else
+	int file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0) return false;
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (fstat(file, &info) == 0 && info.st_size > 0) view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	//The mapping keeps the file alive on its own
+	::close(file);
+	if (view == MAP_FAILED) {
+		std::cout << "ERROR::CHECKPOINT::NOT_MAPPED: " << path << std::endl;
+		return false;
+	}
+	_data = (const char*)view;
+	_size = (unsigned long long)info.st_size;
+#endif
+
+	if (!validate(path)) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool CheckpointReader::validate(const std::string& path) {
+	if (_size < sizeof(CheckpointHeader)) {
+		std::cout << "ERROR::CHECKPOINT::TRUNCATED: " << path << std::endl;
+		return false;
+	}
+
+	const CheckpointHeader* header = (const CheckpointHeader*)_data;
+	if (std::memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+		std::cout << "ERROR::CHECKPOINT::NOT_A_CHECKPOINT: " << path << std::endl;
+		return false;
+	}
+	if (header->version != CHECKPOINT_VERSION) {
+		std::cout << "ERROR::CHECKPOINT::UNSUPPORTED_VERSION: " << header->version << " in " << path << std::endl;
+		return false;
+	}
+
+	unsigned long long tableEnd = sizeof(CheckpointHeader) + (unsigned long long)header->sectionCount * sizeof(CheckpointSection);
+	if (header->fileSize != _size || tableEnd > _size) {
+		std::cout << "ERROR::CHECKPOINT::TRUNCATED: " << path << std::endl;
+		return false;
+	}
+
+	_sections = (const CheckpointSection*)(_data + sizeof(CheckpointHeader));
+	_sectionCount = header->sectionCount;
+	for (unsigned i = 0; i < _sectionCount; i++) {
+		const CheckpointSection& section = _sections[i];
+		if (section.offset % CHECKPOINT_ALIGNMENT != 0 || section.offset < tableEnd || section.offset > _size || section.size > _size - section.offset) {
+			std::cout << "ERROR::CHECKPOINT::BAD_SECTION: " << std::string(section.name, strnlen(section.name, sizeof(section.name)))
+				<< " in " << path << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+void CheckpointReader::close() {
+	if (!_data) return;
+#ifdef _WIN32
+	UnmapViewOfFile(_data);
+	CloseHandle((HANDLE)_mapping);
+	CloseHandle((HANDLE)_file);
+	_file = nullptr;
+	_mapping = nullptr;
+#else
+	munmap((void*)_data, (size_t)_size);
+#endif
+	_data = nullptr;
+	_size = 0;
+	_sections = nullptr;
+	_sectionCount = 0;
+}
+
+const void* CheckpointReader::section(const std::string& name, unsigned long long& size) const {
+	for (unsigned i = 0; i < _sectionCount; i++) {
+		const CheckpointSection& section = _sections[i];
+		if (name.size() <= sizeof(section.name) && std::strncmp(section.name, name.c_str(), sizeof(section.name)) == 0) {
+			size = section.size;
+			return _data + section.offset;
+		}
+	}
+	return nullptr;
+}
@@ -0,0 +1,102 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+
+// Simulation state as named sections of raw arrays. The file is a header, a table of sections and then
+// every section's bytes, each starting on a 64 byte boundary. Mapped into memory, every section is an
+// aligned array ready to use where it lies, nothing is parsed. Values are stored in the writing
+// machine's byte order.
+//
+// Layout of version 1:
+//   header   magic "GRCK", version, section count, reserved, total file size
+//   table    per section an 8 character name, its offset from the start of the file and its size in bytes
+//   sections padded to CHECKPOINT_ALIGNMENT
+const unsigned CHECKPOINT_VERSION = 1;
+const unsigned CHECKPOINT_ALIGNMENT = 64;
+
+struct CheckpointHeader
+{
+	char magic[4];
+	unsigned version;
+	unsigned sectionCount;
+	unsigned reserved;
+	unsigned long long fileSize;
+};
+
+struct CheckpointSection
+{
+	// Zero padded, not terminated when all 8 are used
+	char name[8];
+	unsigned long long offset;
+	unsigned long long size;
+};
+
+// Gathers sections and writes them in one go. The data isn't copied, it has to stay alive until write returns.
+class CheckpointWriter
+{
+	struct PendingSection {
+		std::string name;
+		const void* data;
+		unsigned long long size;
+	};
+
+	std::vector<PendingSection> _sections;
+
+public:
+	// Names are at most 8 characters
+	void add(const std::string& name, const void* data, unsigned long long size);
+
+	template <typename T>
+	void add(const std::string& name, const T* values, size_t count) {
+		add(name, (const void*)values, (unsigned long long)count * sizeof(T));
+	}
+
+	bool write(const std::string& path) const;
+};
+
+// Maps a checkpoint read only and hands out pointers into the mapping, valid while the reader is open
+class CheckpointReader
+{
+	const char* _data = nullptr;
+	unsigned long long _size = 0;
+	const CheckpointSection* _sections = nullptr;
+	unsigned _sectionCount = 0;
+	// Windows file and mapping handles
+	void* _file = nullptr;
+	void* _mapping = nullptr;
+
+	bool validate(const std::string& path);
+
+public:
+	CheckpointReader() = default;
+	~CheckpointReader();
+
+	CheckpointReader(const CheckpointReader&) = delete;
+	CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+	// False if the file is missing, without a message. Files that exist but aren't a valid checkpoint of
+	// this version are reported and rejected.
+	bool open(const std::string& path);
+	void close();
+
+	bool isOpen() const {
+		return _data != nullptr;
+	}
+
+	// Start of the named section and its size in bytes, nullptr if the file has none
+	const void* section(const std::string& name, unsigned long long& size) const;
+
+	// The named section as count values of T, nullptr if missing or not a whole number of them
+	template <typename T>
+	const T* section(const std::string& name, size_t& count) const {
+		unsigned long long size = 0;
+		const void* data = section(name, size);
+		if (!data || size % sizeof(T) != 0) return nullptr;
+		count = (size_t)(size / sizeof(T));
+		return (const T*)data;
+	}
+};
+
+#endif
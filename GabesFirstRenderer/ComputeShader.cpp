@@ -8,10 +8,9 @@
 #include <iostream>
 #include <assert.h>
 
-ComputeShader::ComputeShader(const char* path, size_t ioSize)
+ComputeShader::ComputeShader(const char* path, size_t ioSize, const std::map<std::string, std::string>& defines, const std::map<std::string, std::string>& includes)
 {
     // 1. retrieve the vertex/fragment source code from filePath
-    std::string computeCode;
     std::ifstream cShaderFile;
     // ensure ifstream objects can throw exceptions:
     cShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -25,17 +24,49 @@ ComputeShader::ComputeShader(const char* path, size_t ioSize)
         // close file handlers
         cShaderFile.close();
         // convert stream into string
-        computeCode = cShaderStream.str();
+        _source = cShaderStream.str();
     }
     catch (std::ifstream::failure& e)
     {
         std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
     }
-    const char* cShaderCode = computeCode.c_str();
 
     // 2. compile shaders
+    link(defines, includes);
+
+    inputSSBO = new Buffer(ioSize);
+    outputSSBO = new Buffer(ioSize);
+
+    glUseProgram(0);
+}
+
+void ComputeShader::link(const std::map<std::string, std::string>& defines, const std::map<std::string, std::string>& includes) {
+    std::string computeCode = _source;
+
+    // GLSL has no #include, the directive is only a marker for generated code
+    for (const auto& include : includes) {
+        std::string directive = "#include \"" + include.first + "\"";
+        size_t start = computeCode.find(directive);
+        if (start == std::string::npos) continue;
+        computeCode.replace(start, directive.size(), include.second);
+    }
+
+    for (const auto& define : defines) {
+        std::string directive = "#define " + define.first + " " + define.second;
+        size_t start = computeCode.find("#define " + define.first + " ");
+        if (start != std::string::npos) {
+            size_t end = computeCode.find('\n', start);
+            computeCode.replace(start, end == std::string::npos ? std::string::npos : end - start, directive);
+        }
+        else {
+            // #version has to stay the first line
+            size_t versionEnd = computeCode.find('\n', computeCode.find("#version"));
+            computeCode.insert(versionEnd == std::string::npos ? computeCode.size() : versionEnd + 1, directive + "\n");
+        }
+    }
+    const char* cShaderCode = computeCode.c_str();
+
     unsigned int compute;
-    // vertex shader
     compute = compile(cShaderCode, GL_COMPUTE_SHADER);
 
     // shader Program
@@ -44,13 +75,13 @@ ComputeShader::ComputeShader(const char* path, size_t ioSize)
     glLinkProgram(_ID);
     checkCompileErrors(_ID, "PROGRAM");
 
-    inputSSBO = new Buffer(ioSize);
-    outputSSBO = new Buffer(ioSize);
-
     // delete the shaders as they're linked into our program now and no longer necessary
     glDeleteShader(compute);
+}
 
-    glUseProgram(0);
+void ComputeShader::recompile(const std::map<std::string, std::string>& defines, const std::map<std::string, std::string>& includes) {
+    glDeleteProgram(_ID);
+    link(defines, includes);
 }
 
 unsigned int ComputeShader::compile(const char* shaderCode, int type) {
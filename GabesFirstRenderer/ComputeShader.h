@@ -1,10 +1,14 @@
 #pragma once
+#include <map>
 #include <string>
 #include "Buffer.h"
 
 class ComputeShader
 {
+    std::string _source;
+
     unsigned int compile(const char* shaderCode, int type);
+    void link(const std::map<std::string, std::string>& defines, const std::map<std::string, std::string>& includes);
 
 public:
     unsigned int _ID;
@@ -12,12 +16,19 @@ public:
     Buffer* inputSSBO;
     Buffer* outputSSBO;
 
-    ComputeShader(const char* path, size_t ioSize);
+    // Each entry of defines replaces the value of a matching #define in the source, or is added after #version.
+    // Each entry of includes replaces an #include "name" line with generated source.
+    ComputeShader(const char* path, size_t ioSize, const std::map<std::string, std::string>& defines = std::map<std::string, std::string>(),
+        const std::map<std::string, std::string>& includes = std::map<std::string, std::string>());
     ~ComputeShader() {
+        glDeleteProgram(_ID);
         delete inputSSBO;
         delete outputSSBO;
     }
 
+    // Rebuilds the program from the same source with new defines. Uniforms have to be set again afterwards.
+    void recompile(const std::map<std::string, std::string>& defines, const std::map<std::string, std::string>& includes = std::map<std::string, std::string>());
+
     void bind();
     void use();
     void checkCompileErrors(unsigned shader, std::string type, int duration = -1);
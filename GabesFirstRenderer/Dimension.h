@@ -0,0 +1,51 @@
+#ifndef DIMENSION_H
+#define DIMENSION_H
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+// Everything the simulator needs to know about the space it runs in. The neighbour
+// search visits the 3^Dim cells around a particle's own, offsets are folded at compile time.
+// Offsets are point symmetric, cellOffset(NeighbourCells - 1 - i) == -cellOffset(i), so the
+// cells after the centre one are a half stencil for pair traversal.
+template <int Dim>
+struct Dimension;
+
+template <>
+struct Dimension<2>
+{
+	typedef glm::vec2 Vec;
+	static const int NeighbourCells = 9;
+
+	// Same order as offsets2D in the compute shaders: rows top to bottom, left to right
+	static constexpr Vec cellOffset(int i) {
+		return Vec(float(i % 3 - 1), float(1 - i / 3));
+	}
+
+	// Must match HashCell2D in the compute shaders
+	static unsigned hashCell(const Vec& cell) {
+		unsigned a = (unsigned)cell.x * 15823;
+		unsigned b = (unsigned)cell.y * 9737333;
+		return (a + b);
+	}
+};
+
+template <>
+struct Dimension<3>
+{
+	typedef glm::vec3 Vec;
+	static const int NeighbourCells = 27;
+
+	static constexpr Vec cellOffset(int i) {
+		return Vec(float(i % 3 - 1), float(1 - (i / 3) % 3), float(i / 9 - 1));
+	}
+
+	static unsigned hashCell(const Vec& cell) {
+		unsigned a = (unsigned)cell.x * 15823;
+		unsigned b = (unsigned)cell.y * 9737333;
+		unsigned c = (unsigned)cell.z * 440817757;
+		return (a + b + c);
+	}
+};
+
+#endif
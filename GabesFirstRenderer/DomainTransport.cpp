@@ -0,0 +1,184 @@
+#include <iostream>
+#include "DomainTransport.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	class LocalTransport : public DomainTransport
+	{
+		LocalTransportGroup* _group;
+		int _rank;
+		int _size;
+
+	public:
+		LocalTransport(LocalTransportGroup* group, int rank, int size) : _group(group), _rank(rank), _size(size) {}
+
+		int rank() const override {
+			return _rank;
+		}
+
+		int size() const override {
+			return _size;
+		}
+
+		bool exchange(int peer, const std::vector<char>& outgoing, std::vector<char>& incoming) override {
+			_group->post(_rank, peer, outgoing);
+			_group->take(peer, _rank, incoming);
+			return true;
+		}
+	};
+}
+
+LocalTransportGroup::LocalTransportGroup(int ranks) {
+	_size = ranks;
+	for (int i = 0; i < ranks * ranks; i++) _mailboxes.push_back(new Mailbox());
+	for (int rank = 0; rank < ranks; rank++) _transports.push_back(new LocalTransport(this, rank, ranks));
+}
+
+LocalTransportGroup::~LocalTransportGroup() {
+	for (DomainTransport* transport : _transports) delete transport;
+	for (Mailbox* mailbox : _mailboxes) delete mailbox;
+}
+
+void LocalTransportGroup::post(int from, int to, const std::vector<char>& message) {
+	Mailbox* mailbox = _mailboxes[from * _size + to];
+	{
+		std::lock_guard<std::mutex> lock(mailbox->mutex);
+		mailbox->messages.push_back(message);
+	}
+	mailbox->arrived.notify_one();
+}
+
+void LocalTransportGroup::take(int from, int to, std::vector<char>& message) {
+	Mailbox* mailbox = _mailboxes[from * _size + to];
+	std::unique_lock<std::mutex> lock(mailbox->mutex);
+	mailbox->arrived.wait(lock, [&]() { return !mailbox->messages.empty(); });
+	message.swap(mailbox->messages.front());
+	mailbox->messages.pop_front();
+}
+
+#ifndef _WIN32
+SocketTransport* SocketTransport::spawn(int ranks) {
+	//Every pair gets a socket pair before forking, each process then keeps its own ends
+	std::vector<int> ends(ranks * ranks, -1);
+	for (int a = 0; a < ranks; a++) {
+		for (int b = a + 1; b < ranks; b++) {
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+				std::cout << "ERROR::SOCKET_TRANSPORT::SOCKETPAIR_FAILED" << std::endl;
+				for (int end : ends) if (end >= 0) close(end);
+				return nullptr;
+			}
+			ends[a * ranks + b] = pair[0];
+			ends[b * ranks + a] = pair[1];
+		}
+	}
+
+	int rank = 0;
+	std::vector<int> children;
+	for (int child = 1; child < ranks; child++) {
+		int pid = fork();
+		if (pid < 0) {
+			//A partial group can't run, the children already started are stopped before they use their sockets
+			std::cout << "ERROR::SOCKET_TRANSPORT::FORK_FAILED" << std::endl;
+			for (int started : children) kill(started, SIGKILL);
+			for (int started : children) waitpid(started, nullptr, 0);
+			for (int end : ends) if (end >= 0) close(end);
+			return nullptr;
+		}
+		if (pid == 0) {
+			rank = child;
+			children.clear();
+			break;
+		}
+		children.push_back(pid);
+	}
+
+	SocketTransport* transport = new SocketTransport(rank, ranks);
+	transport->_children = children;
+	for (int a = 0; a < ranks; a++) {
+		for (int b = 0; b < ranks; b++) {
+			int end = ends[a * ranks + b];
+			if (end < 0) continue;
+			if (a == rank) transport->_sockets[b] = end;
+			else close(end);
+		}
+	}
+	return transport;
+}
+
+SocketTransport::~SocketTransport() {
+	for (int socket : _sockets)
+		if (socket >= 0) close(socket);
+	for (int child : _children) waitpid(child, nullptr, 0);
+}
+
+bool SocketTransport::exchange(int peer, const std::vector<char>& outgoing, std::vector<char>& incoming) {
+	//Nothing of an earlier message may be left behind if this one fails
+	incoming.clear();
+	int socket = _sockets[peer];
+	//Each message is its length followed by the bytes
+	unsigned long long outgoingSize = outgoing.size();
+	unsigned long long incomingSize = 0;
+	size_t sent = 0, received = 0;
+	const size_t header = sizeof(unsigned long long);
+	const size_t outgoingTotal = header + outgoing.size();
+	size_t incomingTotal = header;
+
+	while (sent < outgoingTotal || received < incomingTotal) {
+		pollfd request = { socket, 0, 0 };
+		if (sent < outgoingTotal) request.events |= POLLOUT;
+		if (received < incomingTotal) request.events |= POLLIN;
+		if (poll(&request, 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			std::cout << "ERROR::SOCKET_TRANSPORT::POLL_FAILED" << std::endl;
+			incoming.clear();
+			return false;
+		}
+
+		if ((request.revents & POLLOUT) && sent < outgoingTotal) {
+			const char* data = sent < header ? (const char*)&outgoingSize + sent : outgoing.data() + (sent - header);
+			size_t length = sent < header ? header - sent : outgoingTotal - sent;
+			ssize_t written = send(socket, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (written > 0) sent += written;
+			else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				std::cout << "ERROR::SOCKET_TRANSPORT::SEND_FAILED" << std::endl;
+				incoming.clear();
+				return false;
+			}
+		}
+
+		if ((request.revents & (POLLIN | POLLHUP)) && received < incomingTotal) {
+			char* data = received < header ? (char*)&incomingSize + received : incoming.data() + (received - header);
+			size_t length = received < header ? header - received : incomingTotal - received;
+			ssize_t read = recv(socket, data, length, MSG_DONTWAIT);
+			if (read == 0) {
+				std::cout << "ERROR::SOCKET_TRANSPORT::PEER_CLOSED" << std::endl;
+				incoming.clear();
+				return false;
+			}
+			if (read > 0) {
+				received += read;
+				//Header complete, the rest of the message can be sized
+				if (received == header) {
+					incoming.resize(incomingSize);
+					incomingTotal = header + incomingSize;
+				}
+			}
+			else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				std::cout << "ERROR::SOCKET_TRANSPORT::RECEIVE_FAILED" << std::endl;
+				incoming.clear();
+				return false;
+			}
+		}
+	}
+	return true;
+}
+#endif
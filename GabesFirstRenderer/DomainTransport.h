@@ -0,0 +1,129 @@
+#ifndef DOMAIN_TRANSPORT_H
+#define DOMAIN_TRANSPORT_H
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Moves messages between the ranks of a decomposed simulation. Every exchange is a swap between
+// two ranks, both call exchange with each other in the same order.
+class DomainTransport
+{
+public:
+	virtual ~DomainTransport() {}
+
+	virtual int rank() const = 0;
+	virtual int size() const = 0;
+	// Sends outgoing to peer and blocks until peer's message has arrived in incoming. False if the link
+	// failed, incoming is then empty and the ranks can't carry on together.
+	virtual bool exchange(int peer, const std::vector<char>& outgoing, std::vector<char>& incoming) = 0;
+};
+
+// Ranks that are threads of one process, messages are handed over in shared memory
+class LocalTransportGroup
+{
+	struct Mailbox {
+		std::mutex mutex;
+		std::condition_variable arrived;
+		std::deque<std::vector<char>> messages;
+	};
+
+	int _size;
+	// One mailbox per sender and receiver, indexed from * size + to
+	std::vector<Mailbox*> _mailboxes;
+	std::vector<DomainTransport*> _transports;
+
+public:
+	LocalTransportGroup(int ranks);
+	~LocalTransportGroup();
+
+	LocalTransportGroup(const LocalTransportGroup&) = delete;
+	LocalTransportGroup& operator=(const LocalTransportGroup&) = delete;
+
+	// Owned by the group, hand one to each thread
+	DomainTransport* transport(int rank) const {
+		return _transports[rank];
+	}
+
+	void post(int from, int to, const std::vector<char>& message);
+	void take(int from, int to, std::vector<char>& message);
+};
+
+#ifndef _WIN32
+// Ranks that are processes on one host, each pair connected by a Unix domain socket
+class SocketTransport : public DomainTransport
+{
+	int _rank;
+	// Socket to each peer, -1 for this rank
+	std::vector<int> _sockets;
+	// Child processes, only rank 0 waits for them
+	std::vector<int> _children;
+
+	SocketTransport(int rank, int size) : _rank(rank), _sockets(size, -1) {}
+
+public:
+	// Forks ranks - 1 children connected to each other and to this process, and returns the transport of
+	// whichever process it returns in. The calling process is rank 0. nullptr if sockets or processes can't be made.
+	static SocketTransport* spawn(int ranks);
+	// Closes the sockets, rank 0 then waits for every child to exit
+	~SocketTransport();
+
+	int rank() const override {
+		return _rank;
+	}
+
+	int size() const override {
+		return (int)_sockets.size();
+	}
+
+	// Sends and receives at the same time, so two ranks swapping messages larger than the socket buffers can't deadlock
+	bool exchange(int peer, const std::vector<char>& outgoing, std::vector<char>& incoming) override;
+};
+#endif
+
+// Appends count values to a message
+template <typename T>
+void writeMessage(std::vector<char>& message, const T* values, size_t count) {
+	size_t offset = message.size();
+	message.resize(offset + count * sizeof(T));
+	if (count > 0) std::memcpy(message.data() + offset, values, count * sizeof(T));
+}
+
+// Reads values back in the order they were written. Reading past the end of the message reads nothing
+// and marks the reader failed.
+class MessageReader
+{
+	const std::vector<char>& _message;
+	size_t _offset = 0;
+	bool _failed = false;
+
+public:
+	MessageReader(const std::vector<char>& message) : _message(message) {}
+
+	template <typename T>
+	bool read(T* values, size_t count) {
+		if (_failed || count > (_message.size() - _offset) / sizeof(T)) {
+			_failed = true;
+			return false;
+		}
+		if (count > 0) std::memcpy(values, _message.data() + _offset, count * sizeof(T));
+		_offset += count * sizeof(T);
+		return true;
+	}
+
+	// A value initialised T once the message has run out
+	template <typename T>
+	T read() {
+		T value = T();
+		read(&value, 1);
+		return value;
+	}
+
+	bool failed() const {
+		return _failed;
+	}
+};
+
+#endif
@@ -0,0 +1,344 @@
+#include "FlipSolver.h"
+#include <algorithm>
+#include <cmath>
+#include <glm/common.hpp>
+
+// Bilinear footprint of a point on a grid of nodes, clamped to its edges
+struct Footprint {
+	int x0, y0, x1, y1;
+	float fx, fy;
+};
+
+static Footprint footprint(glm::vec2 local, int nodesX, int nodesY) {
+	Footprint f;
+	local = glm::clamp(local, glm::vec2(0.0f), glm::vec2(nodesX - 1, nodesY - 1));
+	f.x0 = std::min((int)local.x, std::max(nodesX - 2, 0));
+	f.y0 = std::min((int)local.y, std::max(nodesY - 2, 0));
+	f.x1 = std::min(f.x0 + 1, nodesX - 1);
+	f.y1 = std::min(f.y0 + 1, nodesY - 1);
+	f.fx = local.x - f.x0;
+	f.fy = local.y - f.y0;
+	return f;
+}
+
+static void splat(glm::vec2* faces, int facesX, int facesY, glm::vec2 local, float value) {
+	Footprint f = footprint(local, facesX, facesY);
+	faces[f.y0 * facesX + f.x0] += glm::vec2(value, 1.0f) * ((1 - f.fx) * (1 - f.fy));
+	faces[f.y0 * facesX + f.x1] += glm::vec2(value, 1.0f) * (f.fx * (1 - f.fy));
+	faces[f.y1 * facesX + f.x0] += glm::vec2(value, 1.0f) * ((1 - f.fx) * f.fy);
+	faces[f.y1 * facesX + f.x1] += glm::vec2(value, 1.0f) * (f.fx * f.fy);
+}
+
+FlipSolver::FlipSolver(float cellSize) {
+	_cellSize = cellSize;
+}
+
+unsigned FlipSolver::cellIndex(glm::vec2 position) const {
+	glm::vec2 local = (position - _origin) / _cellSize;
+	int x = glm::clamp((int)std::floor(local.x), 0, _cellsX - 1);
+	int y = glm::clamp((int)std::floor(local.y), 0, _cellsY - 1);
+	return y * _cellsX + x;
+}
+
+void FlipSolver::resize(glm::vec2 origin, glm::vec2 size) {
+	_origin = origin;
+	int cellsX = std::max(1, (int)std::ceil(size.x / _cellSize));
+	int cellsY = std::max(1, (int)std::ceil(size.y / _cellSize));
+	if (cellsX == _cellsX && cellsY == _cellsY) return;
+
+	_cellsX = cellsX;
+	_cellsY = cellsY;
+	size_t cells = (size_t)cellsX * cellsY;
+	size_t facesU = (size_t)(cellsX + 1) * cellsY;
+	size_t facesV = (size_t)cellsX * (cellsY + 1);
+
+	_u.assign(facesU, 0.0f);
+	_previousU.assign(facesU, 0.0f);
+	_validU.assign(facesU, 0);
+	_v.assign(facesV, 0.0f);
+	_previousV.assign(facesV, 0.0f);
+	_validV.assign(facesV, 0);
+
+	_cellTypes.assign(cells, AIR);
+	_particlesPerCell.assign(cells, 0.0f);
+	_pressure.assign(cells, 0.0f);
+	_rhs.assign(cells, 0.0f);
+	_residual.assign(cells, 0.0f);
+	_preconditioned.assign(cells, 0.0f);
+	_search.assign(cells, 0.0f);
+	_product.assign(cells, 0.0f);
+}
+
+void FlipSolver::particlesToGrid(const glm::vec2* positions, const glm::vec2* velocities, unsigned count, JobSystem* jobs) {
+	_uSplat.begin((unsigned)_u.size(), jobs);
+	_vSplat.begin((unsigned)_v.size(), jobs);
+	_cellSplat.begin((unsigned)_particlesPerCell.size(), jobs);
+
+	parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+		glm::vec2* u = _uSplat.local();
+		glm::vec2* v = _vSplat.local();
+		float* cells = _cellSplat.local();
+		for (unsigned i = begin; i < end; i++) {
+			glm::vec2 local = (positions[i] - _origin) / _cellSize;
+			cells[cellIndex(positions[i])] += 1.0f;
+			//u sits on the left edge of each cell, v on the bottom edge
+			splat(u, _cellsX + 1, _cellsY, local - glm::vec2(0.0f, 0.5f), velocities[i].x);
+			splat(v, _cellsX, _cellsY + 1, local - glm::vec2(0.5f, 0.0f), velocities[i].y);
+		}
+	});
+
+	_uSplat.reduce(_cellGrainSize, [&](unsigned i, glm::vec2 total) {
+		_u[i] = total.y > 0 ? total.x / total.y : 0.0f;
+		_validU[i] = total.y > 0;
+	});
+	_vSplat.reduce(_cellGrainSize, [&](unsigned i, glm::vec2 total) {
+		_v[i] = total.y > 0 ? total.x / total.y : 0.0f;
+		_validV[i] = total.y > 0;
+	});
+	_cellSplat.reduce(_cellGrainSize, [&](unsigned i, float total) {
+		_particlesPerCell[i] = total;
+	});
+}
+
+void FlipSolver::classifyCells(const SDFGrid* boundary, JobSystem* jobs) {
+	parallelFor(jobs, 0, (unsigned)_cellTypes.size(), _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned c = begin; c < end; c++) {
+			glm::vec2 centre = _origin + (glm::vec2(c % _cellsX, c / _cellsX) + 0.5f) * _cellSize;
+			if (boundary && boundary->sample(centre) < 0)
+				_cellTypes[c] = SOLID;
+			else
+				_cellTypes[c] = _particlesPerCell[c] > 0 ? FLUID : AIR;
+		}
+	});
+
+	if (_restParticlesPerCell > 0) return;
+	glm::vec2 fluid = parallelReduce(jobs, 0, (unsigned)_cellTypes.size(), _cellGrainSize, glm::vec2(0.0f),
+		[&](unsigned begin, unsigned end) {
+			glm::vec2 sum(0.0f);
+			for (unsigned c = begin; c < end; c++)
+				if (_cellTypes[c] == FLUID) sum += glm::vec2(_particlesPerCell[c], 1.0f);
+			return sum;
+		},
+		[](glm::vec2 a, glm::vec2 b) { return a + b; });
+	if (fluid.y > 0) _restParticlesPerCell = fluid.x / fluid.y;
+}
+
+void FlipSolver::applyLaplacian(const std::vector<float>& values, std::vector<float>& result, JobSystem* jobs) const {
+	parallelFor(jobs, 0, (unsigned)values.size(), _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned c = begin; c < end; c++) {
+			if (_cellTypes[c] != FLUID) {
+				result[c] = 0;
+				continue;
+			}
+			int x = c % _cellsX, y = c / _cellsX;
+			float sum = 0;
+			//Walls and solids take no part, air neighbours hold zero pressure
+			auto neighbour = [&](int nx, int ny) {
+				if (nx < 0 || ny < 0 || nx >= _cellsX || ny >= _cellsY) return;
+				unsigned n = ny * _cellsX + nx;
+				if (_cellTypes[n] == SOLID) return;
+				sum += values[c] - (_cellTypes[n] == FLUID ? values[n] : 0.0f);
+			};
+			neighbour(x - 1, y);
+			neighbour(x + 1, y);
+			neighbour(x, y - 1);
+			neighbour(x, y + 1);
+			result[c] = sum;
+		}
+	});
+}
+
+void FlipSolver::project(float deltaTime, JobSystem* jobs) {
+	const unsigned cells = (unsigned)_cellTypes.size();
+	auto isFluid = [&](int x, int y) {
+		return x >= 0 && y >= 0 && x < _cellsX && y < _cellsY && _cellTypes[y * _cellsX + x] == FLUID;
+	};
+	auto isOpen = [&](int x, int y) {
+		return x >= 0 && y >= 0 && x < _cellsX && y < _cellsY && _cellTypes[y * _cellsX + x] != SOLID;
+	};
+
+	//Velocities as splatted are the FLIP reference, walls and solids are closed before projecting
+	_previousU = _u;
+	_previousV = _v;
+	parallelFor(jobs, 0, (unsigned)_u.size(), _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned f = begin; f < end; f++) {
+			int x = f % (_cellsX + 1), y = f / (_cellsX + 1);
+			if (!isOpen(x - 1, y) || !isOpen(x, y)) _u[f] = 0;
+			if (isFluid(x - 1, y) || isFluid(x, y)) _validU[f] = 1;
+		}
+	});
+	parallelFor(jobs, 0, (unsigned)_v.size(), _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned f = begin; f < end; f++) {
+			int x = f % _cellsX, y = f / _cellsX;
+			if (!isOpen(x, y - 1) || !isOpen(x, y)) _v[f] = 0;
+			if (isFluid(x, y - 1) || isFluid(x, y)) _validV[f] = 1;
+		}
+	});
+
+	//Right hand side, the divergence to remove plus the outflow that empties part of any excess over the step
+	parallelFor(jobs, 0, cells, _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned c = begin; c < end; c++) {
+			int x = c % _cellsX, y = c / _cellsX;
+			int open = isOpen(x - 1, y) + isOpen(x + 1, y) + isOpen(x, y - 1) + isOpen(x, y + 1);
+			if (_cellTypes[c] != FLUID || open == 0) {
+				_rhs[c] = 0;
+				_pressure[c] = 0;
+				continue;
+			}
+			float divergence = _u[y * (_cellsX + 1) + x + 1] - _u[y * (_cellsX + 1) + x] + _v[(y + 1) * _cellsX + x] - _v[y * _cellsX + x];
+			float compression = _restParticlesPerCell > 0 ? std::max(_particlesPerCell[c] / _restParticlesPerCell - 1.0f, 0.0f) : 0.0f;
+			_rhs[c] = driftCorrection * compression * _cellSize / deltaTime - divergence;
+		}
+	});
+
+	auto dot = [&](const std::vector<float>& a, const std::vector<float>& b) {
+		return parallelReduce(jobs, 0, cells, _cellGrainSize, 0.0,
+			[&](unsigned begin, unsigned end) {
+				double sum = 0;
+				for (unsigned c = begin; c < end; c++) sum += (double)a[c] * b[c];
+				return sum;
+			},
+			[](double a, double b) { return a + b; });
+	};
+	auto maxAbs = [&](const std::vector<float>& a) {
+		return parallelReduce(jobs, 0, cells, _cellGrainSize, 0.0f,
+			[&](unsigned begin, unsigned end) {
+				float m = 0;
+				for (unsigned c = begin; c < end; c++) m = std::max(m, std::abs(a[c]));
+				return m;
+			},
+			[](float a, float b) { return std::max(a, b); });
+	};
+	//Jacobi preconditioner, the diagonal is the number of open neighbours
+	auto precondition = [&]() {
+		parallelFor(jobs, 0, cells, _cellGrainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned c = begin; c < end; c++) {
+				int x = c % _cellsX, y = c / _cellsX;
+				int open = isOpen(x - 1, y) + isOpen(x + 1, y) + isOpen(x, y - 1) + isOpen(x, y + 1);
+				_preconditioned[c] = _cellTypes[c] == FLUID && open > 0 ? _residual[c] / open : 0.0f;
+			}
+		});
+	};
+
+	//Preconditioned conjugate gradient from last step's pressure
+	_lastSolve = PressureSolveStats();
+	float scale = maxAbs(_rhs);
+	float targetResidual = scale * tolerance;
+	applyLaplacian(_pressure, _product, jobs);
+	parallelFor(jobs, 0, cells, _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned c = begin; c < end; c++) _residual[c] = _rhs[c] - _product[c];
+	});
+	float residual = maxAbs(_residual);
+
+	if (residual > targetResidual) {
+		precondition();
+		_search = _preconditioned;
+		double alignment = dot(_residual, _preconditioned);
+
+		while (_lastSolve.iterations < maxIterations) {
+			applyLaplacian(_search, _product, jobs);
+			double curvature = dot(_search, _product);
+			if (curvature <= 0) break;
+			float step = (float)(alignment / curvature);
+			parallelFor(jobs, 0, cells, _cellGrainSize, [&](unsigned begin, unsigned end) {
+				for (unsigned c = begin; c < end; c++) {
+					_pressure[c] += step * _search[c];
+					_residual[c] -= step * _product[c];
+				}
+			});
+			_lastSolve.iterations++;
+
+			residual = maxAbs(_residual);
+			if (residual <= targetResidual) break;
+
+			precondition();
+			double nextAlignment = dot(_residual, _preconditioned);
+			float beta = (float)(nextAlignment / alignment);
+			alignment = nextAlignment;
+			parallelFor(jobs, 0, cells, _cellGrainSize, [&](unsigned begin, unsigned end) {
+				for (unsigned c = begin; c < end; c++) _search[c] = _preconditioned[c] + beta * _search[c];
+			});
+		}
+	}
+	_lastSolve.residual = scale > 0 ? residual / scale : 0.0f;
+
+	//Subtract the pressure gradient from every open face next to fluid
+	auto pressureAt = [&](int x, int y) {
+		return isFluid(x, y) ? _pressure[y * _cellsX + x] : 0.0f;
+	};
+	parallelFor(jobs, 0, (unsigned)_u.size(), _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned f = begin; f < end; f++) {
+			int x = f % (_cellsX + 1), y = f / (_cellsX + 1);
+			if (isOpen(x - 1, y) && isOpen(x, y) && (isFluid(x - 1, y) || isFluid(x, y)))
+				_u[f] -= pressureAt(x, y) - pressureAt(x - 1, y);
+		}
+	});
+	parallelFor(jobs, 0, (unsigned)_v.size(), _cellGrainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned f = begin; f < end; f++) {
+			int x = f % _cellsX, y = f / _cellsX;
+			if (isOpen(x, y - 1) && isOpen(x, y) && (isFluid(x, y - 1) || isFluid(x, y)))
+				_v[f] -= pressureAt(x, y) - pressureAt(x, y - 1);
+		}
+	});
+}
+
+float FlipSolver::sampleFace(const std::vector<float>& values, const std::vector<unsigned char>& valid, int facesX, int facesY,
+	glm::vec2 local) const {
+	Footprint f = footprint(local, facesX, facesY);
+	unsigned corners[4] = {
+		(unsigned)(f.y0 * facesX + f.x0), (unsigned)(f.y0 * facesX + f.x1),
+		(unsigned)(f.y1 * facesX + f.x0), (unsigned)(f.y1 * facesX + f.x1)
+	};
+	float weights[4] = { (1 - f.fx) * (1 - f.fy), f.fx * (1 - f.fy), (1 - f.fx) * f.fy, f.fx * f.fy };
+
+	float sum = 0, totalWeight = 0;
+	for (int i = 0; i < 4; i++) {
+		if (!valid[corners[i]]) continue;
+		sum += values[corners[i]] * weights[i];
+		totalWeight += weights[i];
+	}
+	return totalWeight > 0 ? sum / totalWeight : 0.0f;
+}
+
+glm::vec2 FlipSolver::sampleFaces(const std::vector<float>& u, const std::vector<float>& v, glm::vec2 position) const {
+	glm::vec2 local = (position - _origin) / _cellSize;
+	return glm::vec2(
+		sampleFace(u, _validU, _cellsX + 1, _cellsY, local - glm::vec2(0.0f, 0.5f)),
+		sampleFace(v, _validV, _cellsX, _cellsY + 1, local - glm::vec2(0.5f, 0.0f)));
+}
+
+void FlipSolver::gridToParticles(const glm::vec2* positions, glm::vec2* velocities, unsigned count, JobSystem* jobs) const {
+	parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			glm::vec2 pic = sampleFaces(_u, _v, positions[i]);
+			glm::vec2 flip = velocities[i] + pic - sampleFaces(_previousU, _previousV, positions[i]);
+			velocities[i] = flip * flipRatio + pic * (1 - flipRatio);
+		}
+	});
+}
+
+PressureSolveStats FlipSolver::step(const glm::vec2* positions, glm::vec2* velocities, unsigned count, glm::vec2 origin, glm::vec2 size,
+	const SDFGrid* boundary, float deltaTime, JobSystem* jobs) {
+	resize(origin, size);
+	particlesToGrid(positions, velocities, count, jobs);
+	classifyCells(boundary, jobs);
+	project(deltaTime, jobs);
+	gridToParticles(positions, velocities, count, jobs);
+	return _lastSolve;
+}
+
+void FlipSolver::computeDensities(const glm::vec2* positions, unsigned count, float restDensity, float* densities, JobSystem* jobs) const {
+	float scale = _restParticlesPerCell > 0 ? restDensity / _restParticlesPerCell : 0.0f;
+	parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			densities[i] = scale > 0 ? _particlesPerCell[cellIndex(positions[i])] * scale : restDensity;
+	});
+}
+
+float* FlipSolver::getCells(const glm::vec2* positions, unsigned count, JobSystem* jobs) const {
+	float* cells = new float[count];
+	parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) cells[i] = (float)cellIndex(positions[i]);
+	});
+	return cells;
+}
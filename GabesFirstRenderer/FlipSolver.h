@@ -0,0 +1,93 @@
+#ifndef FLIP_SOLVER_H
+#define FLIP_SOLVER_H
+
+#include <vector>
+#include <glm/vec2.hpp>
+#include "JobSystem.h"
+#include "SDFGrid.h"
+#include "SPHSolver.h"
+#include "ImplicitPressureSolver.h"
+
+// Hybrid PIC/FLIP on a staggered (MAC) grid. Particles carry the velocity, each step it is splatted
+// onto the grid faces, made divergence free there with a pressure projection, and read back as a
+// blend of the projected velocity (PIC) and the particle's own velocity plus the grid's change (FLIP).
+// Costs scale with particles and cells rather than neighbour pairs, so far larger counts fit in a step.
+class FlipSolver
+{
+	enum CellType : unsigned char {
+		AIR,
+		FLUID,
+		SOLID
+	};
+
+	float _cellSize;
+	glm::vec2 _origin = glm::vec2(0.0f);
+	int _cellsX = 0;
+	int _cellsY = 0;
+
+	// Face velocities, u on the (cellsX + 1) * cellsY vertical faces and v on the cellsX * (cellsY + 1) horizontal ones
+	std::vector<float> _u, _v;
+	std::vector<float> _previousU, _previousV;
+	// 1 where a face borders fluid or received particle velocity, G2P only reads those
+	std::vector<unsigned char> _validU, _validV;
+
+	std::vector<unsigned char> _cellTypes;
+	std::vector<float> _particlesPerCell;
+	// Particles per fluid cell at rest, measured on the first step
+	float _restParticlesPerCell = 0;
+
+	// Pressure scaled by deltaTime / cellSize, kept as the next solve's first guess
+	std::vector<float> _pressure;
+	std::vector<float> _rhs, _residual, _preconditioned, _search, _product;
+	PressureSolveStats _lastSolve;
+
+	// P2G writes through per-thread grids so particles can be splatted without atomics,
+	// x is the weighted velocity and y the weight
+	ThreadAccumulator<glm::vec2> _uSplat, _vSplat;
+	ThreadAccumulator<float> _cellSplat;
+
+	// Particles per job for the transfers and cells per job for the grid passes
+	static const unsigned _grainSize = 2048;
+	static const unsigned _cellGrainSize = 4096;
+
+	unsigned cellIndex(glm::vec2 position) const;
+	void resize(glm::vec2 origin, glm::vec2 size);
+	void particlesToGrid(const glm::vec2* positions, const glm::vec2* velocities, unsigned count, JobSystem* jobs);
+	void classifyCells(const SDFGrid* boundary, JobSystem* jobs);
+	void project(float deltaTime, JobSystem* jobs);
+	void gridToParticles(const glm::vec2* positions, glm::vec2* velocities, unsigned count, JobSystem* jobs) const;
+	// Bilinear blend of the valid faces around position, offset is the face's position within its cell
+	glm::vec2 sampleFaces(const std::vector<float>& u, const std::vector<float>& v, glm::vec2 position) const;
+	float sampleFace(const std::vector<float>& values, const std::vector<unsigned char>& valid, int facesX, int facesY,
+		glm::vec2 local) const;
+	// Negative divergence of the pressure gradient, over the fluid cells
+	void applyLaplacian(const std::vector<float>& values, std::vector<float>& result, JobSystem* jobs) const;
+
+public:
+	// 0 is pure PIC, which is stable but smooths the flow out, 1 is pure FLIP, which keeps detail but gets noisy
+	float flipRatio = 0.95f;
+	// Stops once the largest remaining divergence is this fraction of the largest starting one
+	float tolerance = 1e-3f;
+	unsigned maxIterations = 300;
+	// Fraction of the excess in cells holding more particles than at rest that is pushed out each step,
+	// counters the drift that bunches particles up over time
+	float driftCorrection = 0.5f;
+
+	FlipSolver(float cellSize);
+
+	// Advances velocities by one step on a grid covering [origin, origin + size], whose edges are walls.
+	// Cells inside boundary are solid. Positions are left for the caller to integrate and collide.
+	PressureSolveStats step(const glm::vec2* positions, glm::vec2* velocities, unsigned count, glm::vec2 origin, glm::vec2 size,
+		const SDFGrid* boundary, float deltaTime, JobSystem* jobs = nullptr);
+
+	// restDensity scaled by how full each particle's cell was in the last step
+	void computeDensities(const glm::vec2* positions, unsigned count, float restDensity, float* densities, JobSystem* jobs = nullptr) const;
+	// Grid cell of each particle, for the renderer's cell colouring. The caller deletes the array.
+	float* getCells(const glm::vec2* positions, unsigned count, JobSystem* jobs = nullptr) const;
+
+	float getCellSize() const {
+		return _cellSize;
+	}
+};
+
+#endif
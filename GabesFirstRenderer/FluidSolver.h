@@ -0,0 +1,356 @@
+#ifndef FLUID_SOLVER_H
+#define FLUID_SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "ImplicitPressureSolver.h"
+#include "SPHSolver.h"
+#include "SparseBlockGrid.h"
+
+// Headless CPU fluid in a box, in 2 or 3 dimensions. Runs the same passes as the CPU
+// backend of ParticleSystem without any rendering, for 3D tanks and offline runs. Grid is the
+// neighbour structure, SparseBlockGridT<Dim> in place of the hash suits large open domains.
+template <int Dim, class Grid = SpatialHashMapT<Dim>>
+class FluidSolver
+{
+public:
+	typedef typename Dimension<Dim>::Vec Vec;
+
+	SPHParameters params;
+	SmoothingKernel kernel = SmoothingKernel::Spiky;
+	Vec gravity;
+	Vec boundsMin;
+	Vec boundsMax;
+	float collisionDamping = 0.95f;
+	PressureSolver pressureSolver = PressureSolver::EquationOfState;
+	ImplicitPressureSolver<Dim> implicitSolver;
+	// Iterations and residual of the last implicit solve
+	PressureSolveStats lastSolve;
+
+	// Adaptive resolution. Calm particles well inside the fluid merge in pairs of equal mass, and merged
+	// particles split again near the free surface or inside the detail region. While enabled the equation
+	// of state passes run with masses and per-particle radii, whatever pressureSolver is set to.
+	struct AdaptiveSettings
+	{
+		bool enabled = false;
+		// Merged particles hold at most 2^maxLevel unit masses
+		unsigned maxLevel = 3;
+		// Merged particles whose density drops below this fraction of the target, as it does within
+		// their radius of the surface, split
+		float splitDensity = 0.85f;
+		// Both particles of a merge must be at least this dense and slower than mergeSpeed
+		float mergeDensity = 0.95f;
+		float mergeSpeed = 50.0f;
+		// Particles within detailRadius of detailCentre, for example the camera's focus, stay at full resolution. 0 turns it off.
+		Vec detailCentre = Vec(0.0f);
+		float detailRadius = 0.0f;
+		// Steps between passes
+		unsigned interval = 10;
+	} adaptive;
+
+	struct AdaptiveStats
+	{
+		unsigned merges = 0;
+		unsigned splits = 0;
+	} lastAdapt;
+
+	FluidSolver(unsigned capacity, JobSystem* jobs = nullptr) : _hash(std::max(capacity, 1u)), _jobs(jobs) {
+		gravity = Vec(0.0f);
+		gravity.y = -9.8f;
+		boundsMin = Vec(0.0f);
+		boundsMax = Vec(500.0f);
+	}
+
+	FluidSolver(const FluidSolver&) = delete;
+	FluidSolver& operator=(const FluidSolver&) = delete;
+
+	unsigned count() const {
+		return (unsigned)_positions.size();
+	}
+
+	const Vec* positions() const {
+		return _positions.data();
+	}
+
+	const Vec* velocities() const {
+		return _velocities.data();
+	}
+
+	const float* densities() const {
+		return _densities.data();
+	}
+
+	// Unit masses each particle stands in for, 1 unless adaptive resolution merged it
+	const float* masses() const {
+		return _masses.data();
+	}
+
+	void addParticle(const Vec& position, const Vec& velocity = Vec(0.0f)) {
+		_positions.push_back(position);
+		_predictedPositions.push_back(position);
+		_velocities.push_back(velocity);
+		_densities.push_back(0.0f);
+		_nearDensities.push_back(0.0f);
+		_masses.push_back(1.0f);
+		_radii.push_back(params.smoothingRadius);
+
+		// Same geometric growth as the particle arrays
+		if (count() > _hash.count()) {
+			_hash.resize(std::max(count(), _hash.count() * 2));
+			_hashPlaced = false;
+		}
+	}
+
+	// Adds count particles at once. Every array is regrown and written with the job system's static partition,
+	// so with pinned workers each particle's pages sit on the node of the worker that steps it.
+	void addParticles(const Vec* positions, const Vec* velocities, unsigned count) {
+		unsigned first = this->count();
+		unsigned total = first + count;
+		placeArray(_positions, total, [&](unsigned i) { return i < first ? _positions[i] : positions[i - first]; });
+		placeArray(_predictedPositions, total, [&](unsigned i) { return i < first ? _predictedPositions[i] : positions[i - first]; });
+		placeArray(_velocities, total, [&](unsigned i) { return i < first ? _velocities[i] : (velocities ? velocities[i - first] : Vec(0.0f)); });
+		placeArray(_densities, total, [&](unsigned i) { return i < first ? _densities[i] : 0.0f; });
+		placeArray(_nearDensities, total, [&](unsigned i) { return i < first ? _nearDensities[i] : 0.0f; });
+		placeArray(_masses, total, [&](unsigned i) { return i < first ? _masses[i] : 1.0f; });
+		placeArray(_radii, total, [&](unsigned i) { return i < first ? _radii[i] : params.smoothingRadius; });
+
+		//The hash the constructor sized is placed the first time too, it may already be large enough for every particle
+		bool grow = total > _hash.count();
+		if (grow) _hash.resize(std::max(total, _hash.count() * 2));
+		if (grow || !_hashPlaced) {
+			_hash.firstTouch(_jobs);
+			_hashPlaced = true;
+		}
+		_mapStale = true;
+	}
+
+	void step(float deltaTime) {
+		unsigned n = count();
+		if (n == 0) return;
+
+		//Uniform per-particle work runs on the same static ranges addParticles placed the arrays with
+		parallelForStatic(_jobs, 0, n, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				_velocities[i] += gravity * deltaTime;
+				_predictedPositions[i] = _positions[i] + _velocities[i] * deltaTime;
+				//The implicit solve targets the density where particles will end up, which is inside the bounds
+				if (pressureSolver == PressureSolver::Implicit) {
+					_predictedPositions[i] = glm::clamp(_predictedPositions[i], boundsMin, boundsMax);
+					_velocities[i] = (_predictedPositions[i] - _positions[i]) / deltaTime;
+				}
+			}
+		});
+
+		//Merged particles are binned by radius in levels of their own
+		if (adaptive.enabled)
+			_levels.update(_predictedPositions.data(), _radii.data(), n, params.smoothingRadius, _jobs);
+		else if (_mapStale || _hash.needsRebuild(_predictedPositions.data(), n, params.smoothingRadius, _jobs)) {
+			_hash.updateMap(_predictedPositions.data(), n, params.smoothingRadius, _jobs);
+			_mapStale = false;
+		}
+
+		withDensityKernel(kernel, [&](auto densityKernel) {
+			typedef decltype(densityKernel) DensityKernel;
+			if (adaptive.enabled) {
+				computeDensitiesVariable<Dim, DensityKernel>(_levels, _predictedPositions.data(), _masses.data(), _radii.data(), n,
+					_densities.data(), _nearDensities.data(), _jobs, _grainSize);
+				applyPressureAndViscosityVariable<Dim, DensityKernel>(_levels, _predictedPositions.data(), _masses.data(), _radii.data(),
+					_densities.data(), _nearDensities.data(), n, params, _velocities.data(), deltaTime, _scratch, _jobs, _grainSize);
+				return;
+			}
+
+			computeDensitiesPairwise<Dim, DensityKernel>(_hash, _predictedPositions.data(), n, params, nullptr,
+				_densities.data(), _nearDensities.data(), _scratch, _jobs, _grainSize);
+
+			if (pressureSolver == PressureSolver::EquationOfState) {
+				applyPressureAndViscosityPairwise<Dim, DensityKernel>(_hash, _predictedPositions.data(), _densities.data(), _nearDensities.data(), n,
+					params, nullptr, nullptr, _velocities.data(), deltaTime, _scratch, _jobs, _grainSize);
+				return;
+			}
+
+			//Viscosity first, the implicit solve needs every other force already applied
+			if (params.viscosityStrength > 0) {
+				SPHParameters viscosityOnly = params;
+				viscosityOnly.pressureMultiplier = 0;
+				viscosityOnly.nearPressureMultiplier = 0;
+				applyPressureAndViscosityPairwise<Dim, DensityKernel>(_hash, _predictedPositions.data(), _densities.data(), _nearDensities.data(), n,
+					viscosityOnly, nullptr, nullptr, _velocities.data(), deltaTime, _scratch, _jobs, _grainSize);
+			}
+			lastSolve = implicitSolver.template solve<DensityKernel>(_hash, _predictedPositions.data(), _densities.data(), n,
+				params, nullptr, _velocities.data(), deltaTime, _jobs, _grainSize, [&](unsigned i, Vec& displacement) {
+					displacement = glm::clamp(_predictedPositions[i] + displacement, boundsMin, boundsMax) - _predictedPositions[i];
+				});
+		});
+
+		parallelForStatic(_jobs, 0, n, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				_positions[i] += _velocities[i] * deltaTime;
+				resolveCollisions(_positions[i], _velocities[i]);
+			}
+		});
+
+		if (adaptive.enabled && ++_stepsSinceAdapt >= adaptive.interval) {
+			_stepsSinceAdapt = 0;
+			adaptResolution();
+		}
+	}
+
+private:
+	static const unsigned _grainSize = 1024;
+
+	FirstTouchVector<Vec> _positions;
+	FirstTouchVector<Vec> _predictedPositions;
+	FirstTouchVector<Vec> _velocities;
+	FirstTouchVector<float> _densities;
+	FirstTouchVector<float> _nearDensities;
+	FirstTouchVector<float> _masses;
+	FirstTouchVector<float> _radii;
+	Grid _hash;
+	MultiLevelHashMapT<Dim> _levels;
+	SPHScratch<Dim> _scratch;
+	JobSystem* _jobs;
+
+	// Particles were added or removed since the map was built
+	bool _mapStale = false;
+	// addParticles has written the hash's arrays from the workers since it was last allocated
+	bool _hashPlaced = false;
+	unsigned _stepsSinceAdapt = 0;
+
+	enum AdaptAction : unsigned char {
+		KEEP,
+		SPLIT,
+		MERGE
+	};
+	std::vector<unsigned char> _actions;
+	// Particle absorbed into another, or the particle's own index when it survives
+	std::vector<unsigned> _mergedInto;
+
+	// Keeps the neighbour count of a unit particle, volume grows with mass
+	float radiusForMass(float mass) const {
+		return params.smoothingRadius * std::pow(mass, 1.0f / Dim);
+	}
+
+	// Distance between particles of this mass at the target density
+	float spacingForMass(float mass) const {
+		return std::pow(mass / params.targetDensity, 1.0f / Dim);
+	}
+
+	// Replaces array with size elements from value(i), each written by the worker whose static range holds it
+	template <typename T, typename Value>
+	void placeArray(FirstTouchVector<T>& array, unsigned size, Value value) {
+		FirstTouchVector<T> placed(size);
+		parallelForStatic(_jobs, 0, size, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) placed[i] = value(i);
+		});
+		array.swap(placed);
+	}
+
+	bool inDetailRegion(const Vec& position) const {
+		return adaptive.detailRadius > 0 && glm::length(position - adaptive.detailCentre) < adaptive.detailRadius;
+	}
+
+	// Decides in parallel from this step's densities, then pairs and rewrites the arrays on the calling thread.
+	// Neighbours are looked up around the predicted positions the map was built from.
+	void adaptResolution() {
+		unsigned n = count();
+		const float maxMass = (float)(1u << adaptive.maxLevel);
+		_actions.assign(n, KEEP);
+		_mergedInto.resize(n);
+
+		parallelFor(_jobs, 0, n, _grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				_mergedInto[i] = i;
+				bool detail = inDetailRegion(_positions[i]);
+				float densityRatio = _densities[i] / params.targetDensity;
+				if (_masses[i] > 1 && (detail || densityRatio < adaptive.splitDensity))
+					_actions[i] = SPLIT;
+				else if (!detail && _masses[i] < maxMass && densityRatio >= adaptive.mergeDensity
+					&& glm::length(_velocities[i]) < adaptive.mergeSpeed)
+					_actions[i] = MERGE;
+			}
+		});
+
+		//Each candidate takes its nearest unclaimed candidate of the same mass within one rest spacing and a half
+		AdaptiveStats stats;
+		for (unsigned i = 0; i < n; i++) {
+			if (_actions[i] != MERGE || _mergedInto[i] != i) continue;
+			float reach = spacingForMass(_masses[i]) * 1.5f;
+			float bestSqrDst = reach * reach;
+			unsigned partner = i;
+			_levels.forEachNeighbour(_predictedPositions[i], reach, [&](unsigned j, const Vec&, float sqrDst) {
+				if (j <= i || _actions[j] != MERGE || _mergedInto[j] != j || _masses[j] != _masses[i] || sqrDst >= bestSqrDst) return;
+				bestSqrDst = sqrDst;
+				partner = j;
+			});
+			if (partner == i) continue;
+
+			//Mass weighted, so momentum and the centre of mass carry over
+			float mass = _masses[i] + _masses[partner];
+			float wi = _masses[i] / mass, wj = _masses[partner] / mass;
+			_positions[i] = _positions[i] * wi + _positions[partner] * wj;
+			_velocities[i] = _velocities[i] * wi + _velocities[partner] * wj;
+			_masses[i] = mass;
+			_radii[i] = radiusForMass(mass);
+			_mergedInto[partner] = i;
+			_actions[i] = KEEP;
+			stats.merges++;
+		}
+
+		//Halves sit apart along an axis that turns with the level, so repeated splits spread out evenly
+		for (unsigned i = 0; i < n; i++) {
+			if (_actions[i] != SPLIT) continue;
+			float mass = _masses[i] * 0.5f;
+			Vec offset(0.0f);
+			offset[(int)std::log2(mass) % Dim] = spacingForMass(mass) * 0.5f;
+
+			_masses[i] = mass;
+			_radii[i] = radiusForMass(mass);
+			Vec velocity = _velocities[i];
+			Vec position = _positions[i];
+			_positions[i] = position - offset;
+			addParticle(position + offset, velocity);
+			_masses.back() = mass;
+			_radii.back() = _radii[i];
+			stats.splits++;
+		}
+
+		//Compact out the absorbed particles, everything appended by splits survives
+		unsigned kept = 0;
+		for (unsigned i = 0; i < count(); i++) {
+			if (i < n && _mergedInto[i] != i) continue;
+			if (kept != i) {
+				_positions[kept] = _positions[i];
+				_velocities[kept] = _velocities[i];
+				_masses[kept] = _masses[i];
+				_radii[kept] = _radii[i];
+			}
+			kept++;
+		}
+		_positions.resize(kept);
+		_predictedPositions.resize(kept);
+		_velocities.resize(kept);
+		_densities.resize(kept);
+		_nearDensities.resize(kept);
+		_masses.resize(kept);
+		_radii.resize(kept);
+
+		_mapStale = true;
+		lastAdapt = stats;
+	}
+
+	void resolveCollisions(Vec& position, Vec& velocity) const {
+		for (int axis = 0; axis < Dim; axis++) {
+			if (position[axis] < boundsMin[axis]) {
+				position[axis] = boundsMin[axis];
+				velocity[axis] *= -collisionDamping;
+			}
+			else if (position[axis] > boundsMax[axis]) {
+				position[axis] = boundsMax[axis];
+				velocity[axis] *= -collisionDamping;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef IMPLICIT_PRESSURE_SOLVER_H
+#define IMPLICIT_PRESSURE_SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Dimension.h"
+#include "JobSystem.h"
+#include "SPHKernels.h"
+#include "SPHSolver.h"
+#include "SpatialHashMap.h"
+
+// How pressure is found from density
+enum class PressureSolver
+{
+	// Stiff equation of state, pressure = (density - target) * pressureMultiplier
+	EquationOfState,
+	// Implicit incompressible SPH, pressures are solved so the next step lands on the target density
+	Implicit
+};
+
+// Outcome of one implicit solve
+struct PressureSolveStats
+{
+	unsigned iterations = 0;
+	// Mean compression left after the last iteration, relative to the target density
+	float residual = 0;
+};
+
+// Implicit incompressible SPH (IISPH). Builds the pressure Poisson equation over the
+// neighbour structure and relaxes it with weighted Jacobi, every particle updating in
+// parallel from the previous iterate. Pressures stay non-negative so free surfaces don't clump. Positions are the predicted ones and densities are
+// measured there, so they already carry every non-pressure force of the step. The solver
+// adds the pressure acceleration that brings them back to the target density.
+// Particles have unit mass, so densities are kernel sums and the rest density is params.targetDensity.
+template <int Dim>
+class ImplicitPressureSolver
+{
+	typedef typename Dimension<Dim>::Vec Vec;
+
+	struct Neighbour {
+		unsigned index;
+		// Gradient of the density kernel at the particle, pointing towards the neighbour
+		Vec gradient;
+	};
+
+	// Neighbours of particle i are _neighbours[_neighbourStart[i].._neighbourStart[i + 1])
+	std::vector<unsigned> _neighbourStart;
+	std::vector<Neighbour> _neighbours;
+
+	std::vector<Vec> _displacement;
+	// Displacement of a particle per unit of pressure around it, and its density per unit of pressure
+	std::vector<float> _reach;
+	std::vector<float> _bound;
+	// Kept between steps, half of the last solution starts the next solve
+	std::vector<float> _pressures;
+	std::vector<float> _nextPressures;
+	std::vector<float> _errors;
+
+public:
+	// Stops once the mean compression falls below tolerance, as a fraction of the target density
+	float tolerance = 0.01f;
+	unsigned minIterations = 2;
+	unsigned maxIterations = 100;
+	// Jacobi relaxation weight, convergent below 2
+	float relaxation = 1.5f;
+
+	// Pressure at each particle after the last solve
+	const float* pressures() const {
+		return _pressures.data();
+	}
+
+	template <class DensityKernel, class Grid>
+	PressureSolveStats solve(const Grid& hash, const Vec* positions, const float* densities, unsigned count,
+		const SPHParameters& params, const unsigned* awake, Vec* velocities, float deltaTime, JobSystem* jobs, unsigned grainSize) {
+		return solve<DensityKernel>(hash, positions, densities, count, params, awake, velocities, deltaTime, jobs, grainSize,
+			[](unsigned, Vec&) {});
+	}
+
+	// constrain(i, displacement) trims the displacement pressure would give particle i, so walls
+	// the solver can't see hold particles back instead of letting the fluid compress against them
+	template <class DensityKernel, class Grid, typename Constrain>
+	PressureSolveStats solve(const Grid& hash, const Vec* positions, const float* densities, unsigned count,
+		const SPHParameters& params, const unsigned* awake, Vec* velocities, float deltaTime, JobSystem* jobs, unsigned grainSize,
+		Constrain constrain) {
+		PressureSolveStats stats;
+		if (count == 0) return stats;
+
+		const float radius = params.smoothingRadius;
+		const float densityScale = kernelScale<DensityKernel, Dim>(radius);
+		const float restDensity = params.targetDensity;
+		const float dt2 = deltaTime * deltaTime;
+
+		resize(count);
+		buildNeighbours<DensityKernel>(hash, positions, count, radius, densityScale, jobs, grainSize);
+
+		//Bound on how far the density of each particle can move per unit of pressure, summed over every
+		//pressure it depends on. Relaxing against it instead of the diagonal alone keeps Jacobi convergent
+		//however many neighbours the smoothing radius takes in, the diagonal shrinks as the stencil widens.
+		parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				float invSqrDensity = 1.0f / (densities[i] * densities[i]);
+				float reach = 0;
+				for (unsigned n = _neighbourStart[i]; n < _neighbourStart[i + 1]; n++) {
+					unsigned j = _neighbours[n].index;
+					reach += glm::length(_neighbours[n].gradient) * (invSqrDensity + 1.0f / (densities[j] * densities[j]));
+				}
+				_reach[i] = dt2 * reach;
+				_pressures[i] *= 0.5f;
+			}
+		});
+
+		parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				float bound = 0;
+				for (unsigned n = _neighbourStart[i]; n < _neighbourStart[i + 1]; n++)
+					bound += glm::length(_neighbours[n].gradient) * (_reach[i] + _reach[_neighbours[n].index]);
+				_bound[i] = bound;
+			}
+		});
+
+		//Weighted Jacobi on the pressure Poisson equation
+		while (stats.iterations < maxIterations) {
+			parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+				for (unsigned i = begin; i < end; i++)
+					_displacement[i] = particleDisplacement(i, densities, dt2, constrain);
+			});
+
+			//Density each particle would reach after those displacements
+			parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+				for (unsigned i = begin; i < end; i++) {
+					float predicted = densities[i];
+					for (unsigned n = _neighbourStart[i]; n < _neighbourStart[i + 1]; n++)
+						predicted += glm::dot(_displacement[i] - _displacement[_neighbours[n].index], _neighbours[n].gradient);
+
+					float error = predicted - restDensity;
+					_errors[i] = std::max(error, 0.0f);
+
+					float pressure = 0;
+					if (_bound[i] > 0) pressure = _pressures[i] + relaxation * error / _bound[i];
+					_nextPressures[i] = std::max(pressure, 0.0f);
+				}
+			});
+			_pressures.swap(_nextPressures);
+			stats.iterations++;
+
+			float error = parallelReduce(jobs, 0, count, grainSize, 0.0f,
+				[&](unsigned begin, unsigned end) {
+					float sum = 0;
+					for (unsigned i = begin; i < end; i++) sum += _errors[i];
+					return sum;
+				},
+				[](float a, float b) { return a + b; });
+			stats.residual = error / count / restDensity;
+			if (stats.iterations >= minIterations && stats.residual < tolerance) break;
+		}
+
+		//Velocity change that carries each particle through its displacement under the solved pressures
+		parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				if (awake && !awake[i]) continue;
+				velocities[i] += particleDisplacement(i, densities, dt2, constrain) / deltaTime;
+			}
+		});
+
+		return stats;
+	}
+
+private:
+	// How far the current pressures move particle i over the step
+	template <typename Constrain>
+	Vec particleDisplacement(unsigned i, const float* densities, float dt2, Constrain& constrain) const {
+		float pressureTerm = _pressures[i] / (densities[i] * densities[i]);
+		Vec displacement(0.0f);
+		for (unsigned n = _neighbourStart[i]; n < _neighbourStart[i + 1]; n++) {
+			unsigned j = _neighbours[n].index;
+			displacement -= _neighbours[n].gradient * (pressureTerm + _pressures[j] / (densities[j] * densities[j]));
+		}
+		displacement *= dt2;
+		constrain(i, displacement);
+		return displacement;
+	}
+
+	void resize(unsigned count) {
+		//New particles start without pressure. Removal doesn't move pressures, so a particle moved into a freed slot
+		//warm starts from whatever was last solved for that slot.
+		_pressures.resize(count, 0.0f);
+		_nextPressures.resize(count);
+		_displacement.resize(count);
+		_reach.resize(count);
+		_bound.resize(count);
+		_errors.resize(count);
+		_neighbourStart.resize(count + 1);
+	}
+
+	// Counts, offsets, then fills, so each particle writes its own run of the list
+	template <class DensityKernel, class Grid>
+	void buildNeighbours(const Grid& hash, const Vec* positions, unsigned count, float radius, float densityScale,
+		JobSystem* jobs, unsigned grainSize) {
+		parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				unsigned neighbours = 0;
+				hash.forEachNeighbour(positions, positions[i], radius, [&](unsigned j, const Vec&, float) {
+					if (j != i) neighbours++;
+				});
+				_neighbourStart[i + 1] = neighbours;
+			}
+		});
+
+		_neighbourStart[0] = 0;
+		for (unsigned i = 0; i < count; i++) _neighbourStart[i + 1] += _neighbourStart[i];
+		_neighbours.resize(_neighbourStart[count]);
+
+		parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				unsigned n = _neighbourStart[i];
+				hash.forEachNeighbour(positions, positions[i], radius, [&](unsigned j, const Vec& offset, float sqrDst) {
+					if (j == i) return;
+					float dst = std::sqrt(sqrDst);
+					Vec gradient(0.0f);
+					if (dst > 0) gradient = offset * (-kernelDerivative<DensityKernel>(dst, radius, densityScale) / dst);
+					_neighbours[n++] = { j, gradient };
+				});
+			}
+		});
+	}
+};
+
+#endif
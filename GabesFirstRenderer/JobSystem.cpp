@@ -0,0 +1,260 @@
+#include "JobSystem.h"
+#include <algorithm>
+
+static thread_local unsigned t_workerIndex = 0;
+
+JobSystem::JobSystem(unsigned workerCount, ThreadPinning pinning) : _nextQueue(0), _queuedJobs(0), _stealableJobs(0), _stopping(false), _pinning(pinning), _startedWorkers(0), _unpinnedWorkers(0) {
+	if (workerCount == 0) {
+		unsigned hardwareThreads = std::thread::hardware_concurrency();
+		workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+	}
+
+	const NumaTopology& topology = NumaTopology::system();
+	_threadNodes.assign(workerCount + 1, 0);
+	if (pinning != ThreadPinning::None) {
+		for (unsigned i = 1; i <= workerCount; i++)
+			_threadNodes[i] = topology.nodeOfCpu(topology.cpuForWorker(i - 1, pinning));
+	}
+
+	// Queue 0 belongs to threads outside the pool, workers use 1..workerCount
+	for (unsigned i = 0; i <= workerCount; i++) {
+		_queues.push_back(new WorkerQueue());
+	}
+
+	for (unsigned i = 1; i <= workerCount; i++) {
+		_workers.emplace_back(&JobSystem::workerLoop, this, i);
+	}
+
+	// Wait for every worker to try pinning itself so unpinnedWorkers is final once we return
+	if (pinning != ThreadPinning::None) {
+		while (_startedWorkers.load() < workerCount) std::this_thread::yield();
+	}
+}
+
+JobSystem::~JobSystem() {
+	{
+		std::lock_guard<std::mutex> lock(_wakeMutex);
+		_stopping = true;
+	}
+	_wake.notify_all();
+
+	for (std::thread& worker : _workers) {
+		worker.join();
+	}
+
+	for (WorkerQueue* queue : _queues) {
+		delete queue;
+	}
+}
+
+unsigned JobSystem::threadCount() const {
+	return (unsigned)_workers.size() + 1;
+}
+
+unsigned JobSystem::currentThreadIndex() {
+	return t_workerIndex;
+}
+
+unsigned JobSystem::threadNode(unsigned threadIndex) const {
+	return threadIndex < _threadNodes.size() ? _threadNodes[threadIndex] : 0;
+}
+
+unsigned JobSystem::unpinnedWorkers() const {
+	return _unpinnedWorkers.load();
+}
+
+void JobSystem::workerLoop(unsigned index) {
+	t_workerIndex = index;
+	if (_pinning != ThreadPinning::None && !pinCurrentThread(NumaTopology::system().cpuForWorker(index - 1, _pinning)))
+		_unpinnedWorkers.fetch_add(1);
+	_startedWorkers.fetch_add(1);
+
+	WorkerQueue* own = _queues[index];
+	while (true) {
+		if (tryRunJob(index)) continue;
+
+		//Jobs pinned to other workers are no use to us, so only wake for our own or stealable ones
+		std::unique_lock<std::mutex> lock(_wakeMutex);
+		_wake.wait(lock, [this, own] { return _stopping || _stealableJobs.load() > 0 || own->queued.load() > 0; });
+		if (_stopping && _queuedJobs.load() <= 0) return;
+		if (_stopping && _stealableJobs.load() <= 0 && own->queued.load() <= 0) {
+			//Only other workers' pinned jobs are left to drain before shutdown
+			lock.unlock();
+			std::this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::push(Job job) {
+	// Workers feed their own deque so nested work stays cache-local,
+	// outside threads spread their jobs across the workers
+	unsigned queue = t_workerIndex;
+	if (queue == 0) {
+		queue = 1 + _nextQueue.fetch_add(1) % (unsigned)_workers.size();
+	}
+
+	pushTo(queue, job);
+}
+
+void JobSystem::pushTo(unsigned queue, Job job) {
+	{
+		std::lock_guard<std::mutex> lock(_queues[queue]->mutex);
+		_queues[queue]->jobs.push_back(job);
+		_queues[queue]->queued.fetch_add(1);
+	}
+	if (!job.pinned) _stealableJobs.fetch_add(1);
+	_queuedJobs.fetch_add(1);
+}
+
+bool JobSystem::tryRunJob(unsigned homeQueue) {
+	Job job;
+	bool found = false;
+
+	// Newest job from our own queue first, it is the most likely to be in cache
+	{
+		WorkerQueue* own = _queues[homeQueue];
+		std::lock_guard<std::mutex> lock(own->mutex);
+		if (!own->jobs.empty()) {
+			job = own->jobs.back();
+			own->jobs.pop_back();
+			own->queued.fetch_sub(1);
+			found = true;
+		}
+	}
+
+	// Otherwise steal the oldest job from someone else
+	unsigned queueCount = (unsigned)_queues.size();
+	for (unsigned i = 1; i < queueCount && !found; i++) {
+		WorkerQueue* victim = _queues[(homeQueue + i) % queueCount];
+		std::lock_guard<std::mutex> lock(victim->mutex);
+		if (!victim->jobs.empty() && !victim->jobs.front().pinned) {
+			job = victim->jobs.front();
+			victim->jobs.pop_front();
+			victim->queued.fetch_sub(1);
+			found = true;
+		}
+	}
+
+	if (!found) return false;
+
+	if (!job.pinned) _stealableJobs.fetch_sub(1);
+	_queuedJobs.fetch_sub(1);
+	job.fn();
+	job.pending->fetch_sub(1);
+	return true;
+}
+
+void JobSystem::submit(const std::function<void()>& fn, std::atomic<int>& pending) {
+	pending.fetch_add(1);
+	push(Job{ fn, &pending });
+
+	{
+		std::lock_guard<std::mutex> lock(_wakeMutex);
+	}
+	_wake.notify_one();
+}
+
+void JobSystem::wait(std::atomic<int>& pending) {
+	while (pending.load() > 0) {
+		if (!tryRunJob(t_workerIndex)) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::parallelFor(unsigned begin, unsigned end, unsigned grainSize, const std::function<void(unsigned, unsigned)>& body) {
+	if (end <= begin) return;
+	if (grainSize == 0) grainSize = 1;
+
+	// A few chunks per thread leaves room for stealing to even out uneven work
+	unsigned count = end - begin;
+	unsigned chunks = std::min((count + grainSize - 1) / grainSize, threadCount() * 4);
+	if (chunks <= 1) {
+		body(begin, end);
+		return;
+	}
+	unsigned chunkSize = (count + chunks - 1) / chunks;
+
+	std::atomic<int> pending(0);
+	for (unsigned chunkBegin = begin + chunkSize; chunkBegin < end; chunkBegin += chunkSize) {
+		unsigned chunkEnd = std::min(end, chunkBegin + chunkSize);
+		pending.fetch_add(1);
+		push(Job{ [&body, chunkBegin, chunkEnd]() { body(chunkBegin, chunkEnd); }, &pending });
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_wakeMutex);
+	}
+	_wake.notify_all();
+
+	// The calling thread takes the first chunk itself
+	body(begin, std::min(end, begin + chunkSize));
+	wait(pending);
+}
+
+void JobSystem::parallelForStatic(unsigned begin, unsigned end, const std::function<void(unsigned, unsigned)>& body) {
+	if (end <= begin) return;
+
+	unsigned workers = (unsigned)_workers.size();
+	unsigned count = end - begin;
+	std::atomic<int> pending(0);
+	for (unsigned worker = 0; worker < workers; worker++) {
+		unsigned rangeBegin = begin + (unsigned)((unsigned long long)count * worker / workers);
+		unsigned rangeEnd = begin + (unsigned)((unsigned long long)count * (worker + 1) / workers);
+		if (rangeBegin == rangeEnd) continue;
+		pending.fetch_add(1);
+		Job job{ [&body, rangeBegin, rangeEnd]() { body(rangeBegin, rangeEnd); }, &pending };
+		job.pinned = true;
+		pushTo(worker + 1, job);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_wakeMutex);
+	}
+	_wake.notify_all();
+	wait(pending);
+}
+
+TaskGraph::~TaskGraph() {
+	for (Task* task : _tasks) {
+		delete task;
+	}
+}
+
+int TaskGraph::add(const std::function<void()>& fn) {
+	Task* task = new Task();
+	task->fn = fn;
+	task->remaining = 0;
+	_tasks.push_back(task);
+	return (int)_tasks.size() - 1;
+}
+
+void TaskGraph::precede(int before, int after) {
+	_tasks[before]->successors.push_back(after);
+	_tasks[after]->dependencies++;
+}
+
+void TaskGraph::schedule(JobSystem& jobs, int task, std::atomic<int>& pending) {
+	jobs.submit([this, &jobs, task, &pending]() {
+		_tasks[task]->fn();
+
+		for (int successor : _tasks[task]->successors) {
+			if (_tasks[successor]->remaining.fetch_sub(1) == 1)
+				schedule(jobs, successor, pending);
+		}
+	}, pending);
+}
+
+void TaskGraph::run(JobSystem& jobs) {
+	for (Task* task : _tasks) {
+		task->remaining = task->dependencies;
+	}
+
+	std::atomic<int> pending(0);
+	for (int i = 0; i < (int)_tasks.size(); i++) {
+		if (_tasks[i]->dependencies == 0)
+			schedule(jobs, i, pending);
+	}
+
+	jobs.wait(pending);
+}
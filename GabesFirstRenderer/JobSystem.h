@@ -0,0 +1,143 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "NumaTopology.h"
+
+// Work-stealing thread pool. Each worker owns a deque: it pops its own jobs LIFO
+// and steals the oldest jobs of other workers when it runs dry. Threads that wait
+// on a batch help run queued jobs instead of blocking, so nested parallelFor calls
+// never spawn extra threads and the pool never oversubscribes the machine.
+class JobSystem
+{
+	struct Job {
+		std::function<void()> fn;
+		std::atomic<int>* pending;
+		// Only runs on the worker it was queued for, see parallelForStatic
+		bool pinned = false;
+	};
+
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<Job> jobs;
+		// Mirrors jobs.size() so a sleeping worker can check its own queue without the lock
+		std::atomic<int> queued{ 0 };
+	};
+
+	std::vector<std::thread> _workers;
+	std::vector<WorkerQueue*> _queues;
+	std::atomic<unsigned> _nextQueue;
+	std::atomic<int> _queuedJobs;
+	// Queued jobs that any worker may steal, the rest are pinned to their queue's worker
+	std::atomic<int> _stealableJobs;
+	std::atomic<bool> _stopping;
+
+	std::mutex _wakeMutex;
+	std::condition_variable _wake;
+
+	ThreadPinning _pinning;
+	// NUMA node of each pinned worker, indexed like currentThreadIndex
+	std::vector<unsigned> _threadNodes;
+	std::atomic<unsigned> _startedWorkers;
+	std::atomic<unsigned> _unpinnedWorkers;
+
+	void workerLoop(unsigned index);
+	void push(Job job);
+	void pushTo(unsigned queue, Job job);
+	bool tryRunJob(unsigned homeQueue);
+
+public:
+	// 0 workers uses one per hardware thread, minus the thread that submits work
+	JobSystem(unsigned workerCount = 0, ThreadPinning pinning = ThreadPinning::None);
+	~JobSystem();
+
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	// Workers plus the submitting thread
+	unsigned threadCount() const;
+	// 1..workerCount on pool threads, 0 on any other thread. Use to index per-thread scratch buffers.
+	static unsigned currentThreadIndex();
+	// NUMA node a thread is pinned to, 0 for threads outside the pool or when workers aren't pinned
+	unsigned threadNode(unsigned threadIndex) const;
+	// Workers the OS refused to pin, always 0 without pinning
+	unsigned unpinnedWorkers() const;
+
+	// Runs fn asynchronously, decrementing pending once it has finished
+	void submit(const std::function<void()>& fn, std::atomic<int>& pending);
+	// Blocks until pending reaches zero, running queued jobs in the meantime
+	void wait(std::atomic<int>& pending);
+
+	// Splits [begin, end) into chunks of at least grainSize and runs body(chunkBegin, chunkEnd) on each
+	void parallelFor(unsigned begin, unsigned end, unsigned grainSize, const std::function<void(unsigned, unsigned)>& body);
+	// Splits [begin, end) into one contiguous range per worker, in worker order, and runs each on its own worker
+	// with no stealing. A range always lands on the same thread, so arrays first written through this stay on the
+	// NUMA node of the threads that later read them the same way. The calling thread only waits.
+	void parallelForStatic(unsigned begin, unsigned end, const std::function<void(unsigned, unsigned)>& body);
+};
+
+// Runs serially on the calling thread when no job system is available
+inline void parallelFor(JobSystem* jobs, unsigned begin, unsigned end, unsigned grainSize, const std::function<void(unsigned, unsigned)>& body) {
+	if (jobs) {
+		jobs->parallelFor(begin, end, grainSize, body);
+	}
+	else if (begin < end) {
+		body(begin, end);
+	}
+}
+
+inline void parallelForStatic(JobSystem* jobs, unsigned begin, unsigned end, const std::function<void(unsigned, unsigned)>& body) {
+	if (jobs) {
+		jobs->parallelForStatic(begin, end, body);
+	}
+	else if (begin < end) {
+		body(begin, end);
+	}
+}
+
+// Reduces [begin, end) by running body(chunkBegin, chunkEnd) on each chunk and folding
+// the partial results together with combine. Chunks are folded in no particular order.
+template <typename T, typename Body, typename Combine>
+T parallelReduce(JobSystem* jobs, unsigned begin, unsigned end, unsigned grainSize, T identity, Body body, Combine combine) {
+	T result = identity;
+	std::mutex mutex;
+	parallelFor(jobs, begin, end, grainSize, [&](unsigned chunkBegin, unsigned chunkEnd) {
+		T partial = body(chunkBegin, chunkEnd);
+		std::lock_guard<std::mutex> lock(mutex);
+		result = combine(result, partial);
+	});
+	return result;
+}
+
+// A set of jobs with ordering constraints. A task is queued as soon as every task it
+// depends on has finished, so independent branches run concurrently.
+class TaskGraph
+{
+	struct Task {
+		std::function<void()> fn;
+		std::vector<int> successors;
+		int dependencies = 0;
+		std::atomic<int> remaining;
+	};
+
+	std::vector<Task*> _tasks;
+
+	void schedule(JobSystem& jobs, int task, std::atomic<int>& pending);
+
+public:
+	~TaskGraph();
+
+	int add(const std::function<void()>& fn);
+	// after will not start until before has finished
+	void precede(int before, int after);
+	// Runs the whole graph and returns once every task has finished. May be run repeatedly.
+	void run(JobSystem& jobs);
+};
+
+#endif
@@ -0,0 +1,14 @@
+#include "KernelTable.h"
+
+KernelTable::KernelTable(float radius, unsigned resolution, const std::function<glm::vec4(float)>& evaluate) {
+	resolution = std::max(resolution, 2u);
+	_radius = radius;
+	float sqrRadius = _radius * _radius;
+	_scale = (resolution - 1) / sqrRadius;
+
+	_values.resize(resolution);
+	for (unsigned i = 0; i < resolution; i++) {
+		float sqrDst = sqrRadius * i / (resolution - 1);
+		_values[i] = evaluate(std::sqrt(sqrDst));
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef KERNEL_TABLE_H
+#define KERNEL_TABLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include <glm/vec4.hpp>
+
+// The solver's kernels sampled at evenly spaced squared distances in [0, radius^2] and
+// linearly interpolated, so looking up a pair needs neither a sqrt nor any powers.
+// Laid out as vec4s so the same array is uploaded as is for the compute shaders.
+class KernelTable
+{
+	std::vector<glm::vec4> _values;
+	float _radius;
+	// Converts a squared distance to a fractional index
+	float _scale;
+
+public:
+	// evaluate returns density, near density and their derivatives at a distance
+	KernelTable(float radius, unsigned resolution, const std::function<glm::vec4(float)>& evaluate);
+
+	glm::vec4 sample(float sqrDst) const {
+		float x = sqrDst * _scale;
+		unsigned last = (unsigned)_values.size() - 1;
+		if (x >= last) return _values[last];
+
+		unsigned i = (unsigned)x;
+		float t = x - i;
+		return _values[i] + (_values[i + 1] - _values[i]) * t;
+	}
+
+	unsigned resolution() const {
+		return (unsigned)_values.size();
+	}
+
+	float scale() const {
+		return _scale;
+	}
+
+	const glm::vec4* data() const {
+		return _values.data();
+	}
+};
+
+#endif
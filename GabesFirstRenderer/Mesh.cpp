@@ -4,6 +4,7 @@
 Mesh::Mesh(float* vertices, int byteCount, Shader* shader) {
 	this->shader = shader;
 	_vertCount = byteCount / (3 * sizeof(float)); // Assuming 3 floats per vertex
+	_vertexData.assign(vertices, vertices + byteCount / sizeof(float));
 
 	glGenVertexArrays(1, &_vertices);
 	glGenBuffers(1, &_vbo);
@@ -28,6 +29,7 @@ Mesh::Mesh(float* vertices, int byteCount, Shader* shader) {
 
 Mesh::Mesh(float* vertices, int vByteCount, unsigned int* indices, int iByteCount, Shader* shader): Mesh(vertices, vByteCount, shader) {
 	_indCount = iByteCount / sizeof(unsigned int); // Number of indices
+	_indexData.assign(indices, indices + _indCount);
 
 	glBindVertexArray(_vertices);
 	glGenBuffers(1, &_indices);
@@ -36,6 +38,14 @@ Mesh::Mesh(float* vertices, int vByteCount, unsigned int* indices, int iByteCoun
 	glBindVertexArray(0);
 }
 
+const std::vector<float>& Mesh::getVertexData() const {
+	return _vertexData;
+}
+
+const std::vector<unsigned int>& Mesh::getIndexData() const {
+	return _indexData;
+}
+
 int Mesh::getIndCount() const {
 	return _indCount;
 }
@@ -1,6 +1,7 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <vector>
 #include "Shader.h"
 
 class Mesh {
@@ -13,6 +14,10 @@ class Mesh {
 
 	unsigned int _vbo;
 
+	// CPU copies for anything that needs the geometry, such as baking boundaries
+	std::vector<float> _vertexData;
+	std::vector<unsigned int> _indexData;
+
 public:
 	Shader* shader;
 	Mesh(float* vertices, int count, Shader* shader);
@@ -23,6 +28,10 @@ public:
 	unsigned int getIndices() const;
 	int getVertCount() const;
 	int getIndCount() const;
+	// 3 floats per vertex, as passed in
+	const std::vector<float>& getVertexData() const;
+	// Empty for meshes drawn without indices
+	const std::vector<unsigned int>& getIndexData() const;
 };
 
 #endif
\ No newline at end of file
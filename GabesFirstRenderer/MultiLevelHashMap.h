@@ -0,0 +1,147 @@
+#ifndef MULTI_LEVEL_HASH_MAP_H
+#define MULTI_LEVEL_HASH_MAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Dimension.h"
+#include "JobSystem.h"
+#include "SpatialHashMap.h"
+
+// Neighbour search for particles with their own smoothing radii. Particles are split into levels by
+// radius, each level spanning a factor of bandRatio, and every level is a SpatialHashMapT whose cells
+// fit the largest radius it holds. Small particles stay in small cells instead of being binned at
+// the largest radius in the scene, and a query only walks the cells of each level that the pair
+// support around it can reach.
+template <int Dim>
+class MultiLevelHashMapT
+{
+public:
+	typedef typename Dimension<Dim>::Vec Vec;
+
+private:
+	struct Level {
+		SpatialHashMapT<Dim>* map = nullptr;
+		// Particle index of each point binned in the level, and the point's position and radius
+		std::vector<unsigned> indices;
+		std::vector<Vec> points;
+		std::vector<float> radii;
+		// Largest radius in the level, also the size of its cells
+		float cellSize = 0;
+	};
+
+	std::vector<Level> _levels;
+	// Level of each particle at the last update
+	std::vector<unsigned char> _levelOf;
+	std::vector<unsigned char> _nextLevelOf;
+
+	// Particles per job when gathering and checking the levels
+	static const unsigned _grainSize = 2048;
+
+	unsigned levelForRadius(float radius, float baseRadius) const {
+		if (radius <= baseRadius) return 0;
+		//The small bias keeps radii that are exact multiples of the band on the band's lower side
+		float level = std::floor(std::log(radius / baseRadius) / std::log(bandRatio) + 1e-4f);
+		return std::min((unsigned)level, maxLevels - 1);
+	}
+
+public:
+	// Radii within this factor of each other share a level
+	float bandRatio = 2.0f;
+	unsigned maxLevels = 8;
+
+	MultiLevelHashMapT() {}
+
+	~MultiLevelHashMapT() {
+		for (Level& level : _levels) delete level.map;
+	}
+
+	unsigned levelCount() const {
+		return (unsigned)_levels.size();
+	}
+
+	unsigned levelSize(unsigned level) const {
+		return (unsigned)_levels[level].indices.size();
+	}
+
+	float levelCellSize(unsigned level) const {
+		return _levels[level].cellSize;
+	}
+
+	// Bins points by radius, levels start at baseRadius, the smallest radius expected. Particles are regathered
+	// every call, a level's map is only rebuilt when its membership changed or one of its points left its cell.
+	void update(const Vec* points, const float* radii, unsigned count, float baseRadius, JobSystem* jobs = nullptr) {
+		_nextLevelOf.resize(count);
+		parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++)
+				_nextLevelOf[i] = (unsigned char)levelForRadius(radii[i], baseRadius);
+		});
+
+		bool regrouped = _nextLevelOf != _levelOf;
+		if (regrouped) {
+			_levelOf.swap(_nextLevelOf);
+			unsigned levels = 0;
+			for (unsigned i = 0; i < count; i++) levels = std::max(levels, (unsigned)_levelOf[i] + 1);
+			for (unsigned l = levels; l < _levels.size(); l++) delete _levels[l].map;
+			_levels.resize(levels);
+
+			for (Level& level : _levels) level.indices.clear();
+			for (unsigned i = 0; i < count; i++) _levels[_levelOf[i]].indices.push_back(i);
+		}
+
+		for (Level& level : _levels) {
+			unsigned size = (unsigned)level.indices.size();
+			level.points.resize(size);
+			level.radii.resize(size);
+			parallelFor(jobs, 0, size, _grainSize, [&](unsigned begin, unsigned end) {
+				for (unsigned p = begin; p < end; p++) {
+					level.points[p] = points[level.indices[p]];
+					level.radii[p] = radii[level.indices[p]];
+				}
+			});
+			if (size == 0) continue;
+
+			float cellSize = *std::max_element(level.radii.begin(), level.radii.end());
+			bool resized = cellSize != level.cellSize;
+			level.cellSize = cellSize;
+
+			// Same geometric growth as the particle arrays
+			if (!level.map) level.map = new SpatialHashMapT<Dim>(size);
+			else if (size > level.map->count()) level.map->resize(std::max(size, level.map->count() * 2));
+
+			if (regrouped || resized || level.map->needsRebuild(level.points.data(), size, cellSize, jobs))
+				level.map->updateMap(level.points.data(), size, cellSize, jobs);
+		}
+	}
+
+	// Calls fn(particleIndex, offsetToNeighbour, sqrDistance) for every point within radius of position
+	template <typename Fn>
+	void forEachNeighbour(Vec position, float radius, Fn fn) const {
+		for (const Level& level : _levels) {
+			if (level.indices.empty()) continue;
+			level.map->forEachWithin(level.points.data(), position, radius, level.cellSize, [&](unsigned p, const Vec& offset, float sqrDst) {
+				fn(level.indices[p], offset, sqrDst);
+			});
+		}
+	}
+
+	// Calls fn(particleIndex, offsetToNeighbour, sqrDistance, supportRadius) for every point closer than the mean of
+	// radius and its own radius, the support SPH pairs of unequal radii share. Each level is searched only as far as
+	// its largest radius can take the support.
+	template <typename Fn>
+	void forEachInSupport(Vec position, float radius, Fn fn) const {
+		for (const Level& level : _levels) {
+			if (level.indices.empty()) continue;
+			float reach = (radius + level.cellSize) * 0.5f;
+			level.map->forEachWithin(level.points.data(), position, reach, level.cellSize, [&](unsigned p, const Vec& offset, float sqrDst) {
+				float support = (radius + level.radii[p]) * 0.5f;
+				if (sqrDst < support * support) fn(level.indices[p], offset, sqrDst, support);
+			});
+		}
+	}
+};
+
+typedef MultiLevelHashMapT<2> MultiLevelHashMap;
+typedef MultiLevelHashMapT<3> MultiLevelHashMap3D;
+
+#endif
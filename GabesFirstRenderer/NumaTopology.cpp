@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "NumaTopology.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef _WIN32
+// Parses a sysfs cpu list such as "0-7,16-23"
+static std::vector<unsigned> parseCpuList(const std::string& list) {
+	std::vector<unsigned> cpus;
+	std::stringstream stream(list);
+	std::string range;
+	while (std::getline(stream, range, ',')) {
+		if (range.empty() || range[0] < '0' || range[0] > '9') continue;
+		size_t dash = range.find('-');
+		unsigned first = (unsigned)std::stoul(range.substr(0, dash));
+		unsigned last = dash == std::string::npos ? first : (unsigned)std::stoul(range.substr(dash + 1));
+		for (unsigned cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+	}
+	return cpus;
+}
+#endif
+
+NumaTopology::NumaTopology() {
+#ifdef _WIN32
+	ULONG highestNode = 0;
+	if (GetNumaHighestNodeNumber(&highestNode)) {
+		for (USHORT node = 0; node <= highestNode; node++) {
+			GROUP_AFFINITY affinity;
+			if (!GetNumaNodeProcessorMaskEx(node, &affinity)) continue;
+			NumaNode numaNode = { node, {} };
+			for (unsigned bit = 0; bit < 64; bit++)
+				if (affinity.Mask & (1ull << bit)) numaNode.cpus.push_back(affinity.Group * 64 + bit);
+			if (!numaNode.cpus.empty()) _nodes.push_back(numaNode);
+		}
+	}
+#else
+	DIR* directory = opendir("/sys/devices/system/node");
+	if (directory) {
+		while (dirent* entry = readdir(directory)) {
+			std::string name = entry->d_name;
+			if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name[4] < '0' || name[4] > '9') continue;
+
+			std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+			std::string list;
+			if (!std::getline(file, list)) continue;
+			NumaNode node = { (unsigned)std::stoul(name.substr(4)), parseCpuList(list) };
+			if (!node.cpus.empty()) _nodes.push_back(node);
+		}
+		closedir(directory);
+	}
+	std::sort(_nodes.begin(), _nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+#endif
+
+	if (_nodes.empty()) {
+		NumaNode node = { 0, {} };
+		unsigned hardwareThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned cpu = 0; cpu < hardwareThreads; cpu++) node.cpus.push_back(cpu);
+		_nodes.push_back(node);
+	}
+}
+
+const NumaTopology& NumaTopology::system() {
+	static NumaTopology topology;
+	return topology;
+}
+
+unsigned NumaTopology::cpuForWorker(unsigned worker, ThreadPinning pinning) const {
+	if (pinning == ThreadPinning::Scatter) {
+		//Round-robin over the nodes, then along each node's cores
+		const NumaNode& node = _nodes[worker % _nodes.size()];
+		return node.cpus[(worker / _nodes.size()) % node.cpus.size()];
+	}
+
+	unsigned total = 0;
+	for (const NumaNode& node : _nodes) total += (unsigned)node.cpus.size();
+	worker %= total;
+	for (const NumaNode& node : _nodes) {
+		if (worker < node.cpus.size()) return node.cpus[worker];
+		worker -= (unsigned)node.cpus.size();
+	}
+	return 0;
+}
+
+unsigned NumaTopology::nodeOfCpu(unsigned cpu) const {
+	for (unsigned i = 0; i < _nodes.size(); i++)
+		if (std::find(_nodes[i].cpus.begin(), _nodes[i].cpus.end(), cpu) != _nodes[i].cpus.end()) return i;
+	return 0;
+}
+
+bool pinCurrentThread(unsigned cpu) {
+#ifdef _WIN32
+	GROUP_AFFINITY affinity = {};
+	affinity.Group = (WORD)(cpu / 64);
+	affinity.Mask = (KAFFINITY)1 << (cpu % 64);
+	return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
@@ -0,0 +1,82 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+// How JobSystem workers are bound to cores
+enum class ThreadPinning
+{
+	// Left to the scheduler
+	None,
+	// Worker i on the i-th core, filling one NUMA node before the next
+	Compact,
+	// Workers dealt round-robin across the nodes, so every socket's memory bandwidth is used from the start
+	Scatter
+};
+
+struct NumaNode
+{
+	unsigned id;
+	std::vector<unsigned> cpus;
+};
+
+// The machine's NUMA nodes and the logical processors on each. Machines the nodes can't be read
+// on, or that have only one, show up as a single node holding every hardware thread.
+class NumaTopology
+{
+	std::vector<NumaNode> _nodes;
+
+	NumaTopology();
+
+public:
+	static const NumaTopology& system();
+
+	unsigned nodeCount() const {
+		return (unsigned)_nodes.size();
+	}
+
+	const NumaNode& node(unsigned index) const {
+		return _nodes[index];
+	}
+
+	// Logical processor for the index-th pinned worker
+	unsigned cpuForWorker(unsigned worker, ThreadPinning pinning) const;
+	// Index of the node holding cpu
+	unsigned nodeOfCpu(unsigned cpu) const;
+};
+
+// Binds the calling thread to one logical processor, false where the platform refuses
+bool pinCurrentThread(unsigned cpu);
+
+// Allocator whose value-less construct leaves trivial types unwritten. Resizing a vector then doesn't
+// touch the new pages, and the operating system places each page on the node of the thread that first
+// writes it, see JobSystem::parallelForStatic.
+template <typename T>
+struct FirstTouchAllocator : std::allocator<T>
+{
+	template <typename U>
+	struct rebind {
+		typedef FirstTouchAllocator<U> other;
+	};
+
+	FirstTouchAllocator() = default;
+	template <typename U>
+	FirstTouchAllocator(const FirstTouchAllocator<U>&) {}
+
+	template <typename U>
+	void construct(U* pointer) {
+		::new ((void*)pointer) U;
+	}
+
+	template <typename U, typename... Args>
+	void construct(U* pointer, Args&&... args) {
+		::new ((void*)pointer) U(std::forward<Args>(args)...);
+	}
+};
+
+template <typename T>
+using FirstTouchVector = std::vector<T, FirstTouchAllocator<T>>;
+
+#endif
@@ -6,38 +6,41 @@
 #include "ComputeShader.h"
 #include <chrono>
 #include "BufferLayout.h"
-
-const extern float Poly6ScalingFactor = 1.0f;
-
-static float ViscosityKernel(float dst, float radius)
-{
-	if (dst < radius)
-	{
-		float v = radius * radius - dst * dst;
-		return v * v * v * Poly6ScalingFactor;
-	}
-	return 0;
-}
+#include "Checkpoint.h"
 
 ParticleSystem::ParticleSystem(int count, Shader* shader, float screenWidth, float screenHeight, float screenX, float screenY) {
 	this->shader = shader;
 	_particleCount = count;
+	_capacity = std::max(count, _minCapacity);
+	_vertexCapacity = _capacity;
+	_particleSteps = 0;
 	_screenWidth = screenWidth;
 	_screenHeight = screenHeight;
+	_prevScreenWidth = screenWidth;
+	_prevScreenHeight = screenHeight;
 	_windowPosition = glm::vec2(screenX, screenY);
+	_viewPosition = _windowPosition;
+	_viewSize = glm::vec2(screenWidth, screenHeight);
+	_pendingWindowPosition = _viewPosition;
+	_pendingScreenSize = _viewSize;
 
-	_spatialHash = new SpatialHashMap(_particleCount);
+	_spatialHash = new SpatialHashMap(_capacity);
 
 	// Adjust gravity for screen space (example value for 600px height screen)
-	positions = new glm::vec2[_particleCount];
-	predictedPositions = new glm::vec2[_particleCount];
-	velocities = new glm::vec2[_particleCount];
-	densities = new float[_particleCount];
-	nearDensities = new float[_particleCount];
+	positions = new glm::vec2[_capacity];
+	predictedPositions = new glm::vec2[_capacity];
+	velocities = new glm::vec2[_capacity];
+	_stepStartVelocities = new glm::vec2[_capacity];
+	_awake = new unsigned[_capacity];
+	_calmFrames = new unsigned[_capacity];
+	_restDensities = new float[_capacity];
+	densities = new float[_capacity];
+	nearDensities = new float[_capacity];
 	
-	densityCompute = new ComputeShader("DensityKernel.comp", 0);
-	pressureCompute = new ComputeShader("PressureKernel.comp", 0);
-	hasherCompute = new ComputeShader("SpatialHasher.comp", 0);
+	setSmoothingKernel(SmoothingKernel::Spiky);
+	densityCompute = new ComputeShader("DensityKernel.comp", 0, kernelDefines(), kernelIncludes());
+	pressureCompute = new ComputeShader("PressureKernel.comp", 0, kernelDefines(), kernelIncludes());
+	hasherCompute = new ComputeShader("SpatialHasher.comp", 0, kernelDefines());
 
 	srand(0);
 	
@@ -105,9 +108,13 @@ ParticleSystem::ParticleSystem(int count, Shader* shader, float screenWidth, flo
 		//positions[i] = glm::vec2(random_float(0.0, _screenWidth), random_float(0.0f, _screenHeight));
 		predictedPositions[i] = glm::vec2(positions[i]);
 		velocities[i] = glm::vec2(0.0f, 0.0f);
+		_stepStartVelocities[i] = glm::vec2(0.0f, 0.0f);
+		_awake[i] = 1;
+		_calmFrames[i] = 0;
+		_restDensities[i] = 0;
 	}
 
-	_spatialHash->warmMap(positions, _particleCount, _smoothingRadius);
+	_spatialHash->warmMap(positions, _particleCount, _smoothingRadius, _jobs);
 
 	// Create and bind vertex array object
 	glGenVertexArrays(1, &_vao);
@@ -117,66 +124,138 @@ ParticleSystem::ParticleSystem(int count, Shader* shader, float screenWidth, flo
 	glGenBuffers(1, &_vertexBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
 
-	// Initialize buffer with data, specifying dynamic usage
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(glm::vec2), positions, GL_DYNAMIC_DRAW);
+	// Allocate for capacity, the renderer fills the buffers from the published snapshots
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(glm::vec2), nullptr, GL_DYNAMIC_DRAW);
 	// Set up vertex attributes for the positions
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
 	glEnableVertexAttribArray(0);
 
 	glGenBuffers(1, &_densityBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, _densityBuffer);
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(float), densities, GL_DYNAMIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
 	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);
 	glEnableVertexAttribArray(1);
 
 	glGenBuffers(1, &_gridBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, _gridBuffer);
-	float* cellValues = _spatialHash->getCells();
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(float), cellValues, GL_DYNAMIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
 	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);
 	glEnableVertexAttribArray(2);
-	delete cellValues;
 
 	glGenBuffers(1, &_velBuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, _velBuffer);
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(glm::vec2), velocities, GL_DYNAMIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(glm::vec2), nullptr, GL_DYNAMIC_DRAW);
 	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
 	glEnableVertexAttribArray(3);
 
+	setupComputeBuffers();
+	if (_particleCount > 0)
+		densityKernel(0.01f);
+
+	setWindowPosition(screenX, screenY);
+
+	// Give the renderer something to draw before the first step
+	float* cellValues = _spatialHash->getCells();
+	publishSnapshot(cellValues);
+	delete[] cellValues;
+
+	std::cout << "Particle System Initialized with:" << std::endl;
+	std::cout << "Screen dimensions: " << _screenWidth << "x" << _screenHeight << std::endl;
+	std::cout << "Particle count: " << _particleCount << std::endl;
+}
+
+int ParticleSystem::count() const {
+	return _particleCount;
+}
+
+int ParticleSystem::capacity() const {
+	return _capacity;
+}
+
+void ParticleSystem::addEmitter(const ParticleEmitter& emitter) {
+	_emitters.push_back(emitter);
+}
+
+void ParticleSystem::addSink(const ParticleSink& sink) {
+	_sinks.push_back(sink);
+}
+
+void ParticleSystem::ensureVertexCapacity(int count) {
+	if (count <= _vertexCapacity) return;
+
+	_vertexCapacity = std::max(count, _vertexCapacity * 2);
+	glBindBuffer(GL_ARRAY_BUFFER, _vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(glm::vec2), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, _densityBuffer);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, _gridBuffer);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, _velBuffer);
+	glBufferData(GL_ARRAY_BUFFER, _vertexCapacity * sizeof(glm::vec2), nullptr, GL_DYNAMIC_DRAW);
+}
+
+template <typename T>
+static void growArray(T*& array, int count, int capacity) {
+	T* grown = new T[capacity];
+	std::copy(array, array + count, grown);
+	delete[] array;
+	array = grown;
+}
+
+std::map<std::string, std::string> ParticleSystem::kernelDefines() const {
+	std::map<std::string, std::string> defines;
+	// Buffer arrays are laid out for capacity, the kernels have to agree on their size
+	defines["ARRAY_GLOBAL_LIMIT"] = std::to_string(_capacity);
+	if (_kernelTable) {
+		defines["USE_KERNEL_TABLE"] = "1";
+		defines["KERNEL_TABLE_SIZE"] = std::to_string(_kernelTable->resolution());
+	}
+	return defines;
+}
+
+std::map<std::string, std::string> ParticleSystem::kernelIncludes() const {
+	std::map<std::string, std::string> includes;
+	switch (_smoothingKernel) {
+	case SmoothingKernel::Spiky: includes["SmoothingKernels.glsl"] = smoothingKernelsGLSL<SpikyPow2Kernel, NearDensityKernel, ViscosityKernel>(); break;
+	case SmoothingKernel::Poly6: includes["SmoothingKernels.glsl"] = smoothingKernelsGLSL<Poly6Kernel, NearDensityKernel, ViscosityKernel>(); break;
+	case SmoothingKernel::WendlandC2: includes["SmoothingKernels.glsl"] = smoothingKernelsGLSL<WendlandC2Kernel, NearDensityKernel, ViscosityKernel>(); break;
+	case SmoothingKernel::CubicSpline: includes["SmoothingKernels.glsl"] = smoothingKernelsGLSL<CubicSplineKernel, NearDensityKernel, ViscosityKernel>(); break;
+	}
+	return includes;
+}
+
+// Lays out the SSBOs for the current capacity and sets the uniforms that don't change per step
+void ParticleSystem::setupComputeBuffers() {
 	//Initialize density buffers
 	BufferLayout densityInLayout;
-	densityInLayout.addElement(sizeof(unsigned), 4, _particleCount, "spatialOffsets");
-	densityInLayout.addElement(sizeof(glm::vec2), 8, _particleCount, "predictedPositions");
-	densityInLayout.addElement(sizeof(glm::uvec4), 16, _particleCount, "spatialIndices");
+	densityInLayout.addElement(sizeof(unsigned), 4, _capacity, "spatialOffsets");
+	densityInLayout.addElement(sizeof(glm::vec2), 8, _capacity, "predictedPositions");
+	densityInLayout.addElement(sizeof(glm::uvec4), 16, _capacity, "spatialIndices");
 	densityCompute->inputSSBO->setLayout(densityInLayout);
 
 	BufferLayout densityOutLayout;
-	densityOutLayout.addElement(sizeof(float), 4, _particleCount, "densities");
-	densityOutLayout.addElement(sizeof(float), 4, _particleCount, "nearDensities");
+	densityOutLayout.addElement(sizeof(float), 4, _capacity, "densities");
+	densityOutLayout.addElement(sizeof(float), 4, _capacity, "nearDensities");
 	densityCompute->outputSSBO->setLayout(densityOutLayout);
 
 	//glBindBuffer(GL_SHADER_STORAGE_BUFFER, densityCompute->_ID
 	densityCompute->use();
 	//Initialize density uniforms
-	glUniform1f(glGetUniformLocation(densityCompute->_ID, "SpikyPow2ScalingFactor"), SpikyPow2ScalingFactor);
-	glUniform1f(glGetUniformLocation(densityCompute->_ID, "SpikyPow3ScalingFactor"), SpikyPow3ScalingFactor);
+	glUniform1f(glGetUniformLocation(densityCompute->_ID, "densityKernelScale"), _densityKernelScale);
+	glUniform1f(glGetUniformLocation(densityCompute->_ID, "nearDensityKernelScale"), _nearDensityKernelScale);
 	glUniform1f(glGetUniformLocation(densityCompute->_ID, "smoothingRadius"), _smoothingRadius);
 	glUniform1ui(glGetUniformLocation(densityCompute->_ID, "numParticles"), _particleCount);
-
-	densityKernel(0.01);
+	glUniform1ui(glGetUniformLocation(densityCompute->_ID, "tableSize"), _capacity);
 
 	//Initialize pressure buffers
 	BufferLayout pressureInLayout;
-	pressureInLayout.addElement(sizeof(glm::vec2), 8, _particleCount, "velocities");
-	pressureInLayout.addElement(sizeof(float), 4, _particleCount, "densities");
-	pressureInLayout.addElement(sizeof(float), 4, _particleCount, "nearDensities");
-	pressureInLayout.addElement(sizeof(unsigned), 4, _particleCount, "spatialOffsets");
-	pressureInLayout.addElement(sizeof(glm::vec2), 8, _particleCount, "predictedPositions");
-	pressureInLayout.addElement(sizeof(glm::uvec4), 16, _particleCount, "spatialIndices");
+	//Positions, the spatial map and densities are read straight from the density kernel's buffers
+	pressureInLayout.addElement(sizeof(glm::vec2), 8, _capacity, "velocities");
+	pressureInLayout.addElement(sizeof(unsigned), 4, _capacity, "awake");
 	pressureCompute->inputSSBO->setLayout(pressureInLayout);
 
 	BufferLayout pressureOutLayout;
-	pressureOutLayout.addElement(sizeof(glm::vec2), 8, _particleCount, "velocities");
+	pressureOutLayout.addElement(sizeof(glm::vec2), 8, _capacity, "velocities");
 	pressureCompute->outputSSBO->setLayout(pressureOutLayout);
 
 	pressureCompute->use();
@@ -184,36 +263,124 @@ ParticleSystem::ParticleSystem(int count, Shader* shader, float screenWidth, flo
 	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "nearPressureMultiplier"), _nearPressureMultiplier);
 	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "pressureMultiplier"), _pressureMultiplier);
 	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "targetDensity"), _targetDensity);
-	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "SpikyPow2DerivativeScalingFactor"), SpikyPow2DerivativeScalingFactor);
-	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "SpikyPow3DerivativeScalingFactor"), SpikyPow3DerivativeScalingFactor);
+	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "densityKernelScale"), _densityKernelScale);
+	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "nearDensityKernelScale"), _nearDensityKernelScale);
+	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "viscosityKernelScale"), kernelScale<ViscosityKernel>(_smoothingRadius));
 	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "smoothingRadius"), _smoothingRadius);
 	glUniform1ui(glGetUniformLocation(pressureCompute->_ID, "numParticles"), _particleCount);
+	glUniform1ui(glGetUniformLocation(pressureCompute->_ID, "tableSize"), _capacity);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
 	BufferLayout hashInLayout;
-	hashInLayout.addElement(sizeof(glm::vec2), 8, _particleCount, "predictedPositions");
+	hashInLayout.addElement(sizeof(glm::vec2), 8, _capacity, "predictedPositions");
 	hasherCompute->inputSSBO->setLayout(hashInLayout);
 
 
 	BufferLayout hashOutLayout;
-	hashOutLayout.addElement(sizeof(glm::uvec4), 16, _particleCount, "spatialIndices");
+	hashOutLayout.addElement(sizeof(glm::uvec4), 16, _capacity, "spatialIndices");
 	hasherCompute->outputSSBO->setLayout(hashOutLayout);
 
+	if (_kernelTable) {
+		if (!_kernelTableBuffer) _kernelTableBuffer = new Buffer(0);
+		BufferLayout tableLayout;
+		tableLayout.addElement(sizeof(glm::vec4), 16, _kernelTable->resolution(), "kernelTable");
+		_kernelTableBuffer->setLayout(tableLayout);
+		_kernelTableBuffer->write((void*)_kernelTable->data(), _kernelTable->resolution() * sizeof(glm::vec4));
+
+		densityCompute->use();
+		glUniform1f(glGetUniformLocation(densityCompute->_ID, "kernelTableScale"), _kernelTable->scale());
+		pressureCompute->use();
+		glUniform1f(glGetUniformLocation(pressureCompute->_ID, "kernelTableScale"), _kernelTable->scale());
+	}
+
 	hasherCompute->use();
 	glUniform1f(glGetUniformLocation(hasherCompute->_ID, "smoothingRadius"), _smoothingRadius);
 	glUniform1ui(glGetUniformLocation(hasherCompute->_ID, "numParticles"), _particleCount);
+	glUniform1ui(glGetUniformLocation(hasherCompute->_ID, "tableSize"), _capacity);
+}
 
-	setWindowPosition(screenX, screenY);
+void ParticleSystem::grow(int minCapacity) {
+	setCapacity(std::max(minCapacity, _capacity * 2));
+}
 
-	std::cout << "Particle System Initialized with:" << std::endl;
-	std::cout << "Screen dimensions: " << _screenWidth << "x" << _screenHeight << std::endl;
-	std::cout << "Particle count: " << _particleCount << std::endl;
+void ParticleSystem::setCapacity(int capacity) {
+	int kept = std::min(_particleCount, capacity);
+	growArray(positions, kept, capacity);
+	growArray(predictedPositions, kept, capacity);
+	growArray(velocities, kept, capacity);
+	growArray(_stepStartVelocities, kept, capacity);
+	growArray(densities, kept, capacity);
+	growArray(nearDensities, kept, capacity);
+	growArray(_awake, kept, capacity);
+	growArray(_calmFrames, kept, capacity);
+	growArray(_restDensities, kept, capacity);
+	_spatialHash->resize(capacity);
+	_capacity = capacity;
+
+	// Deferred to the next GPU dispatch, CPU systems may grow on a thread without a GL context
+	_kernelsStale = true;
 }
 
-int ParticleSystem::count() const {
-	return _particleCount;
+void ParticleSystem::spawnParticle(glm::vec2 position, glm::vec2 velocity) {
+	if (_particleCount == _capacity) grow(_particleCount + 1);
+
+	int i = _particleCount++;
+	positions[i] = position;
+	predictedPositions[i] = position;
+	velocities[i] = velocity;
+	_stepStartVelocities[i] = velocity;
+	densities[i] = 0;
+	nearDensities[i] = 0;
+	_awake[i] = 1;
+	_calmFrames[i] = 0;
+	_restDensities[i] = 0;
+}
+
+// Keeps the arrays dense by moving the last particle into the freed slot
+void ParticleSystem::removeParticle(int index) {
+	int last = --_particleCount;
+	positions[index] = positions[last];
+	predictedPositions[index] = predictedPositions[last];
+	velocities[index] = velocities[last];
+	_stepStartVelocities[index] = _stepStartVelocities[last];
+	densities[index] = densities[last];
+	nearDensities[index] = nearDensities[last];
+	_awake[index] = _awake[last];
+	_calmFrames[index] = _calmFrames[last];
+	_restDensities[index] = _restDensities[last];
+}
+
+void ParticleSystem::updateEmittersAndSinks(float deltaTime) {
+	for (ParticleEmitter& emitter : _emitters) {
+		emitter.accumulator += emitter.rate * deltaTime;
+		int spawnCount = (int)emitter.accumulator;
+		emitter.accumulator -= spawnCount;
+
+		// Grow once for the whole batch rather than per particle
+		if (_particleCount + spawnCount > _capacity) grow(_particleCount + spawnCount);
+
+		for (int i = 0; i < spawnCount; i++) {
+			float angle = random_float(0.0f, 2.0f * PI);
+			float distance = emitter.radius * std::sqrt(random_float(0.0f, 1.0f));
+			spawnParticle(emitter.position + glm::vec2(std::cos(angle), std::sin(angle)) * distance, emitter.velocity);
+		}
+	}
+
+	if (_sinks.empty()) return;
+
+	// Walk backwards so the particle swapped into a freed slot has already been checked
+	for (int i = _particleCount - 1; i >= 0; i--) {
+		for (const ParticleSink& sink : _sinks) {
+			if (positions[i].x >= sink.min.x && positions[i].x <= sink.max.x &&
+				positions[i].y >= sink.min.y && positions[i].y <= sink.max.y) {
+				removeParticle(i);
+				break;
+			}
+		}
+	}
 }
 
+
 unsigned int ParticleSystem::getVertices() const {
 	return _vao;
 }
@@ -226,13 +393,21 @@ unsigned int ParticleSystem::getDensityBuff() const {
 	return _densityBuffer;
 }
 
+unsigned int ParticleSystem::getGridBuff() const {
+	return _gridBuffer;
+}
+
+unsigned int ParticleSystem::getVelBuff() const {
+	return _velBuffer;
+}
+
 void ParticleSystem::updateProjectionMatrix() {
 	// Create view matrix that transforms from screen space to window space
 	glm::mat4 viewMatrix = glm::translate(glm::mat4(1.0f),
-		glm::vec3(-_windowPosition.x, -_windowPosition.y, 0.0f));
+		glm::vec3(-_viewPosition.x, -_viewPosition.y, 0.0f));
 
 	// Create orthographic projection for window space
-	_projectionMatrix = glm::ortho(0.0f, _screenWidth, 0.0f, _screenHeight);
+	_projectionMatrix = glm::ortho(0.0f, _viewSize.x, 0.0f, _viewSize.y);
 
 	// Combine projection and view matrices
 	glm::mat4 combined = _projectionMatrix * viewMatrix;
@@ -249,23 +424,41 @@ glm::vec2 ParticleSystem::externalForces(int particleIndex) {
 	return gravityAccel;
 }
 
-void ParticleSystem::densityKernel(float deltaTime) {
+void ParticleSystem::densityKernel(float deltaTime, bool readBack) {
+	if (_kernelsStale) {
+		// Reallocating the SSBOs drops their contents, everything is uploaded again below
+		densityCompute->recompile(kernelDefines(), kernelIncludes());
+		pressureCompute->recompile(kernelDefines(), kernelIncludes());
+		hasherCompute->recompile(kernelDefines());
+		setupComputeBuffers();
+		_mapUploaded = false;
+		_kernelsStale = false;
+	}
+
 	densityCompute->use();
 
-	densityCompute->inputSSBO->write(_spatialHash->_spatialOffsets, _particleCount * sizeof(unsigned), densityCompute->inputSSBO->getOffset("spatialOffsets"));
+	//The map only changes on a rebuild, substeps in between reuse the copy already on the GPU. Every bucket goes up,
+	//the kernels look keys up across the whole table.
+	if (!_mapUploaded) {
+		densityCompute->inputSSBO->write(_spatialHash->_spatialOffsets, _spatialHash->offsetBytes(), densityCompute->inputSSBO->getOffset("spatialOffsets"));
+		densityCompute->inputSSBO->write(_spatialHash->_spatialIndices, _spatialHash->entryBytes(), densityCompute->inputSSBO->getOffset("spatialIndices"));
+		_mapUploaded = true;
+	}
 	densityCompute->inputSSBO->write(predictedPositions, _particleCount * sizeof(glm::vec2), densityCompute->inputSSBO->getOffset("predictedPositions"));
-	densityCompute->inputSSBO->write(_spatialHash->_spatialIndices, _particleCount * sizeof(glm::uvec4), densityCompute->inputSSBO->getOffset("spatialIndices"));
 
 	glUniform1f(glGetUniformLocation(densityCompute->_ID, "deltaTime"), deltaTime);
+	glUniform1ui(glGetUniformLocation(densityCompute->_ID, "numParticles"), count());
+	setPeriodicUniforms(densityCompute);
 
 	densityCompute->bind();
+	if (_kernelTable) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, *_kernelTableBuffer);
 	glDispatchCompute(count(), 1, 1);
 	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
 
-	delete[] densities;
-	delete[] nearDensities;
-	densities = (float*)densityCompute->outputSSBO->read(sizeof(float) * count());
-	nearDensities = (float*)densityCompute->outputSSBO->read(sizeof(float) * count(), sizeof(float) * count());
+	if (!readBack) return;
+
+	densityCompute->outputSSBO->readInto(densities, sizeof(float) * count(), densityCompute->outputSSBO->getOffset("densities"));
+	densityCompute->outputSSBO->readInto(nearDensities, sizeof(float) * count(), densityCompute->outputSSBO->getOffset("nearDensities"));
 }
 
 void ParticleSystem::pressureKernel(float deltaTime) {
@@ -273,39 +466,274 @@ void ParticleSystem::pressureKernel(float deltaTime) {
 
 	// Write data to the buffer
 	pressureCompute->inputSSBO->write(velocities, count() * sizeof(glm::vec2), pressureCompute->inputSSBO->getOffset("velocities"));
-	pressureCompute->inputSSBO->write(densities, count() * sizeof(float), pressureCompute->inputSSBO->getOffset("densities"));
-	pressureCompute->inputSSBO->write(nearDensities, count() * sizeof(float), pressureCompute->inputSSBO->getOffset("nearDensities"));
-	pressureCompute->inputSSBO->write(_spatialHash->_spatialOffsets, count() * sizeof(unsigned), pressureCompute->inputSSBO->getOffset("spatialOffsets"));
-	pressureCompute->inputSSBO->write(predictedPositions, count() * sizeof(glm::vec2), pressureCompute->inputSSBO->getOffset("predictedPositions"));
-	pressureCompute->inputSSBO->write(_spatialHash->_spatialIndices, count() * sizeof(glm::uvec4), pressureCompute->inputSSBO->getOffset("spatialIndices"));
+	pressureCompute->inputSSBO->write(_awake, count() * sizeof(unsigned), pressureCompute->inputSSBO->getOffset("awake"));
 
 	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "deltaTime"), deltaTime);
+	glUniform1f(glGetUniformLocation(pressureCompute->_ID, "viscosityStrength"), _viscosityStrength);
+	setPeriodicUniforms(pressureCompute);
+	glUniform1ui(glGetUniformLocation(pressureCompute->_ID, "numParticles"), count());
 
 	pressureCompute->bind();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, *densityCompute->inputSSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, *densityCompute->outputSSBO);
+	if (_kernelTable) glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, *_kernelTableBuffer);
 	glDispatchCompute(count(), 1, 1);
 
 	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
 
-	delete[] velocities;
-	velocities = (glm::vec2*)pressureCompute->outputSSBO->read(sizeof(glm::vec2) * count());
+	pressureCompute->outputSSBO->readInto(velocities, sizeof(glm::vec2) * count());
+}
+
+SPHParameters ParticleSystem::sphParameters() const {
+	SPHParameters params;
+	params.smoothingRadius = _smoothingRadius;
+	params.targetDensity = _targetDensity;
+	params.pressureMultiplier = _pressureMultiplier;
+	params.nearPressureMultiplier = _nearPressureMultiplier;
+	params.viscosityStrength = _viscosityStrength;
+	return params;
+}
+
+void ParticleSystem::setSPHParameters(const SPHParameters& params) {
+	_smoothingRadius = params.smoothingRadius;
+	_targetDensity = params.targetDensity;
+	_pressureMultiplier = params.pressureMultiplier;
+	_nearPressureMultiplier = params.nearPressureMultiplier;
+	_viscosityStrength = params.viscosityStrength;
+
+	//Kernel scales and tables depend on the radius, and rebuilding them marks the GPU kernels stale so the uniforms are set again
+	setSmoothingKernel(_smoothingKernel);
+	//Cells are sized by the radius. A periodic domain recounts its cells, and the map is dropped either way so the
+	//next step rebuilds it.
+	updatePeriodicDomain();
+	_spatialHash->invalidate();
+	_mapUploaded = false;
+	//FLIP cells sized from the radius follow it, the grid is made again at the new size
+	if (_flip && _flipCellSize <= 0 && _flip->getCellSize() != _smoothingRadius / 4) setFluidMethod(FluidMethod::Flip);
+	//Rest densities were measured against the old target
+	wakeAll();
+}
+
+//The CPU passes are shared with FluidSolver, see SPHSolver.h and FluidSolver.h
+void ParticleSystem::densityKernelCPU() {
+	withDensityKernel(_smoothingKernel, [&](auto kernel) {
+		if (_symmetricPairs)
+			computeDensitiesPairwise<2, decltype(kernel), NearDensityKernel>(*_spatialHash, predictedPositions, count(), sphParameters(),
+				_kernelTable, densities, nearDensities, _scratch, _jobs, _grainSize);
+		else
+			computeDensities<2, decltype(kernel), NearDensityKernel>(*_spatialHash, predictedPositions, count(), sphParameters(),
+				_kernelTable, densities, nearDensities, _jobs, _grainSize);
+	});
+}
+
+void ParticleSystem::pressureKernelCPU(float deltaTime) {
+	withDensityKernel(_smoothingKernel, [&](auto kernel) {
+		if (_symmetricPairs)
+			applyPressureAndViscosityPairwise<2, decltype(kernel), NearDensityKernel, ViscosityKernel>(*_spatialHash, predictedPositions,
+				densities, nearDensities, count(), sphParameters(), _kernelTable, _awake, velocities, deltaTime, _scratch, _jobs, _grainSize);
+		else
+			applyPressureAndViscosity<2, decltype(kernel), NearDensityKernel, ViscosityKernel>(*_spatialHash, predictedPositions,
+				densities, nearDensities, count(), sphParameters(), _kernelTable, _awake, velocities, deltaTime, _scratch, _jobs, _grainSize);
+	});
+}
+
+void ParticleSystem::implicitPressureCPU(float deltaTime) {
+	//Viscosity alone through the usual pass, the solver adds pressure on top
+	SPHParameters params = sphParameters();
+	if (params.viscosityStrength > 0) {
+		SPHParameters viscosityOnly = params;
+		viscosityOnly.pressureMultiplier = 0;
+		viscosityOnly.nearPressureMultiplier = 0;
+		withDensityKernel(_smoothingKernel, [&](auto kernel) {
+			applyPressureAndViscosityPairwise<2, decltype(kernel), NearDensityKernel, ViscosityKernel>(*_spatialHash, predictedPositions,
+				densities, nearDensities, count(), viscosityOnly, _kernelTable, _awake, velocities, deltaTime, _scratch, _jobs, _grainSize);
+		});
+	}
+
+	withDensityKernel(_smoothingKernel, [&](auto kernel) {
+		_lastSolve = _implicitSolver.template solve<decltype(kernel)>(*_spatialHash, predictedPositions, densities, count(), params,
+			_awake, velocities, deltaTime, _jobs, _grainSize, [&](unsigned i, glm::vec2& displacement) {
+				displacement = clampToWindow(predictedPositions[i] + displacement) - predictedPositions[i];
+			});
+	});
+	_profiler.setCounter("Pressure iterations", _lastSolve.iterations);
+	_profiler.setCounter("Pressure residual", _lastSolve.residual);
+}
+
+void ParticleSystem::setPressureSolver(PressureSolver solver, float tolerance, unsigned maxIterations) {
+	_pressureSolver = solver;
+	_implicitSolver.tolerance = tolerance;
+	_implicitSolver.maxIterations = maxIterations;
+	_lastSolve = PressureSolveStats();
+}
+
+void ParticleSystem::setFluidMethod(FluidMethod method, float cellSize) {
+	_fluidMethod = method;
+	_flipCellSize = cellSize;
+	delete _flip;
+	_flip = nullptr;
+	//About four particles per cell at the target density
+	if (method == FluidMethod::Flip) _flip = new FlipSolver(cellSize > 0 ? cellSize : _smoothingRadius / 4);
+	_lastSolve = PressureSolveStats();
+	_mapUploaded = false;
+	wakeAll();
+}
+
+void ParticleSystem::flipStep(float deltaTime, bool lastSubstep) {
+	auto start = std::chrono::high_resolution_clock::now();
+	_lastSolve = _flip->step(positions, velocities, count(), _windowPosition, glm::vec2(_screenWidth, _screenHeight), _boundary,
+		deltaTime, _jobs);
+	_flip->computeDensities(positions, count(), _targetDensity, densities, _jobs);
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+	_profiler.record("Pressure", duration.count());
+	_profiler.setCounter("Pressure iterations", _lastSolve.iterations);
+	_profiler.setCounter("Pressure residual", _lastSolve.residual);
+
+	start = std::chrono::high_resolution_clock::now();
+	integrate(deltaTime);
+	end = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+	_profiler.record("Positions", duration.count());
+
+	if (!lastSubstep) return;
+	float* cellValues = _flip->getCells(positions, count(), _jobs);
+	publishSnapshot(cellValues);
+	delete[] cellValues;
+}
+
+void ParticleSystem::setTimeStep(float fixedTimeStep, int maxSubsteps) {
+	_fixedTimeStep = fixedTimeStep;
+	_maxSubsteps = maxSubsteps;
+}
+
+void ParticleSystem::setAdaptiveTimeStep(bool enabled, float cflFactor, float forceFactor, float minStep, float maxStep) {
+	_adaptiveTimeStep = enabled;
+	_cflFactor = cflFactor;
+	_forceFactor = forceFactor;
+	_minTimeStep = minStep;
+	_maxTimeStep = maxStep;
+	_stableTimeStep = maxStep;
+}
+
+float ParticleSystem::computeStableTimeStep(float deltaTime) {
+	//Largest speed and acceleration over the step that just finished
+	glm::vec2 extremes = parallelReduce(_jobs, 0, count(), _grainSize, glm::vec2(0.0f),
+		[&](unsigned begin, unsigned end) {
+			float maxSqrSpeed = 0;
+			float maxSqrDeltaV = 0;
+			for (unsigned i = begin; i < end; i++) {
+				glm::vec2 deltaV = velocities[i] - _stepStartVelocities[i];
+				maxSqrSpeed = std::max(maxSqrSpeed, velocities[i].x * velocities[i].x + velocities[i].y * velocities[i].y);
+				maxSqrDeltaV = std::max(maxSqrDeltaV, deltaV.x * deltaV.x + deltaV.y * deltaV.y);
+			}
+			return glm::vec2(maxSqrSpeed, maxSqrDeltaV);
+		},
+		[](glm::vec2 a, glm::vec2 b) { return glm::vec2(std::max(a.x, b.x), std::max(a.y, b.y)); });
+
+	float maxSpeed = std::sqrt(extremes.x);
+	float maxAcceleration = std::sqrt(extremes.y) / deltaTime;
+
+	//CFL: no particle may cross more than a fraction of the smoothing radius per step
+	float timeStep = _maxTimeStep;
+	if (maxSpeed > 0)
+		timeStep = std::min(timeStep, _cflFactor * _smoothingRadius / maxSpeed);
+	//Force criterion: bounds the distance covered under the current acceleration
+	if (maxAcceleration > 0)
+		timeStep = std::min(timeStep, _forceFactor * std::sqrt(_smoothingRadius / maxAcceleration));
+
+	return std::max(timeStep, _minTimeStep);
+}
+
+unsigned long long ParticleSystem::getParticleSteps() const {
+	return _particleSteps.load();
 }
 
 void ParticleSystem::simulate(float deltaTime) {
-	printErrors();
-	int i;
+	if (needsGLContext()) printErrors();
+	applyPendingBounds();
+
+	//Consume the frame time in steps, carrying the remainder into the next frame
+	_accumulator += deltaTime;
+	float stepSize = _adaptiveTimeStep ? _stableTimeStep : _fixedTimeStep;
+	if (_accumulator > stepSize * _maxSubsteps) {
+		//Too far behind to catch up, drop the backlog instead of spiralling
+		_accumulator = stepSize * _maxSubsteps;
+	}
+	if (_accumulator < stepSize) return;
 
+	int substeps = 0;
+	float simulatedTime = 0;
 	auto start = std::chrono::high_resolution_clock::now();
-	//External Forces Kernel
-	for (i = 0; i < count(); i++) {
-		velocities[i] += externalForces(i) * deltaTime;
+	while (true) {
+		_accumulator -= stepSize;
+		simulatedTime += stepSize;
+		_simulationTime += stepSize;
+		substeps++;
+
+		//Decided up front since the last substep also reads back and publishes for the renderer
+		bool lastSubstep = substeps == _maxSubsteps || _accumulator < stepSize;
+		step(stepSize, lastSubstep);
+
+		if (lastSubstep) {
+			if (_adaptiveTimeStep) _stableTimeStep = computeStableTimeStep(stepSize);
+			break;
+		}
+
+		if (_adaptiveTimeStep) {
+			_stableTimeStep = computeStableTimeStep(stepSize);
+			//A step that grew past what is left still has to run so this frame gets published
+			stepSize = std::min(_stableTimeStep, _accumulator);
+		}
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
 
-		const float predictionFactor = 1 / 120;
-		//cout << velocities[i].x << ", " << velocities[i].y << endl;
-		predictedPositions[i] = positions[i] + velocities[i] * predictionFactor;
+	_particleSteps += (unsigned long long)substeps * count();
+	_profiler.setCounter("Substeps", substeps);
+	_profiler.setCounter("Time step", simulatedTime / substeps);
+	_profiler.setCounter("Particle steps/s", duration.count() > 0 ? (double)substeps * count() * 1e6 / duration.count() : 0.0);
+	if (needsGLContext()) printErrors();
+}
+
+void ParticleSystem::step(float deltaTime, bool lastSubstep) {
+	updateEmittersAndSinks(deltaTime);
+	if (count() == 0) {
+		if (lastSubstep) publishSnapshot(nullptr);
+		return;
 	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+	//External Forces Kernel
+	parallelFor(_jobs, 0, count(), _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			_stepStartVelocities[i] = velocities[i];
+			if (!_awake[i]) {
+				predictedPositions[i] = positions[i];
+				continue;
+			}
+			velocities[i] += externalForces(i) * deltaTime;
+
+			const float predictionFactor = 1 / 120;
+			//cout << velocities[i].x << ", " << velocities[i].y << endl;
+			predictedPositions[i] = positions[i] + velocities[i] * predictionFactor;
+
+			//The implicit solve corrects the density at the end of the step, where the walls hold particles in
+			if (_pressureSolver == PressureSolver::Implicit) {
+				predictedPositions[i] = clampToWindow(positions[i] + velocities[i] * deltaTime);
+				velocities[i] = (predictedPositions[i] - positions[i]) / deltaTime;
+			}
+		}
+	});
 	auto end = std::chrono::high_resolution_clock::now();
 	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-	std::cout << "External Forces: " << duration.count() << "ms" << std::endl;
+	_profiler.record("External Forces", duration.count());
+
+	//The grid replaces the neighbour search, density and pressure passes
+	if (_fluidMethod == FluidMethod::Flip) {
+		flipStep(deltaTime, lastSubstep);
+		return;
+	}
 
 	start = std::chrono::high_resolution_clock::now();
 	//Spatial Hash Kernel
@@ -315,52 +743,487 @@ void ParticleSystem::simulate(float deltaTime) {
 	glDispatchCompute(count(), 1, 1);
 	_spatialHash->_spatialIndices = (glm::uvec4*)hasherCompute->outputSSBO->read(_particleCount * sizeof(glm::uvec4));*/
 
-	_spatialHash->updateMap(predictedPositions, count(), _smoothingRadius);
+	//The map stays exact until a particle changes cell, so substeps in between skip the rebuild
+	if (_spatialHash->needsRebuild(predictedPositions, count(), _smoothingRadius, _jobs)) {
+		_spatialHash->updateMap(predictedPositions, count(), _smoothingRadius, _jobs);
+		_mapUploaded = false;
+	}
 	end = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-	std::cout << "Spatial Mapping: " << duration.count() << "ms" << std::endl;
+	_profiler.record("Spatial Mapping", duration.count());
+
+	if (_statsEnabled && lastSubstep) {
+		start = std::chrono::high_resolution_clock::now();
+		_spatialHash->gatherStats(predictedPositions, count(), _smoothingRadius, _statsSampleStride, _stats);
+		publishStats();
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+		_profiler.record("Statistics", duration.count());
+	}
 
 	start = std::chrono::high_resolution_clock::now();
-	//Density Kernel
-	densityKernel(deltaTime);
+	//Density Kernel, densities stay on the GPU for the pressure kernel and only come back for the renderer
+	bool implicitPressure = _pressureSolver == PressureSolver::Implicit;
+	if (_backend == SolverBackend::GPU && !implicitPressure)
+		densityKernel(deltaTime, lastSubstep);
+	else
+		densityKernelCPU();
 	end = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-	std::cout << "Density: " << duration.count() << "ms" << std::endl;
+	_profiler.record("Density", duration.count());
 	
+	//Densities are only back on the CPU on the last substep, so sleep is decided once per frame
+	if (_sleepEnabled && lastSubstep) {
+		start = std::chrono::high_resolution_clock::now();
+		updateSleepStates();
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+		_profiler.record("Sleep", duration.count());
+	}
+
 	start = std::chrono::high_resolution_clock::now();
 
-	//Pressure Kernel
-	pressureKernel(deltaTime);
+	//Pressure and viscosity share one neighbour pass over the densities computed above
+	if (implicitPressure)
+		implicitPressureCPU(deltaTime);
+	else if (_backend == SolverBackend::GPU)
+		pressureKernel(deltaTime);
+	else
+		pressureKernelCPU(deltaTime);
 	end = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-	std::cout << "Pressure: " << duration.count() << "ms" << std::endl;
-
-	//Viscosity Kernel
+	_profiler.record("Pressure", duration.count());
 
 	start = std::chrono::high_resolution_clock::now();
-	//Update Positions
-	for (i = 0; i < count(); i++) {
-		positions[i] +=	velocities[i] * (float)deltaTime;
-		resolveCollisions(&(positions[i]), &(velocities[i]));
+	//Update Positions, the cell values only depend on the spatial map so they are rebuilt alongside
+	if (!lastSubstep) {
+		integrate(deltaTime);
+		end = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+		_profiler.record("Positions", duration.count());
+		return;
+	}
+
+	float* cellValues = nullptr;
+	if (_jobs) {
+		TaskGraph graph;
+		graph.add([&]() { integrate(deltaTime); });
+		graph.add([&]() { cellValues = _spatialHash->getCells(_jobs); });
+		graph.run(*_jobs);
+	}
+	else {
+		integrate(deltaTime);
+		cellValues = _spatialHash->getCells();
 	}
 	end = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-	std::cout << "Positions: " << duration.count() << "ms" << std::endl;
+	_profiler.record("Positions", duration.count());
 
-	/* WRITE TO BUFFER */
-	glBindBuffer(GL_ARRAY_BUFFER, _gridBuffer);
-	float* cellValues = _spatialHash->getCells();
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(float), cellValues, GL_DYNAMIC_DRAW);
+	/* HAND OFF TO RENDERER */
+	publishSnapshot(cellValues);
+	delete[] cellValues;
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, _velBuffer);
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(glm::vec2), velocities, GL_DYNAMIC_DRAW);
+// Scalars of a checkpoint, stored as one section next to the arrays
+struct ParticleCheckpointState
+{
+	int particleCount;
+	int capacity;
+	float smoothingRadius;
+	float targetDensity;
+	float pressureMultiplier;
+	float nearPressureMultiplier;
+	float viscosityStrength;
+	int smoothingKernel;
+	glm::vec2 gravity;
+	glm::vec2 windowPosition;
+	glm::vec2 screenSize;
+	int periodicX;
+	int periodicY;
+	float accumulator;
+	float stableTimeStep;
+	unsigned long long particleSteps;
+	unsigned hashTableSize;
+	unsigned hashMappedCount;
+};
+
+bool ParticleSystem::saveCheckpoint(const std::string& path) const {
+	ParticleCheckpointState state = {};
+	state.particleCount = _particleCount;
+	state.capacity = _capacity;
+	state.smoothingRadius = _smoothingRadius;
+	state.targetDensity = _targetDensity;
+	state.pressureMultiplier = _pressureMultiplier;
+	state.nearPressureMultiplier = _nearPressureMultiplier;
+	state.viscosityStrength = _viscosityStrength;
+	state.smoothingKernel = (int)_smoothingKernel;
+	state.gravity = gravity;
+	state.windowPosition = _windowPosition;
+	state.screenSize = glm::vec2(_screenWidth, _screenHeight);
+	state.periodicX = _periodicX;
+	state.periodicY = _periodicY;
+	state.accumulator = _accumulator;
+	state.stableTimeStep = _stableTimeStep;
+	state.particleSteps = _particleSteps.load();
+	state.hashTableSize = _spatialHash->count();
+	state.hashMappedCount = _spatialHash->mappedCount();
+
+	CheckpointWriter writer;
+	writer.add("state", &state, 1);
+	writer.add("pos", positions, _particleCount);
+	writer.add("predpos", predictedPositions, _particleCount);
+	writer.add("vel", velocities, _particleCount);
+	writer.add("stepvel", _stepStartVelocities, _particleCount);
+	writer.add("density", densities, _particleCount);
+	writer.add("neardens", nearDensities, _particleCount);
+	writer.add("awake", _awake, _particleCount);
+	writer.add("calm", _calmFrames, _particleCount);
+	writer.add("restdens", _restDensities, _particleCount);
+	writer.add("hashidx", _spatialHash->_spatialIndices, state.hashMappedCount);
+	writer.add("hashoffs", _spatialHash->_spatialOffsets, state.hashTableSize);
+	writer.add("hashcell", _spatialHash->_cellHashes, state.hashMappedCount);
+	return writer.write(path);
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, _densityBuffer);
-	glBufferData(GL_ARRAY_BUFFER, _particleCount * sizeof(float), densities, GL_DYNAMIC_DRAW);
-	printErrors();
+// Points values at a section of exactly count elements
+template <typename T>
+static bool checkpointArray(const CheckpointReader& reader, const char* name, size_t count, const T*& values) {
+	size_t found = 0;
+	values = reader.section<T>(name, found);
+	return values && found == count;
+}
+
+bool ParticleSystem::loadCheckpoint(const std::string& path) {
+	auto start = std::chrono::high_resolution_clock::now();
+	CheckpointReader reader;
+	if (!reader.open(path)) return false;
+
+	size_t stateCount = 0;
+	const ParticleCheckpointState* state = reader.section<ParticleCheckpointState>("state", stateCount);
+	if (!state || stateCount != 1 || state->particleCount < 0 || state->capacity < state->particleCount) {
+		std::cout << "ERROR::PARTICLE_SYSTEM::CHECKPOINT_STATE_MISSING: " << path << std::endl;
+		return false;
+	}
+	//Settled under other constants the particles would start out of equilibrium, worse than a fresh spawn
+	if (state->smoothingRadius != _smoothingRadius || state->targetDensity != _targetDensity
+		|| state->pressureMultiplier != _pressureMultiplier || state->nearPressureMultiplier != _nearPressureMultiplier
+		|| state->viscosityStrength != _viscosityStrength || state->gravity != gravity) {
+		std::cout << "ERROR::PARTICLE_SYSTEM::CHECKPOINT_PARAMETERS_DIFFER: " << path << std::endl;
+		return false;
+	}
+
+	//Everything is read straight out of the mapping, the only work is one copy into the particle arrays
+	size_t count = (size_t)state->particleCount;
+	const glm::vec2 *savedPositions, *savedPredicted, *savedVelocities, *savedStepVelocities;
+	const float *savedDensities, *savedNearDensities, *savedRestDensities;
+	const unsigned *savedAwake, *savedCalmFrames, *savedOffsets, *savedCellHashes;
+	const glm::uvec4* savedIndices;
+	bool complete = checkpointArray(reader, "pos", count, savedPositions)
+		&& checkpointArray(reader, "predpos", count, savedPredicted)
+		&& checkpointArray(reader, "vel", count, savedVelocities)
+		&& checkpointArray(reader, "stepvel", count, savedStepVelocities)
+		&& checkpointArray(reader, "density", count, savedDensities)
+		&& checkpointArray(reader, "neardens", count, savedNearDensities)
+		&& checkpointArray(reader, "awake", count, savedAwake)
+		&& checkpointArray(reader, "calm", count, savedCalmFrames)
+		&& checkpointArray(reader, "restdens", count, savedRestDensities)
+		&& checkpointArray(reader, "hashidx", state->hashMappedCount, savedIndices)
+		&& checkpointArray(reader, "hashoffs", state->hashTableSize, savedOffsets)
+		&& checkpointArray(reader, "hashcell", state->hashMappedCount, savedCellHashes);
+	if (!complete) {
+		std::cout << "ERROR::PARTICLE_SYSTEM::CHECKPOINT_INCOMPLETE: " << path << std::endl;
+		return false;
+	}
+
+	//The same capacity as when saved keeps the map's buckets valid
+	if (state->capacity != _capacity) setCapacity(std::max(state->capacity, _minCapacity));
+	_particleCount = (int)count;
+	std::copy(savedPositions, savedPositions + count, positions);
+	std::copy(savedPredicted, savedPredicted + count, predictedPositions);
+	std::copy(savedVelocities, savedVelocities + count, velocities);
+	std::copy(savedStepVelocities, savedStepVelocities + count, _stepStartVelocities);
+	std::copy(savedDensities, savedDensities + count, densities);
+	std::copy(savedNearDensities, savedNearDensities + count, nearDensities);
+	std::copy(savedAwake, savedAwake + count, _awake);
+	std::copy(savedCalmFrames, savedCalmFrames + count, _calmFrames);
+	std::copy(savedRestDensities, savedRestDensities + count, _restDensities);
+
+	if ((SmoothingKernel)state->smoothingKernel != _smoothingKernel) setSmoothingKernel((SmoothingKernel)state->smoothingKernel);
+	_windowPosition = state->windowPosition;
+	_screenWidth = _prevScreenWidth = state->screenSize.x;
+	_screenHeight = _prevScreenHeight = state->screenSize.y;
+	_periodicX = state->periodicX != 0;
+	_periodicY = state->periodicY != 0;
+	updatePeriodicDomain();
+	_accumulator = state->accumulator;
+	_stableTimeStep = state->stableTimeStep;
+	_particleSteps = state->particleSteps;
+
+	//A table saved at another size can't be taken over. The map is rebuilt from the restored positions instead,
+	//the snapshot below reads its cells.
+	if (!_spatialHash->restore(savedIndices, savedOffsets, savedCellHashes, state->hashTableSize, state->hashMappedCount))
+		_spatialHash->updateMap(predictedPositions, count, _smoothingRadius, _jobs);
+	_mapUploaded = false;
+
+	float* cellValues = _spatialHash->getCells(_jobs);
+	publishSnapshot(cellValues);
+	delete[] cellValues;
+
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "Checkpoint load: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms for "
+		<< _particleCount << " particles" << std::endl;
+	return true;
+}
+
+void ParticleSystem::publishSnapshot(const float* cellValues) {
+	ParticleSnapshot& snapshot = _snapshots.writeSlot();
+	// Reserving the whole capacity means the slots only reallocate when the system itself grows
+	if ((int)snapshot.positions.capacity() < _capacity) {
+		snapshot.positions.reserve(_capacity);
+		snapshot.velocities.reserve(_capacity);
+		snapshot.densities.reserve(_capacity);
+		snapshot.cellValues.reserve(_capacity);
+	}
+	snapshot.count = count();
+	snapshot.positions.assign(positions, positions + count());
+	snapshot.velocities.assign(velocities, velocities + count());
+	snapshot.densities.assign(densities, densities + count());
+	snapshot.cellValues.assign(cellValues, cellValues + (cellValues ? count() : 0));
+	_snapshots.publish();
+
+	if (_recorder) {
+		//Blocks only when the writer has fallen a whole pool of frames behind
+		auto start = std::chrono::high_resolution_clock::now();
+		_recorder->record((float)_simulationTime, positions, velocities, count());
+		auto end = std::chrono::high_resolution_clock::now();
+		_profiler.record("Recording", std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+	}
+}
+
+void ParticleSystem::applyPendingBounds() {
+	glm::vec2 windowPosition, screenSize;
+	{
+		std::lock_guard<std::mutex> lock(_boundsMutex);
+		if (!_boundsDirty) return;
+		windowPosition = _pendingWindowPosition;
+		screenSize = _pendingScreenSize;
+		_boundsDirty = false;
+	}
+
+	//Moving walls disturb the whole body
+	if (_sleepEnabled) wakeAll();
+
+	_prevScreenWidth = _screenWidth;
+	_prevScreenHeight = _screenHeight;
+	_windowPosition = windowPosition;
+	_screenWidth = screenSize.x;
+	_screenHeight = screenSize.y;
+
+	float width = _screenWidth;
+	float height = _screenHeight;
+	updatePeriodicDomain();
+
+	// Calculate the change in screen dimensions
+	float deltaWidth = width - _prevScreenWidth;
+	float deltaHeight = height - _prevScreenHeight;
+
+	// Calculate velocities for the "moving walls"
+	// Using small timestep to simulate wall movement
+	const float resizeTimeStep = 1.0f / 60.0f;
+	glm::vec2 wallVelocity(deltaWidth / resizeTimeStep, deltaHeight / resizeTimeStep);
+
+	// Update particles based on wall movement
+	parallelFor(_jobs, 0, count(), _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			// Handle right wall movement
+			if (!_periodicX && deltaWidth < 0 && positions[i].x > width) {
+				// Apply an impulse based on how far the wall has moved
+				float penetration = positions[i].x - width;
+				velocities[i].x = wallVelocity.x * 0.8f; // Scale factor for smoother interaction
+				positions[i].x = width - penetration * 0.1f; // Push particle slightly inside
+			}
+
+			// Handle bottom wall movement
+			if (!_periodicY && deltaHeight < 0 && positions[i].y > height) {
+				float penetration = positions[i].y - height;
+				velocities[i].y = wallVelocity.y * 0.8f;
+				positions[i].y = height - penetration * 0.1f;
+			}
+
+			// Ensure particles stay within bounds
+			resolveCollisions(&positions[i], &velocities[i]);
+
+			// Update predicted positions for next simulation step
+			predictedPositions[i] = positions[i] + velocities[i] * (1.0f / 120.0f);
+		}
+	});
+}
+
+void ParticleSystem::integrate(float deltaTime) {
+	parallelFor(_jobs, 0, count(), _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			if (!_awake[i]) continue;
+			positions[i] += velocities[i] * deltaTime;
+			resolveCollisions(&(positions[i]), &(velocities[i]));
+		}
+	});
+}
+
+//Near density is always the (h - r)^3 spike, see ParticleSystem::NearDensityKernel
+template <class DensityKernel>
+static KernelTable* makeKernelTable(float radius, float densityScale, float nearDensityScale, unsigned resolution) {
+	return new KernelTable(radius, resolution, [=](float dst) {
+		return glm::vec4(
+			kernelValue<DensityKernel>(dst, radius, densityScale),
+			kernelValue<SpikyPow3Kernel>(dst, radius, nearDensityScale),
+			kernelDerivative<DensityKernel>(dst, radius, densityScale),
+			kernelDerivative<SpikyPow3Kernel>(dst, radius, nearDensityScale));
+	});
+}
+
+void ParticleSystem::setSmoothingKernel(SmoothingKernel kernel) {
+	_smoothingKernel = kernel;
+	switch (kernel) {
+	case SmoothingKernel::Spiky: _densityKernelScale = kernelScale<SpikyPow2Kernel>(_smoothingRadius); break;
+	case SmoothingKernel::Poly6: _densityKernelScale = kernelScale<Poly6Kernel>(_smoothingRadius); break;
+	case SmoothingKernel::WendlandC2: _densityKernelScale = kernelScale<WendlandC2Kernel>(_smoothingRadius); break;
+	case SmoothingKernel::CubicSpline: _densityKernelScale = kernelScale<CubicSplineKernel>(_smoothingRadius); break;
+	}
+	_nearDensityKernelScale = kernelScale<NearDensityKernel>(_smoothingRadius);
+
+	//Tables hold the old kernel, rebuild them at the same resolution
+	if (_kernelTable) setKernelTableResolution(_kernelTable->resolution());
+	_kernelsStale = true;
+}
+
+void ParticleSystem::setKernelTableResolution(unsigned resolution) {
+	delete _kernelTable;
+	_kernelTable = nullptr;
+	if (resolution > 0) {
+		switch (_smoothingKernel) {
+		case SmoothingKernel::Spiky: _kernelTable = makeKernelTable<SpikyPow2Kernel>(_smoothingRadius, _densityKernelScale, _nearDensityKernelScale, resolution); break;
+		case SmoothingKernel::Poly6: _kernelTable = makeKernelTable<Poly6Kernel>(_smoothingRadius, _densityKernelScale, _nearDensityKernelScale, resolution); break;
+		case SmoothingKernel::WendlandC2: _kernelTable = makeKernelTable<WendlandC2Kernel>(_smoothingRadius, _densityKernelScale, _nearDensityKernelScale, resolution); break;
+		case SmoothingKernel::CubicSpline: _kernelTable = makeKernelTable<CubicSplineKernel>(_smoothingRadius, _densityKernelScale, _nearDensityKernelScale, resolution); break;
+		}
+	}
+	//The kernels are built with or without the table, picked up on the next GPU dispatch
+	_kernelsStale = true;
+}
+
+void ParticleSystem::enableSleeping(bool enabled, float speedThreshold, float densityChange, unsigned framesToSleep) {
+	_sleepEnabled = enabled;
+	_sleepSpeed = speedThreshold;
+	_sleepDensityChange = densityChange;
+	_framesToSleep = framesToSleep;
+	if (!enabled) wakeAll();
+}
+
+void ParticleSystem::wakeAll() {
+	parallelFor(_jobs, 0, count(), _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			_awake[i] = 1;
+			_calmFrames[i] = 0;
+		}
+	});
+}
+
+void ParticleSystem::updateSleepStates() {
+	float sqrSleepSpeed = _sleepSpeed * _sleepSpeed;
+	float maxDensityChange = _sleepDensityChange * _targetDensity;
+
+	unsigned awakeCount = parallelReduce(_jobs, 0, count(), _grainSize, 0u,
+		[&](unsigned begin, unsigned end) {
+			unsigned awake = 0;
+			for (unsigned i = begin; i < end; i++) {
+				bool disturbed = std::abs(densities[i] - _restDensities[i]) > maxDensityChange;
+
+				if (!_awake[i]) {
+					//A neighbour moving in or out shows up as a change in density
+					if (disturbed) {
+						_awake[i] = 1;
+						_calmFrames[i] = 0;
+						_restDensities[i] = densities[i];
+					}
+				}
+				else {
+					float sqrSpeed = velocities[i].x * velocities[i].x + velocities[i].y * velocities[i].y;
+					if (disturbed || sqrSpeed > sqrSleepSpeed)
+						_calmFrames[i] = 0;
+					else if (++_calmFrames[i] >= _framesToSleep) {
+						_awake[i] = 0;
+						velocities[i] = glm::vec2(0.0f);
+					}
+					_restDensities[i] = densities[i];
+				}
+
+				awake += _awake[i];
+			}
+			return awake;
+		},
+		[](unsigned a, unsigned b) { return a + b; });
+
+	_profiler.setCounter("Awake fraction", count() > 0 ? (double)awakeCount / count() : 1.0);
+}
+
+void ParticleSystem::publishStats() {
+	_profiler.setCounter("Neighbours (min)", _stats.minNeighbours);
+	_profiler.setCounter("Neighbours (mean)", _stats.meanNeighbours);
+	_profiler.setCounter("Neighbours (max)", _stats.maxNeighbours);
+	_profiler.setCounter("Hash mismatch ratio", _stats.hashMismatchRatio);
+	_profiler.setCounter("Occupied cells", _stats.occupiedCells);
+	_profiler.setCounter("Occupied buckets", _stats.occupiedBuckets);
+	_profiler.setCounter("Max bucket size", _stats.maxBucketSize);
+
+	for (int i = 0; i < BUCKET_HISTOGRAM_BINS; i++) {
+		unsigned lower = i == 0 ? 1 : (1u << (i - 1)) + 1;
+		unsigned upper = 1u << i;
+		std::string label = lower == upper ? std::to_string(upper) : std::to_string(lower) + "-" + std::to_string(upper);
+		if (i == BUCKET_HISTOGRAM_BINS - 1) label = ">" + std::to_string(lower - 1);
+		_profiler.setCounter("Buckets of size " + label, _stats.bucketHistogram[i]);
+	}
 }
 
 //TODO: offset collision detection by pixelRatio * particleRadius
+// Into [0, size)
+static float wrapCoordinate(float value, float size) {
+	value -= size * std::floor(value / size);
+	return value < size ? value : 0.0f;
+}
+
+void ParticleSystem::setPeriodic(bool x, bool y) {
+	_periodicX = x;
+	_periodicY = y;
+	updatePeriodicDomain();
+}
+
+// The domain follows the window, it is rebuilt whenever the bounds change
+void ParticleSystem::updatePeriodicDomain() {
+	if (_periodicX || _periodicY)
+		_spatialHash->setPeriodic(_windowPosition, glm::vec2(_screenWidth, _screenHeight), _smoothingRadius,
+			glm::vec2(_periodicX ? 1.0f : 0.0f, _periodicY ? 1.0f : 0.0f));
+	else
+		_spatialHash->clearPeriodic();
+}
+
+void ParticleSystem::setPeriodicUniforms(ComputeShader* shader) const {
+	glm::vec2 axes(_periodicX ? 1.0f : 0.0f, _periodicY ? 1.0f : 0.0f);
+	glm::vec2 size(_screenWidth, _screenHeight);
+	glm::vec2 cells = _spatialHash->periodCells();
+
+	glUniform1i(glGetUniformLocation(shader->_ID, "periodic"), _spatialHash->isPeriodic());
+	glUniform2f(glGetUniformLocation(shader->_ID, "periodicAxes"), axes.x, axes.y);
+	glUniform2f(glGetUniformLocation(shader->_ID, "periodMin"), _windowPosition.x, _windowPosition.y);
+	glUniform2f(glGetUniformLocation(shader->_ID, "periodSize"), size.x, size.y);
+	glUniform2f(glGetUniformLocation(shader->_ID, "periodCells"), cells.x, cells.y);
+}
+
+glm::vec2 ParticleSystem::clampToWindow(glm::vec2 position) const {
+	if (!_periodicX) position.x = glm::clamp(position.x, _windowPosition.x, _windowPosition.x + _screenWidth);
+	if (!_periodicY) position.y = glm::clamp(position.y, _windowPosition.y, _windowPosition.y + _screenHeight);
+	return position;
+}
+
 void ParticleSystem::resolveCollisions(glm::vec2* pos, glm::vec2* vel) {
 	const float damping = 0.95f;
 
@@ -370,7 +1233,11 @@ void ParticleSystem::resolveCollisions(glm::vec2* pos, glm::vec2* vel) {
 	float bottomBound = _windowPosition.y;
 	float topBound = _windowPosition.y + _screenHeight;
 
-	if (pos->x < leftBound) {
+	//Periodic axes wrap with the velocity untouched
+	if (_periodicX) {
+		pos->x = leftBound + wrapCoordinate(pos->x - leftBound, _screenWidth);
+	}
+	else if (pos->x < leftBound) {
 		pos->x = leftBound;
 		vel->x *= -damping;
 	}
@@ -379,7 +1246,10 @@ void ParticleSystem::resolveCollisions(glm::vec2* pos, glm::vec2* vel) {
 		vel->x *= -damping;
 	}
 
-	if (pos->y < bottomBound) {
+	if (_periodicY) {
+		pos->y = bottomBound + wrapCoordinate(pos->y - bottomBound, _screenHeight);
+	}
+	else if (pos->y < bottomBound) {
 		pos->y = bottomBound;
 		vel->y *= -damping;
 	}
@@ -387,13 +1257,37 @@ void ParticleSystem::resolveCollisions(glm::vec2* pos, glm::vec2* vel) {
 		pos->y = topBound;
 		vel->y *= -damping;
 	}
+
+	if (!_boundary) return;
+
+	//One bilinear lookup gives the distance and the direction out of the obstacle
+	glm::vec3 field = _boundary->sampleGradient(*pos);
+	float penetration = field.x - _boundaryMargin;
+	if (penetration >= 0) return;
+
+	glm::vec2 normal(field.y, field.z);
+	float length = glm::length(normal);
+	if (length <= 0) return;
+	normal /= length;
+
+	*pos -= normal * penetration;
+	float normalSpeed = glm::dot(*vel, normal);
+	if (normalSpeed < 0) *vel -= normal * normalSpeed * (1 + damping);
 }
 
 ParticleSystem::~ParticleSystem() {
 	delete[] positions;
 	delete[] predictedPositions;
 	delete[] velocities;
+	delete[] _stepStartVelocities;
 	delete[] densities;
+	delete[] nearDensities;
+	delete[] _awake;
+	delete[] _calmFrames;
+	delete[] _restDensities;
+	delete _kernelTable;
+	delete _flip;
+	delete _kernelTableBuffer;
 	delete shader;
 	delete densityCompute;
 	glDeleteBuffers(1, &_vertexBuffer);
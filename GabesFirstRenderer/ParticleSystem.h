@@ -4,22 +4,102 @@
 #include "Shader.h"
 #include "ComputeShader.h"
 #include "SpatialHashMap.h"
+#include "Profiler.h"
+#include "JobSystem.h"
+#include "TripleBuffer.h"
+#include "KernelTable.h"
+#include "SPHKernels.h"
+#include "SPHSolver.h"
+#include "ImplicitPressureSolver.h"
+#include "FlipSolver.h"
+#include "SDFGrid.h"
+#include "TrajectoryRecorder.h"
+#include <atomic>
 #include <functional>
+#include <mutex>
+#include <vector>
 #include <glm/mat4x4.hpp>
 
+// Copy of the state the renderer needs, published once per simulation step
+struct ParticleSnapshot
+{
+	int count = 0;
+	std::vector<glm::vec2> positions;
+	std::vector<glm::vec2> velocities;
+	std::vector<float> densities;
+	std::vector<float> cellValues;
+};
+
+// Spawns particles at a steady rate, spread over a disc around position
+struct ParticleEmitter
+{
+	glm::vec2 position;
+	glm::vec2 velocity;
+	float rate;
+	float radius;
+	float accumulator = 0;
+};
+
+// Removes every particle that enters the rectangle
+struct ParticleSink
+{
+	glm::vec2 min;
+	glm::vec2 max;
+};
+
+// Where density and pressure are solved. GPU stages need the GL context and run on the
+// thread that owns it, CPU systems can be stepped from any thread alongside each other.
+enum class SolverBackend
+{
+	GPU,
+	CPU
+};
+
+// How the particles are made incompressible. SPH sums over neighbours on the chosen backend,
+// FLIP projects pressure on a background grid on the CPU, trading small scale detail for throughput.
+enum class FluidMethod
+{
+	SPH,
+	Flip
+};
+
 class ParticleSystem
 {
+	// Simulation bounds, only touched by the thread running simulate
 	float _screenWidth;
 	float _screenHeight;
 
 	float _prevScreenWidth;
 	float _prevScreenHeight;
 	glm::vec2 _windowPosition;
+
+	// Window as last seen by the render thread
+	glm::vec2 _viewPosition;
+	glm::vec2 _viewSize;
 	glm::mat4 _projectionMatrix;
 	void updateProjectionMatrix();
 
+	// Bounds requested by the render thread, applied at the start of the next step
+	std::mutex _boundsMutex;
+	bool _boundsDirty = false;
+	glm::vec2 _pendingWindowPosition;
+	glm::vec2 _pendingScreenSize;
+	void applyPendingBounds();
+
+	TripleBuffer<ParticleSnapshot> _snapshots;
+	void publishSnapshot(const float* cellValues);
+
+	// Owned by the caller, receives every published frame
+	TrajectoryRecorder* _recorder = nullptr;
+	// Simulated seconds since construction, the time stamp of recorded frames
+	double _simulationTime = 0;
+
 	SpatialHashMap* _spatialHash;
 
+	// Owned by the scene, nullptr runs every stage on the calling thread
+	JobSystem* _jobs = nullptr;
+	static const unsigned _grainSize = 1024;
+
 	unsigned int _vao;
 	unsigned int _vertexBuffer;
 	unsigned int _densityBuffer;
@@ -30,21 +110,116 @@ class ParticleSystem
 	ComputeShader* hasherCompute;
 
 	int _particleCount;
+	// Allocated size of every per-particle array and GPU buffer, grows geometrically
+	int _capacity;
+	static const int _minCapacity = 256;
+	// Size of the vertex buffers, grown on the render thread as snapshots get bigger
+	int _vertexCapacity;
 	int _vertices;
-	const float _targetDensity = 0.1f;
-	const float _pressureMultiplier = 1000.0f;
-	const float _nearPressureMultiplier = 100.1f;
-	const float _smoothingRadius = 25.0f;
+
+	std::vector<ParticleEmitter> _emitters;
+	std::vector<ParticleSink> _sinks;
+	void grow(int minCapacity);
+	// Reallocates every per-particle array and the map for exactly capacity particles
+	void setCapacity(int capacity);
+	void setupComputeBuffers();
+	std::map<std::string, std::string> kernelDefines() const;
+	std::map<std::string, std::string> kernelIncludes() const;
+	void spawnParticle(glm::vec2 position, glm::vec2 velocity);
+	void removeParticle(int index);
+	void updateEmittersAndSinks(float deltaTime);
+	// Set through setSPHParameters
+	float _targetDensity = 0.1f;
+	float _pressureMultiplier = 1000.0f;
+	float _nearPressureMultiplier = 100.1f;
+	float _smoothingRadius = 25.0f;
 
 	int* _startIndices;
 
+	Profiler _profiler;
+	bool _statsEnabled = false;
+	unsigned _statsSampleStride = 16;
+	SpatialHashStats _stats;
+	void publishStats();
+
+	// Frame time is consumed in fixed steps, never more than _maxSubsteps per frame
+	float _fixedTimeStep = 1.0f / 240.0f;
+	int _maxSubsteps = 8;
+	float _accumulator = 0;
+	std::atomic<unsigned long long> _particleSteps;
+
+	// CFL and force criteria pick the step size from the fastest and most accelerated particle
+	bool _adaptiveTimeStep = false;
+	float _cflFactor = 0.4f;
+	float _forceFactor = 0.25f;
+	float _minTimeStep = 1.0f / 2000.0f;
+	float _maxTimeStep = 1.0f / 60.0f;
+	float _stableTimeStep = 1.0f / 60.0f;
+	// Velocities at the start of the current step, to measure acceleration over it
+	glm::vec2* _stepStartVelocities;
+	float computeStableTimeStep(float deltaTime);
+	// False once the spatial map has been rebuilt and the GPU copy is stale
+	bool _mapUploaded = false;
+	// Particles that stay slow with a steady density for _framesToSleep frames stop being
+	// integrated and receive no forces, but are still binned and counted as neighbours
+	bool _sleepEnabled = false;
+	float _sleepSpeed = 2.0f;
+	// Relative to the target density
+	float _sleepDensityChange = 0.02f;
+	unsigned _framesToSleep = 30;
+	// 1 while awake, uploaded as is for the pressure kernel
+	unsigned* _awake;
+	unsigned* _calmFrames;
+	// Density when last checked, frozen while asleep so slow drifts also wake the particle
+	float* _restDensities;
+	void updateSleepStates();
+
+	SolverBackend _backend = SolverBackend::GPU;
+	// Set when the capacity grew, the kernels are recompiled before their next dispatch
+	bool _kernelsStale = false;
+	// Optional tabulated kernels, nullptr evaluates them analytically
+	KernelTable* _kernelTable = nullptr;
+	Buffer* _kernelTableBuffer = nullptr;
+	SmoothingKernel _smoothingKernel;
+	typedef SpikyPow3Kernel NearDensityKernel;
+	typedef Poly6Kernel ViscosityKernel;
+	float _viscosityStrength = 0.0f;
+	// Normalisation of each kernel for _smoothingRadius
+	float _densityKernelScale;
+	float _nearDensityKernelScale;
+	// CPU passes evaluate each neighbour pair once and scatter to both sides through per-thread buffers
+	bool _symmetricPairs = true;
+	SPHScratch<2> _scratch;
+	void densityKernelCPU();
+	void pressureKernelCPU(float deltaTime);
+
+	// The implicit solver runs on the CPU for either backend
+	PressureSolver _pressureSolver = PressureSolver::EquationOfState;
+	ImplicitPressureSolver<2> _implicitSolver;
+	PressureSolveStats _lastSolve;
+	void implicitPressureCPU(float deltaTime);
+
+	FluidMethod _fluidMethod = FluidMethod::SPH;
+	FlipSolver* _flip = nullptr;
+	// As passed to setFluidMethod, 0 while the FLIP cells follow the smoothing radius
+	float _flipCellSize = 0;
+	void flipStep(float deltaTime, bool lastSubstep);
+
+	// Static obstacles, owned by the scene. Particles are kept _boundaryMargin outside them.
+	const SDFGrid* _boundary = nullptr;
+	float _boundaryMargin = 2.0f;
+	// Axes on which the window bounds wrap instead of reflecting
+	bool _periodicX = false;
+	bool _periodicY = false;
+	void updatePeriodicDomain();
+	void setPeriodicUniforms(ComputeShader* shader) const;
+	// Pulls a position inside the window bounds on the axes that don't wrap
+	glm::vec2 clampToWindow(glm::vec2 position) const;
 	void resolveCollisions(glm::vec2* pos, glm::vec2* vel);
+	void integrate(float deltaTime);
+	void step(float deltaTime, bool lastSubstep);
 public:
 	const float PI = 3.14159265358979323846f;
-	const float SpikyPow3ScalingFactor = 10 / (PI * std::powf(_smoothingRadius, 5));
-	const float SpikyPow2ScalingFactor = 6 / (PI * std::powf(_smoothingRadius, 4));
-	const float SpikyPow3DerivativeScalingFactor = 30 / (std::powf(_smoothingRadius, 5) * PI);
-	const float SpikyPow2DerivativeScalingFactor = 12 / (std::powf(_smoothingRadius, 4) * PI);
 
 	Shader* shader;
 	glm::vec2 gravity = glm::vec2(0, -9.8);
@@ -56,55 +231,155 @@ public:
 	//Vector3* colors;
 	ParticleSystem(int count, Shader* shader, float screenWidth, float screenHeight, float screenX, float screenY);
 	int count() const;
+	int capacity() const;
+	// Call before the simulation starts
+	void addEmitter(const ParticleEmitter& emitter);
+	void addSink(const ParticleSink& sink);
 	unsigned getVertices() const;
 	unsigned getVBO() const;
 	unsigned getDensityBuff() const;
+	unsigned getGridBuff() const;
+	unsigned getVelBuff() const;
+	// Advances by deltaTime of wall-clock time in fixed substeps
 	void simulate(float deltaTime);
+	void setTimeStep(float fixedTimeStep, int maxSubsteps);
+	// Replaces the fixed step with the largest step the CFL and force criteria allow, within [minStep, maxStep]
+	void setAdaptiveTimeStep(bool enabled, float cflFactor = 0.4f, float forceFactor = 0.25f, float minStep = 1.0f / 2000.0f, float maxStep = 1.0f / 60.0f);
+	// Total particles advanced by one substep since construction, for throughput
+	unsigned long long getParticleSteps() const;
 	glm::vec2 externalForces(int particleIndex);
 
-	void densityKernel(float deltaTime), pressureKernel(float deltaTime);
+	void densityKernel(float deltaTime, bool readBack = true), pressureKernel(float deltaTime);
+
+	void setJobSystem(JobSystem* jobs) {
+		_jobs = jobs;
+	}
+
+	// Records positions and velocities each time a frame is published, nullptr stops recording.
+	// Copying into the recorder's buffers is timed as "Recording" in the profiler.
+	void setRecorder(TrajectoryRecorder* recorder) {
+		_recorder = recorder;
+	}
+
+	void setBackend(SolverBackend backend) {
+		_backend = backend;
+		_mapUploaded = false;
+	}
+
+	SolverBackend getBackend() const {
+		return _backend;
+	}
+
+	// Switches both backends to another density kernel, target density and pressure multipliers may need retuning
+	void setSmoothingKernel(SmoothingKernel kernel);
+
+	// Collides particles with a baked boundary on top of the window edges, nullptr removes it
+	void setBoundary(const SDFGrid* boundary, float margin = 2.0f) {
+		_boundary = boundary;
+		_boundaryMargin = margin;
+	}
+
+	// Wraps particles leaving through the window edges on the chosen axes back in on the opposite side.
+	// Neighbours interact across the seam through minimum image offsets on both backends.
+	void setPeriodic(bool x, bool y);
+
+	// Replaces the smoothing radius, target density, pressure multipliers and viscosity on both backends. Kernel
+	// scales and tables follow, the GPU kernels pick the new values up on their next dispatch and the spatial map is
+	// rebuilt on the next step. FLIP cells sized from the radius are resized too, which drops the solver's warm start.
+	// Call before the simulation starts, or from the thread running simulate.
+	void setSPHParameters(const SPHParameters& params);
+	SPHParameters sphParameters() const;
+
+	// Evaluated in the pressure pass on both backends, 0 turns viscosity off
+	void setViscosityStrength(float strength) {
+		_viscosityStrength = strength;
+	}
+
+	// Implicit solves the pressures each step to hold the target density within tolerance, which stays stable
+	// at much larger time steps than the equation of state. Density and pressure then run on the CPU on both backends.
+	void setPressureSolver(PressureSolver solver, float tolerance = 0.01f, unsigned maxIterations = 100);
+	// Grid cells of cellSize, 0 sizes them from the smoothing radius. Boundaries and window collisions are shared with SPH,
+	// periodic axes are walls to the grid. Densities are then estimated from how full each particle's cell is.
+	void setFluidMethod(FluidMethod method, float cellSize = 0.0f);
+	FlipSolver* getFlipSolver() const {
+		return _flip;
+	}
+
+	// Iterations and remaining compression of the last implicit solve or FLIP projection
+	PressureSolveStats getLastPressureSolve() const {
+		return _lastSolve;
+	}
+
+	// CPU backend only, false goes back to gathering every neighbour from each particle's side like the GPU kernels
+	void setSymmetricPairs(bool enabled) {
+		_symmetricPairs = enabled;
+	}
+
+	// Evaluates the kernels from tables of the given resolution on both backends, 0 goes back to the analytic kernels
+	void setKernelTableResolution(unsigned resolution);
+
+	// Writes every particle array, the parameters and the spatial map to path. Call while simulate isn't running,
+	// or from the thread that runs it.
+	bool saveCheckpoint(const std::string& path) const;
+	// Replaces every particle with the state saved by saveCheckpoint, so a run resumes already settled. False and
+	// unchanged if the file is missing, damaged, or saved with another smoothing radius, target density or pressure
+	// multipliers. The window bounds come back as they were saved and move to the current window on the next step.
+	bool loadCheckpoint(const std::string& path);
+
+	// Opt-in, particles wake when their density moves by more than densityChange * target density
+	void enableSleeping(bool enabled, float speedThreshold = 2.0f, float densityChange = 0.02f, unsigned framesToSleep = 30);
+	// Wakes every particle, for example after the bounds moved
+	void wakeAll();
+
+	// False when simulate makes no GL calls and may run on any thread
+	bool needsGLContext() const {
+		return _backend == SolverBackend::GPU && _fluidMethod == FluidMethod::SPH;
+	}
 
 	void setWindowPosition(float x, float y) {
-		_windowPosition = glm::vec2(x, y);
+		_viewPosition = glm::vec2(x, y);
 		updateProjectionMatrix();
+
+		std::lock_guard<std::mutex> lock(_boundsMutex);
+		_pendingWindowPosition = _viewPosition;
+		_boundsDirty = true;
 	}
 
 	void updateScreenSize(float width, float height) {
 		shader->use();
 		shader->setVec2("screenSize", glm::vec2(width, height));
+		_viewSize = glm::vec2(width, height);
 		updateProjectionMatrix();
-		// Calculate the change in screen dimensions
-		float deltaWidth = width - _prevScreenWidth;
-		float deltaHeight = height - _prevScreenHeight;
-
-		// Calculate velocities for the "moving walls"
-		// Using small timestep to simulate wall movement
-		const float resizeTimeStep = 1.0f / 60.0f;
-		glm::vec2 wallVelocity(deltaWidth / resizeTimeStep, deltaHeight / resizeTimeStep);
-
-		// Update particles based on wall movement
-		for (int i = 0; i < _particleCount; i++) {
-			// Handle right wall movement
-			if (deltaWidth < 0 && positions[i].x > width) {
-				// Apply an impulse based on how far the wall has moved
-				float penetration = positions[i].x - width;
-				velocities[i].x = wallVelocity.x * 0.8f; // Scale factor for smoother interaction
-				positions[i].x = width - penetration * 0.1f; // Push particle slightly inside
-			}
-
-			// Handle bottom wall movement
-			if (deltaHeight < 0 && positions[i].y > height) {
-				float penetration = positions[i].y - height;
-				velocities[i].y = wallVelocity.y * 0.8f;
-				positions[i].y = height - penetration * 0.1f;
-			}
-
-			// Ensure particles stay within bounds
-			resolveCollisions(&positions[i], &velocities[i]);
-
-			// Update predicted positions for next simulation step
-			predictedPositions[i] = positions[i] + velocities[i] * (1.0f / 120.0f);
-		}
+
+		std::lock_guard<std::mutex> lock(_boundsMutex);
+		_pendingScreenSize = _viewSize;
+		_boundsDirty = true;
+	}
+
+	// Render thread side: swaps in the latest published state, returns true if it changed
+	bool acquireSnapshot() {
+		return _snapshots.acquire();
+	}
+
+	const ParticleSnapshot& getSnapshot() const {
+		return _snapshots.readSlot();
+	}
+
+	// Render thread side: makes room in the vertex buffers for count particles
+	void ensureVertexCapacity(int count);
+
+	// Opt-in neighbour and hash table statistics, published through the profiler each frame
+	void enableStats(bool enabled, unsigned sampleStride = 16) {
+		_statsEnabled = enabled;
+		_statsSampleStride = sampleStride;
+	}
+
+	const SpatialHashStats& getStats() const {
+		return _stats;
+	}
+
+	Profiler& getProfiler() {
+		return _profiler;
 	}
 
 	const float getTargetDensity() const {
@@ -0,0 +1,50 @@
+#include "Profiler.h"
+#include <iostream>
+
+void Profiler::record(const std::string& stage, long long microseconds) {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_timings.find(stage) == _timings.end())
+			_stageOrder.push_back(stage);
+		_timings[stage] = microseconds;
+	}
+
+	if (verbose)
+		std::cout << stage << ": " << microseconds << "us" << std::endl;
+}
+
+void Profiler::setCounter(const std::string& name, double value) {
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_counters.find(name) == _counters.end())
+		_counterOrder.push_back(name);
+	_counters[name] = value;
+}
+
+long long Profiler::getTiming(const std::string& stage) const {
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto it = _timings.find(stage);
+	return it != _timings.end() ? it->second : 0;
+}
+
+double Profiler::getCounter(const std::string& name) const {
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto it = _counters.find(name);
+	return it != _counters.end() ? it->second : 0.0;
+}
+
+std::map<std::string, double> Profiler::getCounters() const {
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _counters;
+}
+
+void Profiler::report() const {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	for (const std::string& stage : _stageOrder) {
+		std::cout << stage << ": " << _timings.at(stage) << "us" << std::endl;
+	}
+
+	for (const std::string& name : _counterOrder) {
+		std::cout << name << ": " << _counters.at(name) << std::endl;
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Collects per-stage timings and named counters for the most recent frame.
+// Values are overwritten every frame, so readers always see the latest sample.
+class Profiler
+{
+	std::map<std::string, long long> _timings;
+	std::map<std::string, double> _counters;
+	std::vector<std::string> _stageOrder;
+	std::vector<std::string> _counterOrder;
+	mutable std::mutex _mutex;
+
+public:
+	// Print every stage as soon as it is recorded, off so headless runs aren't flooded
+	bool verbose = false;
+
+	void record(const std::string& stage, long long microseconds);
+	void setCounter(const std::string& name, double value);
+
+	long long getTiming(const std::string& stage) const;
+	double getCounter(const std::string& name) const;
+	std::map<std::string, double> getCounters() const;
+
+	void report() const;
+};
+
+// Records the lifetime of the enclosing scope as a stage timing
+class ScopedTimer
+{
+	Profiler* _profiler;
+	std::string _stage;
+	std::chrono::high_resolution_clock::time_point _start;
+
+public:
+	ScopedTimer(Profiler* profiler, const std::string& stage) : _profiler(profiler), _stage(stage) {
+		_start = std::chrono::high_resolution_clock::now();
+	}
+
+	~ScopedTimer() {
+		auto end = std::chrono::high_resolution_clock::now();
+		_profiler->record(_stage, std::chrono::duration_cast<std::chrono::microseconds>(end - _start).count());
+	}
+};
+
+#endif
@@ -4,7 +4,7 @@ void Renderer::updateScreenSize(const Scene& scene, float width, float height) {
 	_screenWidth = width;
 	_screenHeight = height;
 
-	std::vector<ParticleSystem*> psList = scene.getParticleSystems();
+	const std::vector<ParticleSystem*>& psList = scene.getParticleSystems();
 
 	int i;
 	for (i = 0; i < psList.size(); i++) {
@@ -15,7 +15,7 @@ void Renderer::updateScreenSize(const Scene& scene, float width, float height) {
 void Renderer::updateWindowPosition(const Scene& scene, float x, float y) {
 	_screenX = x;
 	_screenY = y;
-	std::vector<ParticleSystem*> psList = scene.getParticleSystems();
+	const std::vector<ParticleSystem*>& psList = scene.getParticleSystems();
 
 	int i;
 	for (i = 0; i < psList.size(); i++) {
@@ -30,13 +30,13 @@ void Renderer::renderLoop(const Scene& scene) const
 	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	std::vector<Mesh*> meshes = scene.getMeshes();
+	const std::vector<Mesh*>& meshes = scene.getMeshes();
 
 	for (i = 0; i < meshes.size(); i++) {
 		drawMesh(*meshes[i]);
 	}
 
-	std::vector<ParticleSystem*> psList = scene.getParticleSystems();
+	const std::vector<ParticleSystem*>& psList = scene.getParticleSystems();
 
 	for (i = 0; i < psList.size(); i++) {
 		drawParticleSystem(*psList[i]);
@@ -56,7 +56,7 @@ void Renderer::drawMesh(const Mesh& mesh) const {
 	glBindVertexArray(0);
 }
 
-void Renderer::drawParticleSystem(const ParticleSystem& ps) const {
+void Renderer::drawParticleSystem(ParticleSystem& ps) const {
 	ps.shader->use();
 
 	ps.shader->setFloat("targetDensity", ps.getTargetDensity());
@@ -64,19 +64,30 @@ void Renderer::drawParticleSystem(const ParticleSystem& ps) const {
 
 	glBindVertexArray(ps.getVertices());
 
-	// If you need to update the positions:
-	glBindBuffer(GL_ARRAY_BUFFER, ps.getVBO());
-	glBufferSubData(GL_ARRAY_BUFFER, 0, ps.count() * sizeof(glm::vec2), ps.positions);
+	// Only upload when the simulation has published a new step since the last frame
+	if (ps.acquireSnapshot()) {
+		const ParticleSnapshot& snapshot = ps.getSnapshot();
+		ps.ensureVertexCapacity(snapshot.count);
 
-	glBindBuffer(GL_ARRAY_BUFFER, ps.getDensityBuff());
-	glBufferSubData(GL_ARRAY_BUFFER, 0, ps.count() * sizeof(float), ps.densities);
+		glBindBuffer(GL_ARRAY_BUFFER, ps.getVBO());
+		glBufferSubData(GL_ARRAY_BUFFER, 0, snapshot.count * sizeof(glm::vec2), snapshot.positions.data());
+
+		glBindBuffer(GL_ARRAY_BUFFER, ps.getDensityBuff());
+		glBufferSubData(GL_ARRAY_BUFFER, 0, snapshot.count * sizeof(float), snapshot.densities.data());
+
+		glBindBuffer(GL_ARRAY_BUFFER, ps.getGridBuff());
+		glBufferSubData(GL_ARRAY_BUFFER, 0, snapshot.count * sizeof(float), snapshot.cellValues.data());
+
+		glBindBuffer(GL_ARRAY_BUFFER, ps.getVelBuff());
+		glBufferSubData(GL_ARRAY_BUFFER, 0, snapshot.count * sizeof(glm::vec2), snapshot.velocities.data());
+	}
 
 	glEnable(GL_PROGRAM_POINT_SIZE);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	// Draw the points
-	glDrawArrays(GL_POINTS, 0, ps.count());
+	glDrawArrays(GL_POINTS, 0, ps.getSnapshot().count);
 
 	// 6. Check for errors
 	printErrors();
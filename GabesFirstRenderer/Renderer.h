@@ -16,7 +16,7 @@ public:
     void updateScreenSize(const Scene& scene, float width, float height);
     void renderLoop(const Scene& scene) const;
     void drawMesh(const Mesh& mesh) const;
-    void drawParticleSystem(const ParticleSystem& ps) const;
+    void drawParticleSystem(ParticleSystem& ps) const;
 };
 
 #endif
@@ -0,0 +1,228 @@
+#include "SDFGrid.h"
+#include "Mesh.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+
+static const char CACHE_MAGIC[4] = { 'S', 'D', 'F', 'G' };
+static const unsigned CACHE_VERSION = 2;
+
+static float segmentDistance(glm::vec2 p, glm::vec2 a, glm::vec2 b) {
+	glm::vec2 ab = b - a, ap = p - a;
+	return glm::length(ap - ab * glm::clamp(glm::dot(ap, ab) / glm::dot(ab, ab), 0.0f, 1.0f));
+}
+
+//Same side of every edge for either winding, points on an edge count as inside
+static bool insideTriangle(glm::vec2 p, glm::vec2 p0, glm::vec2 p1, glm::vec2 p2) {
+	float d0 = (p1.x - p0.x) * (p.y - p0.y) - (p1.y - p0.y) * (p.x - p0.x);
+	float d1 = (p2.x - p1.x) * (p.y - p1.y) - (p2.y - p1.y) * (p.x - p1.x);
+	float d2 = (p0.x - p2.x) * (p.y - p2.y) - (p0.y - p2.y) * (p.x - p2.x);
+	bool negative = d0 < 0 || d1 < 0 || d2 < 0;
+	bool positive = d0 > 0 || d1 > 0 || d2 > 0;
+	return !(negative && positive);
+}
+
+static float boxDistance(glm::vec2 p, glm::vec2 min, glm::vec2 max) {
+	glm::vec2 centre = (min + max) * 0.5f;
+	glm::vec2 d = glm::abs(p - centre) - (max - min) * 0.5f;
+	return glm::length(glm::max(d, glm::vec2(0.0f))) + std::min(std::max(d.x, d.y), 0.0f);
+}
+
+// FNV-1a over raw bytes
+static void hashBytes(unsigned long long& hash, const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+}
+
+SDFGrid::SDFGrid(glm::vec2 origin, glm::vec2 size, float cellSize) {
+	_origin = origin;
+	_cellSize = cellSize;
+	_nodesX = std::max(2, (int)std::ceil(size.x / cellSize) + 1);
+	_nodesY = std::max(2, (int)std::ceil(size.y / cellSize) + 1);
+}
+
+void SDFGrid::addCircle(glm::vec2 centre, float radius) {
+	_circles.push_back({ centre, radius });
+}
+
+void SDFGrid::addBox(glm::vec2 min, glm::vec2 max) {
+	_boxes.push_back({ min, max });
+}
+
+void SDFGrid::addTriangles(const float* vertices, int vertexCount, const unsigned* indices, int indexCount, const glm::mat4& transform) {
+	auto vertex = [&](unsigned index) {
+		glm::vec4 v = transform * glm::vec4(vertices[index * 3], vertices[index * 3 + 1], vertices[index * 3 + 2], 1.0f);
+		return glm::vec2(v.x, v.y);
+	};
+
+	int count = indices ? indexCount : vertexCount;
+	for (int i = 0; i + 2 < count; i += 3) {
+		Triangle triangle;
+		triangle.a = vertex(indices ? indices[i] : i);
+		triangle.b = vertex(indices ? indices[i + 1] : i + 1);
+		triangle.c = vertex(indices ? indices[i + 2] : i + 2);
+
+		//Triangles seen edge on have no area and no inside
+		glm::vec2 ab = triangle.b - triangle.a, ac = triangle.c - triangle.a;
+		if (std::abs(ab.x * ac.y - ab.y * ac.x) < 1e-8f) continue;
+		_triangles.push_back(triangle);
+	}
+}
+
+void SDFGrid::findBoundaryEdges() {
+	//Edges keyed by their end points in a fixed order, so both windings of a shared edge meet
+	std::map<std::pair<std::pair<float, float>, std::pair<float, float>>, int> edgeCounts;
+	auto addEdge = [&](glm::vec2 a, glm::vec2 b) {
+		std::pair<float, float> first(a.x, a.y), second(b.x, b.y);
+		if (second < first) std::swap(first, second);
+		edgeCounts[std::make_pair(first, second)]++;
+	};
+	for (const Triangle& triangle : _triangles) {
+		addEdge(triangle.a, triangle.b);
+		addEdge(triangle.b, triangle.c);
+		addEdge(triangle.c, triangle.a);
+	}
+
+	_boundaryEdges.clear();
+	for (const auto& edgeCount : edgeCounts) {
+		if (edgeCount.second != 1) continue;
+		glm::vec2 a(edgeCount.first.first.first, edgeCount.first.first.second);
+		glm::vec2 b(edgeCount.first.second.first, edgeCount.first.second.second);
+		_boundaryEdges.push_back({ a, b });
+	}
+}
+
+void SDFGrid::addMesh(const Mesh& mesh, const glm::mat4& transform) {
+	const std::vector<float>& vertices = mesh.getVertexData();
+	const std::vector<unsigned>& indices = mesh.getIndexData();
+	addTriangles(vertices.data(), (int)vertices.size() / 3, indices.empty() ? nullptr : indices.data(), (int)indices.size(), transform);
+}
+
+float SDFGrid::evaluate(glm::vec2 position) const {
+	float distance = std::numeric_limits<float>::max();
+	for (const Circle& circle : _circles)
+		distance = std::min(distance, glm::length(position - circle.centre) - circle.radius);
+	for (const Box& box : _boxes)
+		distance = std::min(distance, boxDistance(position, box.min, box.max));
+	if (_triangles.empty()) return distance;
+
+	//The triangles are one shape, edges inside it would otherwise pull the surface in along every diagonal
+	float meshDistance = std::numeric_limits<float>::max();
+	for (const Edge& edge : _boundaryEdges)
+		meshDistance = std::min(meshDistance, segmentDistance(position, edge.a, edge.b));
+	for (const Triangle& triangle : _triangles) {
+		if (insideTriangle(position, triangle.a, triangle.b, triangle.c)) {
+			meshDistance = -meshDistance;
+			break;
+		}
+	}
+	return std::min(distance, meshDistance);
+}
+
+unsigned long long SDFGrid::cacheKey() const {
+	unsigned long long hash = 14695981039346656037ull;
+	hashBytes(hash, &_origin, sizeof(_origin));
+	hashBytes(hash, &_cellSize, sizeof(_cellSize));
+	hashBytes(hash, &_nodesX, sizeof(_nodesX));
+	hashBytes(hash, &_nodesY, sizeof(_nodesY));
+	hashBytes(hash, _circles.data(), _circles.size() * sizeof(Circle));
+	hashBytes(hash, _boxes.data(), _boxes.size() * sizeof(Box));
+	hashBytes(hash, _triangles.data(), _triangles.size() * sizeof(Triangle));
+	return hash;
+}
+
+bool SDFGrid::loadCache(const std::string& path, unsigned long long key) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return false;
+
+	char magic[4];
+	unsigned version;
+	unsigned long long fileKey;
+	int nodesX, nodesY;
+	file.read(magic, sizeof(magic));
+	file.read((char*)&version, sizeof(version));
+	file.read((char*)&fileKey, sizeof(fileKey));
+	file.read((char*)&nodesX, sizeof(nodesX));
+	file.read((char*)&nodesY, sizeof(nodesY));
+	if (!file || std::memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0 || version != CACHE_VERSION || fileKey != key
+		|| nodesX != _nodesX || nodesY != _nodesY)
+		return false;
+
+	std::vector<float> distances((size_t)_nodesX * _nodesY);
+	file.read((char*)distances.data(), distances.size() * sizeof(float));
+	if (!file) return false;
+
+	_distances.swap(distances);
+	return true;
+}
+
+void SDFGrid::saveCache(const std::string& path, unsigned long long key) const {
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	file.write((const char*)&CACHE_VERSION, sizeof(CACHE_VERSION));
+	file.write((const char*)&key, sizeof(key));
+	file.write((const char*)&_nodesX, sizeof(_nodesX));
+	file.write((const char*)&_nodesY, sizeof(_nodesY));
+	file.write((const char*)_distances.data(), _distances.size() * sizeof(float));
+	if (!file) std::cout << "ERROR::SDF_GRID::CACHE_NOT_WRITTEN: " << path << std::endl;
+}
+
+void SDFGrid::bake(JobSystem* jobs, const std::string& cachePath) {
+	unsigned long long key = cacheKey();
+	if (!cachePath.empty() && loadCache(cachePath, key)) return;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	findBoundaryEdges();
+	_distances.assign((size_t)_nodesX * _nodesY, 0.0f);
+	parallelFor(jobs, 0, _nodesY, _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned y = begin; y < end; y++) {
+			for (int x = 0; x < _nodesX; x++)
+				_distances[(size_t)y * _nodesX + x] = evaluate(_origin + glm::vec2(x, y) * _cellSize);
+		}
+	});
+	auto end = std::chrono::high_resolution_clock::now();
+	std::cout << "SDF bake: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms for "
+		<< _nodesX << "x" << _nodesY << " nodes" << std::endl;
+
+	if (!cachePath.empty()) saveCache(cachePath, key);
+}
+
+bool SDFGrid::isBaked() const {
+	return !_distances.empty();
+}
+
+float SDFGrid::sample(glm::vec2 position) const {
+	return sampleGradient(position).x;
+}
+
+glm::vec3 SDFGrid::sampleGradient(glm::vec2 position) const {
+	glm::vec2 local = (position - _origin) / _cellSize;
+	if (_distances.empty() || local.x < 0 || local.y < 0 || local.x >= _nodesX - 1 || local.y >= _nodesY - 1)
+		return glm::vec3(std::numeric_limits<float>::max(), 0, 0);
+
+	int x = (int)local.x;
+	int y = (int)local.y;
+	float fx = local.x - x;
+	float fy = local.y - y;
+
+	const float* row = &_distances[(size_t)y * _nodesX + x];
+	float d00 = row[0], d10 = row[1];
+	float d01 = row[_nodesX], d11 = row[_nodesX + 1];
+
+	float bottom = d00 + (d10 - d00) * fx;
+	float top = d01 + (d11 - d01) * fx;
+	float distance = bottom + (top - bottom) * fy;
+	float gradientX = ((d10 - d00) * (1 - fy) + (d11 - d01) * fy) / _cellSize;
+	float gradientY = (top - bottom) / _cellSize;
+	return glm::vec3(distance, gradientX, gradientY);
+}
@@ -0,0 +1,81 @@
+#ifndef SDF_GRID_H
+#define SDF_GRID_H
+
+#include <string>
+#include <vector>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+#include "JobSystem.h"
+
+class Mesh;
+
+// Signed distance to static boundary geometry, baked once onto a regular grid of nodes and
+// negative inside obstacles. A lookup blends the four surrounding nodes, so collisions cost
+// the same however much geometry the boundary holds.
+class SDFGrid
+{
+	struct Triangle {
+		glm::vec2 a, b, c;
+	};
+
+	struct Edge {
+		glm::vec2 a, b;
+	};
+
+	struct Circle {
+		glm::vec2 centre;
+		float radius;
+	};
+
+	struct Box {
+		glm::vec2 min, max;
+	};
+
+	glm::vec2 _origin;
+	float _cellSize;
+	int _nodesX;
+	int _nodesY;
+	std::vector<float> _distances;
+
+	std::vector<Triangle> _triangles;
+	// Edges of _triangles that only one triangle has, the outline of the mesh
+	std::vector<Edge> _boundaryEdges;
+	std::vector<Circle> _circles;
+	std::vector<Box> _boxes;
+
+	// Rows of nodes per job when baking
+	static const unsigned _grainSize = 4;
+
+	// Fills _boundaryEdges, shared edges only match where both triangles have exactly the same end points
+	void findBoundaryEdges();
+	// Exact distance to the union of every shape
+	float evaluate(glm::vec2 position) const;
+	// Identifies the grid and its geometry, a cache file baked from anything else is ignored
+	unsigned long long cacheKey() const;
+	bool loadCache(const std::string& path, unsigned long long key);
+	void saveCache(const std::string& path, unsigned long long key) const;
+
+public:
+	// Covers [origin, origin + size] with nodes cellSize apart
+	SDFGrid(glm::vec2 origin, glm::vec2 size, float cellSize);
+
+	void addCircle(glm::vec2 centre, float radius);
+	void addBox(glm::vec2 min, glm::vec2 max);
+	// Triangles in the Mesh vertex layout of 3 floats per vertex, placed by transform and projected onto xy.
+	// Without indices every three vertices form a triangle.
+	void addTriangles(const float* vertices, int vertexCount, const unsigned* indices, int indexCount, const glm::mat4& transform);
+	void addMesh(const Mesh& mesh, const glm::mat4& transform);
+
+	// Evaluates every node, or loads them from cachePath if it holds a bake of the same geometry.
+	// An empty path skips the cache. Shapes added afterwards need another bake.
+	void bake(JobSystem* jobs = nullptr, const std::string& cachePath = "");
+	bool isBaked() const;
+
+	// Positions outside the grid are treated as far from any geometry
+	float sample(glm::vec2 position) const;
+	// Distance in x, gradient of the bilinear blend in y and z
+	glm::vec3 sampleGradient(glm::vec2 position) const;
+};
+
+#endif
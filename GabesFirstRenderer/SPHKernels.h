@@ -0,0 +1,194 @@
+#ifndef SPH_KERNELS_H
+#define SPH_KERNELS_H
+
+#include <string>
+
+// Smoothing kernel policies. Each one gives its value and radial derivative for a distance
+// inside the support radius, plus the same two bodies as GLSL so the compute shaders are
+// generated from the policy the CPU solver is instantiated with.
+// A kernel's normalisation is known at compile time for a unit radius in Dim dimensions, the
+// runtime scale is normalisation<Dim>() / radius^(Dim + degree()), computed once per radius with kernelScale.
+
+constexpr float KERNEL_PI = 3.14159265358979323846f;
+
+constexpr float constexprPow(float base, int exponent) {
+	float result = 1;
+	for (int i = 0; i < exponent; i++) result *= base;
+	return result;
+}
+
+// (h - r)^2, the density kernel of double density relaxation
+struct SpikyPow2Kernel
+{
+	static const char* name() { return "Spiky"; }
+	template <int Dim> static constexpr float normalisation() { return Dim == 2 ? 6 / KERNEL_PI : 15 / (2 * KERNEL_PI); }
+	static constexpr int degree() { return 2; }
+
+	static float value(float dst, float radius, float scale) {
+		float v = radius - dst;
+		return v * v * scale;
+	}
+
+	static float derivative(float dst, float radius, float scale) {
+		float v = radius - dst;
+		return -2 * v * scale;
+	}
+
+	static const char* glslValue() { return "float v = radius - dst; return v * v * scale;"; }
+	static const char* glslDerivative() { return "float v = radius - dst; return -2.0 * v * scale;"; }
+};
+
+// (h - r)^3, the near density kernel that keeps particles from clumping
+struct SpikyPow3Kernel
+{
+	static const char* name() { return "Spiky (near)"; }
+	template <int Dim> static constexpr float normalisation() { return Dim == 2 ? 10 / KERNEL_PI : 15 / KERNEL_PI; }
+	static constexpr int degree() { return 3; }
+
+	static float value(float dst, float radius, float scale) {
+		float v = radius - dst;
+		return v * v * v * scale;
+	}
+
+	static float derivative(float dst, float radius, float scale) {
+		float v = radius - dst;
+		return -3 * v * v * scale;
+	}
+
+	static const char* glslValue() { return "float v = radius - dst; return v * v * v * scale;"; }
+	static const char* glslDerivative() { return "float v = radius - dst; return -3.0 * v * v * scale;"; }
+};
+
+// (h^2 - r^2)^3, smooth everywhere but its gradient vanishes at the centre
+struct Poly6Kernel
+{
+	static const char* name() { return "Poly6"; }
+	template <int Dim> static constexpr float normalisation() { return Dim == 2 ? 4 / KERNEL_PI : 315 / (64 * KERNEL_PI); }
+	static constexpr int degree() { return 6; }
+
+	static float value(float dst, float radius, float scale) {
+		float v = radius * radius - dst * dst;
+		return v * v * v * scale;
+	}
+
+	static float derivative(float dst, float radius, float scale) {
+		float v = radius * radius - dst * dst;
+		return -6 * dst * v * v * scale;
+	}
+
+	static const char* glslValue() { return "float v = radius * radius - dst * dst; return v * v * v * scale;"; }
+	static const char* glslDerivative() { return "float v = radius * radius - dst * dst; return -6.0 * dst * v * v * scale;"; }
+};
+
+// (1 - q)^4 (1 + 4q) with q = r / h, positive definite and resistant to pairing
+struct WendlandC2Kernel
+{
+	static const char* name() { return "Wendland C2"; }
+	template <int Dim> static constexpr float normalisation() { return Dim == 2 ? 7 / KERNEL_PI : 21 / (2 * KERNEL_PI); }
+	static constexpr int degree() { return 0; }
+
+	static float value(float dst, float radius, float scale) {
+		float q = dst / radius;
+		float v = 1 - q;
+		return v * v * v * v * (1 + 4 * q) * scale;
+	}
+
+	static float derivative(float dst, float radius, float scale) {
+		float q = dst / radius;
+		float v = 1 - q;
+		return -20 * q * v * v * v * scale / radius;
+	}
+
+	static const char* glslValue() { return "float q = dst / radius; float v = 1.0 - q; return v * v * v * v * (1.0 + 4.0 * q) * scale;"; }
+	static const char* glslDerivative() { return "float q = dst / radius; float v = 1.0 - q; return -20.0 * q * v * v * v * scale / radius;"; }
+};
+
+// M4 cubic B-spline with its support scaled to the smoothing radius
+struct CubicSplineKernel
+{
+	static const char* name() { return "Cubic spline"; }
+	template <int Dim> static constexpr float normalisation() { return Dim == 2 ? 40 / (7 * KERNEL_PI) : 8 / KERNEL_PI; }
+	static constexpr int degree() { return 0; }
+
+	static float value(float dst, float radius, float scale) {
+		float q = dst / radius;
+		if (q <= 0.5f) return (6 * (q * q * q - q * q) + 1) * scale;
+		float v = 1 - q;
+		return 2 * v * v * v * scale;
+	}
+
+	static float derivative(float dst, float radius, float scale) {
+		float q = dst / radius;
+		if (q <= 0.5f) return 6 * (3 * q * q - 2 * q) * scale / radius;
+		float v = 1 - q;
+		return -6 * v * v * scale / radius;
+	}
+
+	static const char* glslValue() {
+		return "float q = dst / radius; if (q <= 0.5) return (6.0 * (q * q * q - q * q) + 1.0) * scale; float v = 1.0 - q; return 2.0 * v * v * v * scale;";
+	}
+	static const char* glslDerivative() {
+		return "float q = dst / radius; if (q <= 0.5) return 6.0 * (3.0 * q * q - 2.0 * q) * scale / radius; float v = 1.0 - q; return -6.0 * v * v * scale / radius;";
+	}
+};
+
+// Density kernel of the solver. The near density kernel is always the (h - r)^3 spike.
+enum class SmoothingKernel
+{
+	Spiky,
+	Poly6,
+	WendlandC2,
+	CubicSpline
+};
+
+// Calls fn with a default constructed policy for kernel, to reach the template instantiated for it
+template <class Fn>
+void withDensityKernel(SmoothingKernel kernel, Fn fn) {
+	switch (kernel) {
+	case SmoothingKernel::Spiky: fn(SpikyPow2Kernel()); break;
+	case SmoothingKernel::Poly6: fn(Poly6Kernel()); break;
+	case SmoothingKernel::WendlandC2: fn(WendlandC2Kernel()); break;
+	case SmoothingKernel::CubicSpline: fn(CubicSplineKernel()); break;
+	}
+}
+
+// Runtime half of the normalisation, everything but the power of the radius folds at compile time
+template <class Kernel, int Dim = 2>
+constexpr float kernelScale(float radius) {
+	return Kernel::template normalisation<Dim>() / constexprPow(radius, Dim + Kernel::degree());
+}
+
+// Zero outside the support, so policies only handle dst < radius
+template <class Kernel>
+inline float kernelValue(float dst, float radius, float scale) {
+	return dst < radius ? Kernel::value(dst, radius, scale) : 0.0f;
+}
+
+template <class Kernel>
+inline float kernelDerivative(float dst, float radius, float scale) {
+	return dst < radius ? Kernel::derivative(dst, radius, scale) : 0.0f;
+}
+
+// GLSL for DensityKernel, NearDensityKernel, DensityDerivative, NearDensityDerivative and ViscosityKernel,
+// with the scales as the densityKernelScale, nearDensityKernelScale and viscosityKernelScale uniforms
+template <class Density, class NearDensity, class Viscosity = Poly6Kernel>
+std::string smoothingKernelsGLSL() {
+	auto function = [](const char* name, const char* scale, const char* body) {
+		return std::string("float ") + name + "(float dst, float radius)\n{\n"
+			"\tif (dst >= radius) return 0.0;\n"
+			"\tfloat scale = " + scale + ";\n"
+			"\t" + body + "\n}\n";
+	};
+
+	return std::string("// Generated from the ") + Density::name() + ", " + NearDensity::name() + " and " + Viscosity::name() + " kernel policies\n"
+		"uniform float densityKernelScale;\n"
+		"uniform float nearDensityKernelScale;\n"
+		"uniform float viscosityKernelScale;\n" +
+		function("DensityKernel", "densityKernelScale", Density::glslValue()) +
+		function("NearDensityKernel", "nearDensityKernelScale", NearDensity::glslValue()) +
+		function("DensityDerivative", "densityKernelScale", Density::glslDerivative()) +
+		function("NearDensityDerivative", "nearDensityKernelScale", NearDensity::glslDerivative()) +
+		function("ViscosityKernel", "viscosityKernelScale", Viscosity::glslValue());
+}
+
+#endif
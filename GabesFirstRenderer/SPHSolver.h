@@ -0,0 +1,357 @@
+#ifndef SPH_SOLVER_H
+#define SPH_SOLVER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Dimension.h"
+#include "JobSystem.h"
+#include "KernelTable.h"
+#include "MultiLevelHashMap.h"
+#include "SPHKernels.h"
+#include "SpatialHashMap.h"
+
+// Fluid constants of the double density relaxation solver
+struct SPHParameters
+{
+	float smoothingRadius = 25.0f;
+	float targetDensity = 0.1f;
+	float pressureMultiplier = 1000.0f;
+	float nearPressureMultiplier = 100.1f;
+	// Pulls each particle towards the velocity of its neighbours, 0 turns viscosity off
+	float viscosityStrength = 0.0f;
+};
+
+// Per-thread partial sums for the pair passes, so both particles of a pair can be written
+// without atomics. A thread's buffer is cleared the first time it touches it in a pass.
+template <typename T>
+class ThreadAccumulator
+{
+	std::vector<std::vector<T>> _buffers;
+	std::vector<unsigned char> _touched;
+	JobSystem* _jobs = nullptr;
+	unsigned _count = 0;
+
+public:
+	void begin(unsigned count, JobSystem* jobs) {
+		unsigned threads = jobs ? jobs->threadCount() : 1;
+		if (_buffers.size() < threads) _buffers.resize(threads);
+		_touched.assign(_buffers.size(), 0);
+		_jobs = jobs;
+		_count = count;
+	}
+
+	// Buffer of the calling thread, only valid inside the jobs of the current pass
+	T* local() {
+		unsigned thread = _jobs ? JobSystem::currentThreadIndex() : 0;
+		if (!_touched[thread]) {
+			_buffers[thread].assign(_count, T(0));
+			_touched[thread] = 1;
+		}
+		return _buffers[thread].data();
+	}
+
+	// Calls fn(index, total) with the sum over every thread's buffer
+	template <typename Fn>
+	void reduce(unsigned grainSize, Fn fn) const {
+		parallelFor(_jobs, 0, _count, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				T total(0);
+				for (size_t thread = 0; thread < _buffers.size(); thread++)
+					if (_touched[thread]) total += _buffers[thread][i];
+				fn(i, total);
+			}
+		});
+	}
+};
+
+// Scratch of the CPU passes, kept between steps so the buffers are allocated once
+template <int Dim>
+struct SPHScratch
+{
+	// Pair passes
+	ThreadAccumulator<glm::vec2> densities;
+	ThreadAccumulator<typename Dimension<Dim>::Vec> pairAccelerations;
+	// Gather pass
+	std::vector<typename Dimension<Dim>::Vec> accelerations;
+};
+
+// CPU mirror of DensityKernel.comp. Instantiated per dimension and kernel so the neighbour
+// loop inlines both. A non-null table replaces the analytic kernels.
+template <int Dim, class DensityKernel, class NearDensityKernel = SpikyPow3Kernel, class Grid = SpatialHashMapT<Dim>>
+void computeDensities(const Grid& hash, const typename Dimension<Dim>::Vec* positions, unsigned count,
+	const SPHParameters& params, const KernelTable* table, float* densities, float* nearDensities, JobSystem* jobs, unsigned grainSize) {
+	typedef typename Dimension<Dim>::Vec Vec;
+	const float radius = params.smoothingRadius;
+	const float densityScale = kernelScale<DensityKernel, Dim>(radius);
+	const float nearDensityScale = kernelScale<NearDensityKernel, Dim>(radius);
+
+	parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			float density = 0;
+			float nearDensity = 0;
+
+			hash.forEachNeighbour(positions, positions[i], radius, [&](unsigned, const Vec&, float sqrDst) {
+				if (table) {
+					glm::vec4 kernels = table->sample(sqrDst);
+					density += kernels.x;
+					nearDensity += kernels.y;
+					return;
+				}
+
+				float dst = std::sqrt(sqrDst);
+				density += kernelValue<DensityKernel>(dst, radius, densityScale);
+				nearDensity += kernelValue<NearDensityKernel>(dst, radius, nearDensityScale);
+			});
+
+			densities[i] = density;
+			nearDensities[i] = nearDensity;
+		}
+	});
+}
+
+// CPU mirror of PressureKernel.comp. Pressure and viscosity are accumulated in the same neighbour
+// loop, each neighbour is loaded once. Neighbour velocities are read while the pass runs, so the
+// accelerations are gathered first and applied afterwards. Particles with a zero awake flag are
+// skipped, a null awake array skips none.
+template <int Dim, class DensityKernel, class NearDensityKernel = SpikyPow3Kernel, class ViscosityKernel = Poly6Kernel, class Grid = SpatialHashMapT<Dim>>
+void applyPressureAndViscosity(const Grid& hash, const typename Dimension<Dim>::Vec* positions, const float* densities,
+	const float* nearDensities, unsigned count, const SPHParameters& params, const KernelTable* table, const unsigned* awake,
+	typename Dimension<Dim>::Vec* velocities, float deltaTime, SPHScratch<Dim>& scratch, JobSystem* jobs, unsigned grainSize) {
+	typedef typename Dimension<Dim>::Vec Vec;
+	const float radius = params.smoothingRadius;
+	const float densityScale = kernelScale<DensityKernel, Dim>(radius);
+	const float nearDensityScale = kernelScale<NearDensityKernel, Dim>(radius);
+	const float viscosityScale = kernelScale<ViscosityKernel, Dim>(radius);
+	const bool viscosity = params.viscosityStrength > 0;
+
+	// Coincident particles are pushed apart along +y
+	Vec fallbackDirection(0.0f);
+	fallbackDirection.y = 1;
+
+	if (scratch.accelerations.size() < count) scratch.accelerations.resize(count);
+	Vec* accelerations = scratch.accelerations.data();
+
+	parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			if (awake && !awake[i]) continue;
+
+			float pressure = (densities[i] - params.targetDensity) * params.pressureMultiplier;
+			float nearPressure = nearDensities[i] * params.nearPressureMultiplier;
+			Vec velocity = velocities[i];
+			Vec pressureForce(0.0f);
+			Vec viscosityForce(0.0f);
+
+			hash.forEachNeighbour(positions, positions[i], radius, [&](unsigned j, const Vec& offset, float sqrDst) {
+				if (j == i) return;
+
+				//The direction still needs the distance, the table only saves the powers
+				float dst = std::sqrt(sqrDst);
+				Vec dirToNeighbour = dst > 0 ? offset / dst : fallbackDirection;
+				float derivative, nearDerivative;
+				if (table) {
+					glm::vec4 kernels = table->sample(sqrDst);
+					derivative = kernels.z;
+					nearDerivative = kernels.w;
+				}
+				else {
+					derivative = kernelDerivative<DensityKernel>(dst, radius, densityScale);
+					nearDerivative = kernelDerivative<NearDensityKernel>(dst, radius, nearDensityScale);
+				}
+
+				float neighbourPressure = (densities[j] - params.targetDensity) * params.pressureMultiplier;
+				float neighbourNearPressure = nearDensities[j] * params.nearPressureMultiplier;
+				float sharedPressure = (pressure + neighbourPressure) * 0.5f;
+				float sharedNearPressure = (nearPressure + neighbourNearPressure) * 0.5f;
+
+				pressureForce += dirToNeighbour * derivative * sharedPressure / densities[j];
+				pressureForce += dirToNeighbour * nearDerivative * sharedNearPressure / nearDensities[j];
+
+				if (viscosity)
+					viscosityForce += (velocities[j] - velocity) * kernelValue<ViscosityKernel>(dst, radius, viscosityScale);
+			});
+
+			accelerations[i] = pressureForce / densities[i] + viscosityForce * params.viscosityStrength;
+		}
+	});
+
+	parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			if (awake && !awake[i]) continue;
+			velocities[i] += accelerations[i] * deltaTime;
+		}
+	});
+}
+
+// Same result as computeDensities, but each pair within the radius is evaluated once and
+// added to both particles. Needs a map built from positions.
+template <int Dim, class DensityKernel, class NearDensityKernel = SpikyPow3Kernel, class Grid = SpatialHashMapT<Dim>>
+void computeDensitiesPairwise(const Grid& hash, const typename Dimension<Dim>::Vec* positions, unsigned count,
+	const SPHParameters& params, const KernelTable* table, float* densities, float* nearDensities, SPHScratch<Dim>& scratch,
+	JobSystem* jobs, unsigned grainSize) {
+	typedef typename Dimension<Dim>::Vec Vec;
+	const float radius = params.smoothingRadius;
+	const float densityScale = kernelScale<DensityKernel, Dim>(radius);
+	const float nearDensityScale = kernelScale<NearDensityKernel, Dim>(radius);
+
+	auto kernels = [&](float sqrDst) {
+		if (table) {
+			glm::vec4 sampled = table->sample(sqrDst);
+			return glm::vec2(sampled.x, sampled.y);
+		}
+		float dst = std::sqrt(sqrDst);
+		return glm::vec2(kernelValue<DensityKernel>(dst, radius, densityScale), kernelValue<NearDensityKernel>(dst, radius, nearDensityScale));
+	};
+
+	scratch.densities.begin(count, jobs);
+	hash.forEachPair(positions, radius, jobs, grainSize, [&](unsigned i, unsigned j, const Vec&, float sqrDst) {
+		glm::vec2* local = scratch.densities.local();
+		glm::vec2 contribution = kernels(sqrDst);
+		local[i] += contribution;
+		local[j] += contribution;
+	});
+
+	//Every particle is its own neighbour at distance zero
+	const glm::vec2 self = kernels(0.0f);
+	scratch.densities.reduce(grainSize, [&](unsigned i, glm::vec2 total) {
+		densities[i] = total.x + self.x;
+		nearDensities[i] = total.y + self.y;
+	});
+}
+
+// Same result as applyPressureAndViscosity with each pair evaluated once. The pair shares its pressure,
+// kernel gradient and viscosity weight, only the densities the contribution is divided by differ per side.
+// Velocities are only written after every pair has been visited.
+template <int Dim, class DensityKernel, class NearDensityKernel = SpikyPow3Kernel, class ViscosityKernel = Poly6Kernel, class Grid = SpatialHashMapT<Dim>>
+void applyPressureAndViscosityPairwise(const Grid& hash, const typename Dimension<Dim>::Vec* positions, const float* densities,
+	const float* nearDensities, unsigned count, const SPHParameters& params, const KernelTable* table, const unsigned* awake,
+	typename Dimension<Dim>::Vec* velocities, float deltaTime, SPHScratch<Dim>& scratch, JobSystem* jobs, unsigned grainSize) {
+	typedef typename Dimension<Dim>::Vec Vec;
+	const float radius = params.smoothingRadius;
+	const float densityScale = kernelScale<DensityKernel, Dim>(radius);
+	const float nearDensityScale = kernelScale<NearDensityKernel, Dim>(radius);
+	const float viscosityScale = kernelScale<ViscosityKernel, Dim>(radius);
+	const bool viscosity = params.viscosityStrength > 0;
+
+	Vec fallbackDirection(0.0f);
+	fallbackDirection.y = 1;
+
+	scratch.pairAccelerations.begin(count, jobs);
+	hash.forEachPair(positions, radius, jobs, grainSize, [&](unsigned i, unsigned j, const Vec& offset, float sqrDst) {
+		if (awake && !awake[i] && !awake[j]) return;
+
+		float dst = std::sqrt(sqrDst);
+		Vec dirToNeighbour = dst > 0 ? offset / dst : fallbackDirection;
+		float derivative, nearDerivative;
+		if (table) {
+			glm::vec4 kernels = table->sample(sqrDst);
+			derivative = kernels.z;
+			nearDerivative = kernels.w;
+		}
+		else {
+			derivative = kernelDerivative<DensityKernel>(dst, radius, densityScale);
+			nearDerivative = kernelDerivative<NearDensityKernel>(dst, radius, nearDensityScale);
+		}
+
+		float sharedPressure = (densities[i] + densities[j] - 2 * params.targetDensity) * params.pressureMultiplier * 0.5f;
+		float sharedNearPressure = (nearDensities[i] + nearDensities[j]) * params.nearPressureMultiplier * 0.5f;
+		Vec pressureGradient = dirToNeighbour * (derivative * sharedPressure);
+		Vec nearPressureGradient = dirToNeighbour * (nearDerivative * sharedNearPressure);
+
+		Vec accelerationI = (pressureGradient / densities[j] + nearPressureGradient / nearDensities[j]) / densities[i];
+		Vec accelerationJ = -(pressureGradient / densities[i] + nearPressureGradient / nearDensities[i]) / densities[j];
+		if (viscosity) {
+			Vec viscosityForce = (velocities[j] - velocities[i]) * (kernelValue<ViscosityKernel>(dst, radius, viscosityScale) * params.viscosityStrength);
+			accelerationI += viscosityForce;
+			accelerationJ -= viscosityForce;
+		}
+
+		Vec* local = scratch.pairAccelerations.local();
+		local[i] += accelerationI;
+		local[j] += accelerationJ;
+	});
+
+	scratch.pairAccelerations.reduce(grainSize, [&](unsigned i, const Vec& acceleration) {
+		if (awake && !awake[i]) return;
+		velocities[i] += acceleration * deltaTime;
+	});
+}
+
+// Variable resolution. A particle of mass m stands in for m unit particles and carries its own
+// smoothing radius, pairs use the mean of their two radii so every interaction stays symmetric.
+// levels must be updated with positions and radii.
+template <int Dim, class DensityKernel, class NearDensityKernel = SpikyPow3Kernel>
+void computeDensitiesVariable(const MultiLevelHashMapT<Dim>& levels, const typename Dimension<Dim>::Vec* positions, const float* masses,
+	const float* radii, unsigned count, float* densities, float* nearDensities, JobSystem* jobs, unsigned grainSize) {
+	typedef typename Dimension<Dim>::Vec Vec;
+
+	parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			float density = 0;
+			float nearDensity = 0;
+
+			levels.forEachInSupport(positions[i], radii[i], [&](unsigned j, const Vec&, float sqrDst, float radius) {
+				float dst = std::sqrt(sqrDst);
+				density += masses[j] * kernelValue<DensityKernel>(dst, radius, kernelScale<DensityKernel, Dim>(radius));
+				nearDensity += masses[j] * kernelValue<NearDensityKernel>(dst, radius, kernelScale<NearDensityKernel, Dim>(radius));
+			});
+
+			densities[i] = density;
+			nearDensities[i] = nearDensity;
+		}
+	});
+}
+
+// applyPressureAndViscosity with masses and per-pair radii, see computeDensitiesVariable
+template <int Dim, class DensityKernel, class NearDensityKernel = SpikyPow3Kernel, class ViscosityKernel = Poly6Kernel>
+void applyPressureAndViscosityVariable(const MultiLevelHashMapT<Dim>& levels, const typename Dimension<Dim>::Vec* positions, const float* masses,
+	const float* radii, const float* densities, const float* nearDensities, unsigned count, const SPHParameters& params,
+	typename Dimension<Dim>::Vec* velocities, float deltaTime, SPHScratch<Dim>& scratch, JobSystem* jobs, unsigned grainSize) {
+	typedef typename Dimension<Dim>::Vec Vec;
+	const bool viscosity = params.viscosityStrength > 0;
+
+	Vec fallbackDirection(0.0f);
+	fallbackDirection.y = 1;
+
+	if (scratch.accelerations.size() < count) scratch.accelerations.resize(count);
+	Vec* accelerations = scratch.accelerations.data();
+
+	parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			float pressure = (densities[i] - params.targetDensity) * params.pressureMultiplier;
+			float nearPressure = nearDensities[i] * params.nearPressureMultiplier;
+			Vec velocity = velocities[i];
+			Vec pressureForce(0.0f);
+			Vec viscosityForce(0.0f);
+
+			levels.forEachInSupport(positions[i], radii[i], [&](unsigned j, const Vec& offset, float sqrDst, float radius) {
+				if (j == i) return;
+				float dst = std::sqrt(sqrDst);
+
+				Vec dirToNeighbour = dst > 0 ? offset / dst : fallbackDirection;
+				float derivative = kernelDerivative<DensityKernel>(dst, radius, kernelScale<DensityKernel, Dim>(radius));
+				float nearDerivative = kernelDerivative<NearDensityKernel>(dst, radius, kernelScale<NearDensityKernel, Dim>(radius));
+
+				float neighbourPressure = (densities[j] - params.targetDensity) * params.pressureMultiplier;
+				float neighbourNearPressure = nearDensities[j] * params.nearPressureMultiplier;
+				float sharedPressure = (pressure + neighbourPressure) * 0.5f;
+				float sharedNearPressure = (nearPressure + neighbourNearPressure) * 0.5f;
+
+				pressureForce += dirToNeighbour * (masses[j] * derivative * sharedPressure / densities[j]);
+				pressureForce += dirToNeighbour * (masses[j] * nearDerivative * sharedNearPressure / nearDensities[j]);
+
+				if (viscosity)
+					viscosityForce += (velocities[j] - velocity) * (masses[j] * kernelValue<ViscosityKernel>(dst, radius, kernelScale<ViscosityKernel, Dim>(radius)));
+			});
+
+			accelerations[i] = pressureForce / densities[i] + viscosityForce * params.viscosityStrength;
+		}
+	});
+
+	parallelFor(jobs, 0, count, grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			velocities[i] += accelerations[i] * deltaTime;
+	});
+}
+
+#endif
@@ -3,27 +3,51 @@
 #include "iostream"
 #include <vector>
 
+Scene::Scene(unsigned workerCount) {
+	_jobs = new JobSystem(workerCount);
+}
+
 void Scene::add(Mesh* mesh) {
 	_meshes.push_back(mesh);
 }
 
 void Scene::add(ParticleSystem* ps) {
+	ps->setJobSystem(_jobs);
 	_particleSystems.push_back(ps);
 }
 
-std::vector<Mesh*> Scene::getMeshes() const {
+void Scene::add(SDFGrid* boundary, const std::string& cachePath) {
+	if (!boundary->isBaked()) boundary->bake(_jobs, cachePath);
+	_boundaries.push_back(boundary);
+}
+
+const std::vector<Mesh*>& Scene::getMeshes() const {
 	return _meshes;
 }
 
-std::vector<ParticleSystem*> Scene::getParticleSystems() const {
+const std::vector<ParticleSystem*>& Scene::getParticleSystems() const {
 	return _particleSystems;
 }
 
+JobSystem* Scene::getJobSystem() const {
+	return _jobs;
+}
+
 void Scene::update(float deltaTime) {
-	int i;
-	for (i = 0; i < _particleSystems.size(); i++) {
-		_particleSystems[i]->simulate(deltaTime);
+	//Systems never share particles, so each one is an independent job. Their own
+	//parallel stages nest inside and are balanced by work stealing.
+	std::atomic<int> pending(0);
+	for (ParticleSystem* ps : _particleSystems) {
+		if (!ps->needsGLContext())
+			_jobs->submit([ps, deltaTime]() { ps->simulate(deltaTime); }, pending);
+	}
+
+	for (ParticleSystem* ps : _particleSystems) {
+		if (ps->needsGLContext())
+			ps->simulate(deltaTime);
 	}
+
+	_jobs->wait(pending);
 }
 
 Scene::~Scene() {
@@ -35,4 +59,10 @@ Scene::~Scene() {
 	for (i = 0; i < _particleSystems.size(); i++) {
 		delete _particleSystems[i];
 	}
+
+	for (i = 0; i < _boundaries.size(); i++) {
+		delete _boundaries[i];
+	}
+
+	delete _jobs;
 }
\ No newline at end of file
@@ -5,18 +5,32 @@
 #include "glad/glad.h"
 #include "Mesh.h"
 #include "ParticleSystem.h"
+#include "JobSystem.h"
+#include "SDFGrid.h"
 
 class Scene {
 	std::vector<Mesh*> _meshes;
 	std::vector<ParticleSystem*> _particleSystems;
+	std::vector<SDFGrid*> _boundaries;
+
+	// Shared by every system in the scene for their CPU stages
+	JobSystem* _jobs;
 
 public:
+	Scene(unsigned workerCount = 0);
+
 	void add(Mesh* mesh);
 	void add(ParticleSystem* ps);
+	// Bakes the boundary on the scene's job system, through cachePath when one is given. Systems opt in with setBoundary.
+	void add(SDFGrid* boundary, const std::string& cachePath = "");
+	// Steps every system. CPU systems run concurrently on the job system while the GPU
+	// systems, which need the GL context, are stepped on the calling thread.
 	void update(float deltaTime);
 
-	std::vector<Mesh*> getMeshes() const;
-	std::vector<ParticleSystem*> getParticleSystems() const;
+	// Views into the scene, valid until the next add
+	const std::vector<Mesh*>& getMeshes() const;
+	const std::vector<ParticleSystem*>& getParticleSystems() const;
+	JobSystem* getJobSystem() const;
 
 	~Scene();
 };
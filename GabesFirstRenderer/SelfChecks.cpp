@@ -0,0 +1,302 @@
+#include "SelfChecks.h"
+#include "DomainTransport.h"
+#include "FluidSolver.h"
+#include "SDFGrid.h"
+#include "SPHSolver.h"
+#include "SlabSolver.h"
+#include "SparseBlockGrid.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <glm/mat4x4.hpp>
+
+static bool report(const char* name, bool passed) {
+	std::printf("%s %s\n", passed ? "PASS" : "FAIL", name);
+	return passed;
+}
+
+// A square split into two triangles along its diagonal. The shared edge is inside the shape, so the
+// distance is to the square's outline and the gradient points straight out of the nearest side.
+static bool checkSDFQuad() {
+	float vertices[] = {
+		0.0f, 0.0f, 0.0f,
+		10.0f, 0.0f, 0.0f,
+		10.0f, 10.0f, 0.0f,
+		0.0f, 10.0f, 0.0f
+	};
+	unsigned indices[] = { 0, 1, 2, 0, 2, 3 };
+	SDFGrid grid(glm::vec2(-5.0f), glm::vec2(20.0f), 1.0f);
+	grid.addTriangles(vertices, 4, indices, 6, glm::mat4(1.0f));
+	grid.bake();
+
+	bool passed = true;
+	passed &= std::abs(grid.sample(glm::vec2(5.0f, 5.0f)) + 5.0f) < 1e-3f;
+	passed &= std::abs(grid.sample(glm::vec2(2.0f, 2.0f)) + 2.0f) < 1e-3f;
+	passed &= std::abs(grid.sample(glm::vec2(12.0f, 5.0f)) - 2.0f) < 1e-3f;
+	glm::vec3 gradient = grid.sampleGradient(glm::vec2(2.0f, 5.0f));
+	passed &= gradient.y < -0.99f && std::abs(gradient.z) < 1e-3f;
+	return report("sdf quad", passed);
+}
+
+// Points a little below and left of the origin all land in tile (-1, -1), whose key once matched the
+// table's empty marker. Every neighbour and pair found must match a brute force search.
+static bool checkSparseGridNegativeTiles() {
+	const float radius = 25.0f;
+	std::vector<glm::vec2> points;
+	for (int x = 3; x <= 7; x++) {
+		for (int y = 2; y <= 9; y++) points.push_back(glm::vec2(-x, -y));
+	}
+	unsigned count = (unsigned)points.size();
+	SparseBlockGrid grid(count);
+	grid.updateMap(points.data(), count, radius);
+
+	unsigned expectedPairs = 0;
+	for (unsigned i = 0; i < count; i++) {
+		for (unsigned j = i + 1; j < count; j++) {
+			glm::vec2 offset = points[j] - points[i];
+			if (glm::dot(offset, offset) <= radius * radius) expectedPairs++;
+		}
+	}
+
+	bool passed = grid.tileCount() == 1;
+	unsigned neighbours = 0;
+	grid.forEachNeighbour(points.data(), points[0], radius, [&](unsigned, const glm::vec2&, float) { neighbours++; });
+	passed &= neighbours == count;
+	unsigned pairs = 0;
+	grid.forEachPair(points.data(), radius, nullptr, 64, [&](unsigned, unsigned, const glm::vec2&, float) { pairs++; });
+	passed &= pairs == expectedPairs;
+	return report("sparse grid negative tiles", passed);
+}
+
+// Rows of points spacing apart, width to a row, starting at origin
+static std::vector<glm::vec2> pointBlock(unsigned count, unsigned width, float spacing, glm::vec2 origin) {
+	std::vector<glm::vec2> points;
+	for (unsigned i = 0; i < count; i++) points.push_back(origin + glm::vec2((float)(i % width), (float)(i / width)) * spacing);
+	return points;
+}
+
+// The GPU kernels read the map from buffers sized for capacity, holding whatever an earlier and larger map left
+// wherever nothing new was uploaded. Rebuilds the map from such a buffer image the way ParticleSystem uploads it,
+// for far fewer particles than buckets, and the densities must match the CPU gather exactly.
+static bool checkGPUMapUpload() {
+	const unsigned capacity = 256;
+	SPHParameters params;
+	params.smoothingRadius = 8.0f;
+	SpatialHashMap hash(capacity);
+
+	std::vector<glm::vec2> earlier = pointBlock(240, 20, 3.0f, glm::vec2(40.0f, 10.0f));
+	hash.updateMap(earlier.data(), (unsigned)earlier.size(), params.smoothingRadius);
+	std::vector<unsigned> gpuOffsets(hash._spatialOffsets, hash._spatialOffsets + capacity);
+	std::vector<glm::uvec4> gpuEntries(hash._spatialIndices, hash._spatialIndices + capacity);
+
+	std::vector<glm::vec2> points = pointBlock(60, 10, 3.0f, glm::vec2(5.0f));
+	unsigned count = (unsigned)points.size();
+	hash.updateMap(points.data(), count, params.smoothingRadius);
+	std::memcpy(gpuOffsets.data(), hash._spatialOffsets, hash.offsetBytes());
+	std::memcpy(gpuEntries.data(), hash._spatialIndices, hash.entryBytes());
+
+	SpatialHashMap uploaded(capacity);
+	std::vector<unsigned> cellHashes(count, 0);
+	bool passed = uploaded.restore(gpuEntries.data(), gpuOffsets.data(), cellHashes.data(), capacity, count);
+
+	std::vector<float> densities(count), nearDensities(count), gpuDensities(count), gpuNearDensities(count);
+	computeDensities<2, SpikyPow2Kernel>(hash, points.data(), count, params, nullptr, densities.data(), nearDensities.data(), nullptr, 64);
+	computeDensities<2, SpikyPow2Kernel>(uploaded, points.data(), count, params, nullptr, gpuDensities.data(), gpuNearDensities.data(), nullptr, 64);
+	passed &= densities == gpuDensities && nearDensities == gpuNearDensities;
+	return report("gpu map upload", passed);
+}
+
+static std::vector<glm::vec2> randomPoints(unsigned count, glm::vec2 min, glm::vec2 max, unsigned seed) {
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> x(min.x, max.x), y(min.y, max.y);
+	std::vector<glm::vec2> points;
+	for (unsigned i = 0; i < count; i++) points.push_back(glm::vec2(x(rng), y(rng)));
+	return points;
+}
+
+typedef std::vector<std::pair<unsigned, unsigned>> PairList;
+
+// Every unordered pair within radius, lower index first, sorted. offset gives the vector between two points.
+template <typename Offset>
+static PairList brutePairs(const std::vector<glm::vec2>& points, float radius, Offset offset) {
+	PairList pairs;
+	for (unsigned i = 0; i < points.size(); i++) {
+		for (unsigned j = i + 1; j < points.size(); j++) {
+			glm::vec2 d = offset(points[i], points[j]);
+			if (glm::dot(d, d) <= radius * radius) pairs.push_back(std::make_pair(i, j));
+		}
+	}
+	return pairs;
+}
+
+// The pairs a grid visits, lower index first and sorted but with any repeats kept
+template <class Grid>
+static PairList visitedPairs(const Grid& grid, const std::vector<glm::vec2>& points, float radius) {
+	PairList pairs;
+	grid.forEachPair(points.data(), radius, nullptr, 64, [&](unsigned i, unsigned j, const glm::vec2&, float) {
+		pairs.push_back(std::make_pair(std::min(i, j), std::max(i, j)));
+	});
+	std::sort(pairs.begin(), pairs.end());
+	return pairs;
+}
+
+// Sorted neighbours of each point, itself included
+template <class Grid>
+static std::vector<std::vector<unsigned>> neighbourSets(const Grid& grid, const std::vector<glm::vec2>& points, float radius) {
+	std::vector<std::vector<unsigned>> sets(points.size());
+	for (unsigned i = 0; i < points.size(); i++) {
+		grid.forEachNeighbour(points.data(), points[i], radius, [&](unsigned j, const glm::vec2&, float) { sets[i].push_back(j); });
+		std::sort(sets[i].begin(), sets[i].end());
+	}
+	return sets;
+}
+
+// Points crowded enough for several per cell and many pairs across cell borders. forEachPair must visit
+// each pair within the radius exactly once, the same pairs a brute force search finds.
+static bool checkPairsVisitedOnce() {
+	const float radius = 8.0f;
+	std::vector<glm::vec2> points = randomPoints(600, glm::vec2(-60.0f), glm::vec2(60.0f), 1);
+	SpatialHashMap hash((unsigned)points.size());
+	hash.updateMap(points.data(), (unsigned)points.size(), radius);
+
+	PairList expected = brutePairs(points, radius, [](glm::vec2 a, glm::vec2 b) { return b - a; });
+	return report("pairs visited once", visitedPairs(hash, points, radius) == expected);
+}
+
+// A periodic domain 50 wide holds six cells of 8 and a remainder strip, which wraps onto cell 0. Points on
+// either side of the seam are neighbours through it, as the minimum image brute force finds.
+static bool checkPeriodicWrap() {
+	const float radius = 8.0f;
+	const glm::vec2 min(10.0f), size(50.0f);
+	std::vector<glm::vec2> points = randomPoints(300, min, min + size, 2);
+	//Some in the remainder strip and some just across the seam from it
+	for (int i = 0; i < 20; i++) {
+		points.push_back(min + glm::vec2(48.5f + i * 0.07f, 2.5f * i));
+		points.push_back(min + glm::vec2(0.5f + i * 0.07f, 2.5f * i));
+	}
+	SpatialHashMap hash((unsigned)points.size());
+	hash.setPeriodic(min, size, radius, glm::vec2(1.0f));
+	hash.updateMap(points.data(), (unsigned)points.size(), radius);
+
+	auto minimumImage = [&](glm::vec2 a, glm::vec2 b) {
+		glm::vec2 offset = b - a;
+		return offset - size * glm::round(offset / size);
+	};
+	PairList expected = brutePairs(points, radius, minimumImage);
+	bool passed = visitedPairs(hash, points, radius) == expected;
+
+	std::vector<std::vector<unsigned>> neighbours = neighbourSets(hash, points, radius);
+	std::vector<unsigned> counts(points.size(), 1);
+	for (const auto& pair : expected) {
+		counts[pair.first]++;
+		counts[pair.second]++;
+	}
+	for (unsigned i = 0; i < points.size(); i++) passed &= neighbours[i].size() == counts[i];
+	return report("periodic wrap", passed);
+}
+
+// The sparse grid and the hash map are interchangeable, they must find the same neighbours and pairs for
+// points spread over both signs of every axis
+static bool checkSparseGridMatchesHash() {
+	const float radius = 8.0f;
+	std::vector<glm::vec2> points = randomPoints(800, glm::vec2(-150.0f, -90.0f), glm::vec2(130.0f, 70.0f), 3);
+	unsigned count = (unsigned)points.size();
+	SpatialHashMap hash(count);
+	hash.updateMap(points.data(), count, radius);
+	SparseBlockGrid grid(count);
+	grid.updateMap(points.data(), count, radius);
+
+	bool passed = neighbourSets(grid, points, radius) == neighbourSets(hash, points, radius);
+	passed &= visitedPairs(grid, points, radius) == visitedPairs(hash, points, radius);
+	return report("sparse grid matches hash", passed);
+}
+
+// Totals of a fluid whose particles may be in any order
+struct FluidTotals
+{
+	double count = 0;
+	glm::dvec2 position = glm::dvec2(0.0);
+	double kineticEnergy = 0;
+
+	void add(const glm::vec2* positions, const glm::vec2* velocities, unsigned n) {
+		for (unsigned i = 0; i < n; i++) {
+			count += 1;
+			position += glm::dvec2(positions[i]);
+			kineticEnergy += 0.5 * glm::dot(velocities[i], velocities[i]);
+		}
+	}
+};
+
+// A layer of fluid stepped by one FluidSolver and by a SlabSolver over three threads. Ghosts give owned
+// particles the neighbourhood a single solver would, so the totals must agree up to summation order.
+static bool checkSlabsMatchSingle() {
+	const glm::vec2 tank(240.0f, 120.0f);
+	const unsigned steps = 60;
+	const int ranks = 3;
+	std::vector<glm::vec2> positions = pointBlock(1500, 75, std::sqrt(10.0f), glm::vec2(1.5f));
+
+	auto configure = [&](auto& solver) {
+		solver.params.smoothingRadius = 8.0f;
+		solver.params.targetDensity = 0.1f;
+		solver.params.pressureMultiplier = 500.0f;
+		solver.params.nearPressureMultiplier = 100.0f;
+		solver.gravity = glm::vec2(0.0f, -300.0f);
+		solver.boundsMin = glm::vec2(0.0f);
+		solver.boundsMax = tank;
+	};
+
+	FluidSolver<2> single((unsigned)positions.size());
+	configure(single);
+	single.addParticles(positions.data(), nullptr, (unsigned)positions.size());
+	for (unsigned i = 0; i < steps; i++) single.step(1.0f / 240.0f);
+	FluidTotals expected;
+	expected.add(single.positions(), single.velocities(), single.count());
+
+	LocalTransportGroup group(ranks);
+	std::vector<FluidTotals> totals(ranks);
+	std::vector<char> linked(ranks, 0);
+	std::vector<std::thread> threads;
+	for (int rank = 0; rank < ranks; rank++) {
+		threads.emplace_back([&, rank]() {
+			SlabSolver<2> solver(group.transport(rank));
+			configure(solver);
+			solver.partitionEvenly();
+			for (const glm::vec2& position : positions) solver.addParticle(position);
+			bool stepped = true;
+			for (unsigned i = 0; i < steps && stepped; i++) stepped = solver.step(1.0f / 240.0f);
+			totals[rank].add(solver.positions(), solver.velocities(), solver.count());
+			linked[rank] = stepped;
+		});
+	}
+	for (std::thread& thread : threads) thread.join();
+
+	FluidTotals sum;
+	bool passed = true;
+	for (int rank = 0; rank < ranks; rank++) {
+		passed &= linked[rank] != 0;
+		sum.count += totals[rank].count;
+		sum.position += totals[rank].position;
+		sum.kineticEnergy += totals[rank].kineticEnergy;
+	}
+	passed &= sum.count == expected.count;
+	passed &= glm::length(sum.position / sum.count - expected.position / expected.count) < 1e-4;
+	passed &= std::abs(sum.kineticEnergy - expected.kineticEnergy) <= 1e-6 * expected.kineticEnergy;
+	return report("slabs match single domain", passed);
+}
+
+bool runSelfChecks() {
+	bool passed = true;
+	passed &= checkSDFQuad();
+	passed &= checkSparseGridNegativeTiles();
+	passed &= checkGPUMapUpload();
+	passed &= checkPairsVisitedOnce();
+	passed &= checkPeriodicWrap();
+	passed &= checkSparseGridMatchesHash();
+	passed &= checkSlabsMatchSingle();
+	return passed;
+}
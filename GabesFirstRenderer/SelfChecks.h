@@ -0,0 +1,9 @@
+#ifndef SELF_CHECKS_H
+#define SELF_CHECKS_H
+
+// Small headless scenes with known answers, printing each result: the neighbour structures against brute
+// force and each other, the slab decomposition against a single solver, and geometry that has gone wrong
+// before. False if any of them fails.
+bool runSelfChecks();
+
+#endif
@@ -0,0 +1,54 @@
+#include "SimulationThread.h"
+#include <glfw3.h>
+#include <chrono>
+
+SimulationThread::SimulationThread(Scene* scene, GLFWwindow* sharedContext, float ticksPerSecond) {
+	_scene = scene;
+	_context = sharedContext;
+	_tickInterval = 1.0f / ticksPerSecond;
+	_running = false;
+}
+
+SimulationThread::~SimulationThread() {
+	stop();
+}
+
+void SimulationThread::start() {
+	if (_running) return;
+
+	_running = true;
+	_thread = std::thread(&SimulationThread::run, this);
+}
+
+void SimulationThread::stop() {
+	_running = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+void SimulationThread::run() {
+	typedef std::chrono::steady_clock clock;
+
+	glfwMakeContextCurrent(_context);
+
+	clock::duration tick = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(_tickInterval));
+	clock::time_point lastTick = clock::now();
+	clock::time_point nextTick = lastTick + tick;
+
+	while (_running) {
+		std::this_thread::sleep_until(nextTick);
+
+		clock::time_point now = clock::now();
+		_scene->update(std::chrono::duration<float>(now - lastTick).count());
+		lastTick = now;
+
+		nextTick += tick;
+		if (clock::now() > nextTick) {
+			// Running behind, the systems' accumulators pick up the extra time
+			nextTick = clock::now();
+		}
+	}
+
+	glfwMakeContextCurrent(NULL);
+}
@@ -0,0 +1,33 @@
+#ifndef SIMULATION_THREAD_H
+#define SIMULATION_THREAD_H
+
+#include <atomic>
+#include <thread>
+#include "Scene.h"
+
+struct GLFWwindow;
+
+// Ticks a scene at a fixed rate on its own thread, independent of the render loop.
+// Each tick hands the scene the wall-clock time since the previous one, which the
+// particle systems consume in fixed substeps.
+// The thread draws on a separate GL context that shares objects with the render context.
+class SimulationThread
+{
+	Scene* _scene;
+	GLFWwindow* _context;
+	float _tickInterval;
+
+	std::thread _thread;
+	std::atomic<bool> _running;
+
+	void run();
+
+public:
+	SimulationThread(Scene* scene, GLFWwindow* sharedContext, float ticksPerSecond);
+	~SimulationThread();
+
+	void start();
+	void stop();
+};
+
+#endif
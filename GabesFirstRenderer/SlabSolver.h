@@ -0,0 +1,388 @@
+#ifndef SLAB_SOLVER_H
+#define SLAB_SOLVER_H
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include "DomainTransport.h"
+#include "SPHSolver.h"
+
+// One slab of a fluid decomposed across ranks along an axis of the box. Each rank owns the particles
+// between its two cuts and runs the equation of state passes of FluidSolver on them. Every step it
+// hands particles that crossed a cut to the neighbour on that side, receives the neighbours' particles
+// within one smoothing radius of its cuts as ghosts, and swaps the ghosts' densities once the owners
+// have computed them, so owned particles see exactly the neighbourhood a single solver would give them.
+// Cuts move towards the busier slab when particle counts drift apart.
+template <int Dim>
+class SlabSolver
+{
+public:
+	typedef typename Dimension<Dim>::Vec Vec;
+
+	SPHParameters params;
+	SmoothingKernel kernel = SmoothingKernel::Spiky;
+	Vec gravity;
+	// Bounds of the whole domain, walls only act on the outer faces of the end slabs
+	Vec boundsMin;
+	Vec boundsMax;
+	float collisionDamping = 0.95f;
+	// Axis the domain is cut along
+	int axis = 0;
+	// Steps between rebalancing, 0 turns it off
+	unsigned rebalanceInterval = 50;
+	// A cut moves once one side holds this fraction more particles than the other
+	float rebalanceThreshold = 0.1f;
+
+	SlabSolver(DomainTransport* transport, JobSystem* jobs = nullptr) : _transport(transport), _hash(1024), _jobs(jobs) {
+		gravity = Vec(0.0f);
+		gravity.y = -9.8f;
+		boundsMin = Vec(0.0f);
+		boundsMax = Vec(500.0f);
+	}
+
+	SlabSolver(const SlabSolver&) = delete;
+	SlabSolver& operator=(const SlabSolver&) = delete;
+
+	// Cuts the bounds into equally wide slabs, call once the bounds are set and before adding particles
+	void partitionEvenly() {
+		float width = (boundsMax[axis] - boundsMin[axis]) / _transport->size();
+		_slabMin = boundsMin[axis] + width * _transport->rank();
+		_slabMax = _transport->rank() == _transport->size() - 1 ? boundsMax[axis] : _slabMin + width;
+	}
+
+	// Keeps the particle if it lies in this rank's slab, so every rank can run the same spawn loop
+	bool addParticle(const Vec& position, const Vec& velocity = Vec(0.0f)) {
+		if (!ownsPosition(position)) return false;
+		_positions.push_back(position);
+		_velocities.push_back(velocity);
+		return true;
+	}
+
+	// Owned particles only, ghosts live for the duration of a step
+	unsigned count() const {
+		return (unsigned)_positions.size();
+	}
+
+	const Vec* positions() const {
+		return _positions.data();
+	}
+
+	const Vec* velocities() const {
+		return _velocities.data();
+	}
+
+	const float* densities() const {
+		return _densities.data();
+	}
+
+	float slabMin() const {
+		return _slabMin;
+	}
+
+	float slabMax() const {
+		return _slabMax;
+	}
+
+	// Particles whose predicted position crossed into a neighbour during the last step, and ghosts it received
+	unsigned lastMigrated() const {
+		return _lastMigrated;
+	}
+
+	unsigned lastGhosts() const {
+		return _lastGhosts;
+	}
+
+	// False once an exchange with a neighbour has failed. The slab stops part way through that step and
+	// every later step returns false straight away, the ranks can't carry on without each other.
+	bool step(float deltaTime) {
+		if (_failed) return false;
+		_predictedPositions.resize(count());
+		parallelFor(_jobs, 0, count(), _grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				_velocities[i] += gravity * deltaTime;
+				_predictedPositions[i] = _positions[i] + _velocities[i] * deltaTime;
+			}
+		});
+
+		if (!migrate()) return stop();
+		unsigned n = count();
+
+		//Ghosts are appended after the owned particles and dropped again at the end of the step
+		if (!exchangeHalo()) return stop();
+		unsigned total = (unsigned)_predictedPositions.size();
+		_densities.resize(total);
+		_nearDensities.resize(total);
+
+		if (total > _hash.count()) _hash.resize(std::max(total, _hash.count() * 2));
+		if (_hash.needsRebuild(_predictedPositions.data(), total, params.smoothingRadius, _jobs))
+			_hash.updateMap(_predictedPositions.data(), total, params.smoothingRadius, _jobs);
+
+		bool linked = true;
+		withDensityKernel(kernel, [&](auto densityKernel) {
+			typedef decltype(densityKernel) DensityKernel;
+			computeDensities<Dim, DensityKernel>(_hash, _predictedPositions.data(), n, params, nullptr,
+				_densities.data(), _nearDensities.data(), _jobs, _grainSize);
+			linked = exchangeHaloDensities();
+			if (!linked) return;
+			applyPressureAndViscosity<Dim, DensityKernel>(_hash, _predictedPositions.data(), _densities.data(), _nearDensities.data(), n,
+				params, nullptr, nullptr, _velocities.data(), deltaTime, _scratch, _jobs, _grainSize);
+		});
+		if (!linked) return stop();
+
+		_predictedPositions.resize(n);
+		_velocities.resize(n);
+		parallelFor(_jobs, 0, n, _grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned i = begin; i < end; i++) {
+				_positions[i] += _velocities[i] * deltaTime;
+				resolveCollisions(_positions[i], _velocities[i]);
+			}
+		});
+
+		if (rebalanceInterval > 0 && ++_stepsSinceRebalance >= rebalanceInterval) {
+			_stepsSinceRebalance = 0;
+			if (!rebalance()) return stop();
+		}
+		return true;
+	}
+
+private:
+	static const unsigned _grainSize = 1024;
+
+	DomainTransport* _transport;
+	float _slabMin = 0;
+	float _slabMax = 0;
+
+	std::vector<Vec> _positions;
+	std::vector<Vec> _predictedPositions;
+	std::vector<Vec> _velocities;
+	std::vector<float> _densities;
+	std::vector<float> _nearDensities;
+	SpatialHashMapT<Dim> _hash;
+	SPHScratch<Dim> _scratch;
+	JobSystem* _jobs;
+
+	// Owned particles sent to each neighbour as ghosts this step, in the order they were sent
+	std::vector<unsigned> _haloSent[2];
+	// Ghosts received from each neighbour
+	unsigned _ghostsReceived[2] = {};
+	std::vector<char> _outgoing[2];
+	std::vector<char> _incoming[2];
+
+	unsigned _lastMigrated = 0;
+	unsigned _lastGhosts = 0;
+	unsigned _stepsSinceRebalance = 0;
+	bool _failed = false;
+
+	bool ownsPosition(const Vec& position) const {
+		return (position[axis] >= _slabMin || !hasNeighbour(0)) && (position[axis] < _slabMax || !hasNeighbour(1));
+	}
+
+	// Side 0 is the lower neighbour and side 1 the upper
+	bool hasNeighbour(int side) const {
+		return side == 0 ? _transport->rank() > 0 : _transport->rank() < _transport->size() - 1;
+	}
+
+	int neighbour(int side) const {
+		return _transport->rank() + (side == 0 ? -1 : 1);
+	}
+
+	// Reports the failed exchange and drops any ghosts, owned particles keep whatever of the step was applied
+	bool stop() {
+		std::cout << "ERROR::SLAB_SOLVER::EXCHANGE_FAILED: rank " << _transport->rank() << std::endl;
+		_failed = true;
+		_predictedPositions.resize(count());
+		_velocities.resize(count());
+		return false;
+	}
+
+	// Swaps _outgoing for _incoming with both neighbours. Even ranks start with the upper one and odd ranks
+	// with the lower, so the pairs (0, 1), (2, 3)... swap together, then (1, 2), (3, 4)...
+	bool exchangeWithNeighbours() {
+		int first = _transport->rank() % 2 == 0 ? 1 : 0;
+		for (int k = 0; k < 2; k++) {
+			int side = k == 0 ? first : 1 - first;
+			_incoming[side].clear();
+			if (hasNeighbour(side) && !_transport->exchange(neighbour(side), _outgoing[side], _incoming[side])) return false;
+		}
+		return true;
+	}
+
+	// Hands every particle predicted outside the slab to the neighbour on that side, so the halos only have to
+	// reach a smoothing radius past the cuts. Particles move less than a smoothing radius per step and slabs
+	// are wider, so they never skip a slab.
+	bool migrate() {
+		for (int side = 0; side < 2; side++) _outgoing[side].clear();
+		unsigned kept = 0;
+		unsigned migrated = 0;
+		for (unsigned i = 0; i < count(); i++) {
+			int side = -1;
+			if (_predictedPositions[i][axis] < _slabMin && hasNeighbour(0)) side = 0;
+			else if (_predictedPositions[i][axis] >= _slabMax && hasNeighbour(1)) side = 1;
+
+			if (side < 0) {
+				_positions[kept] = _positions[i];
+				_predictedPositions[kept] = _predictedPositions[i];
+				_velocities[kept] = _velocities[i];
+				kept++;
+				continue;
+			}
+			writeMessage(_outgoing[side], &_positions[i], 1);
+			writeMessage(_outgoing[side], &_predictedPositions[i], 1);
+			writeMessage(_outgoing[side], &_velocities[i], 1);
+			migrated++;
+		}
+		_positions.resize(kept);
+		_predictedPositions.resize(kept);
+		_velocities.resize(kept);
+		_lastMigrated = migrated;
+
+		if (!exchangeWithNeighbours()) return false;
+		for (int side = 0; side < 2; side++) {
+			MessageReader reader(_incoming[side]);
+			size_t arrivals = _incoming[side].size() / (3 * sizeof(Vec));
+			for (size_t a = 0; a < arrivals; a++) {
+				_positions.push_back(reader.read<Vec>());
+				_predictedPositions.push_back(reader.read<Vec>());
+				_velocities.push_back(reader.read<Vec>());
+			}
+		}
+		return true;
+	}
+
+	// Sends the predicted position and velocity of every owned particle within a smoothing radius of a cut
+	// to the neighbour across it, and appends the neighbours' as ghosts
+	bool exchangeHalo() {
+		unsigned n = count();
+		float radius = params.smoothingRadius;
+		for (int side = 0; side < 2; side++) {
+			_haloSent[side].clear();
+			_outgoing[side].clear();
+		}
+		for (unsigned i = 0; i < n; i++) {
+			float x = _predictedPositions[i][axis];
+			if (hasNeighbour(0) && x < _slabMin + radius) _haloSent[0].push_back(i);
+			if (hasNeighbour(1) && x >= _slabMax - radius) _haloSent[1].push_back(i);
+		}
+		for (int side = 0; side < 2; side++) {
+			for (unsigned i : _haloSent[side]) {
+				writeMessage(_outgoing[side], &_predictedPositions[i], 1);
+				writeMessage(_outgoing[side], &_velocities[i], 1);
+			}
+		}
+
+		if (!exchangeWithNeighbours()) return false;
+		_lastGhosts = 0;
+		for (int side = 0; side < 2; side++) {
+			MessageReader reader(_incoming[side]);
+			_ghostsReceived[side] = (unsigned)(_incoming[side].size() / (2 * sizeof(Vec)));
+			for (unsigned g = 0; g < _ghostsReceived[side]; g++) {
+				_predictedPositions.push_back(reader.read<Vec>());
+				_velocities.push_back(reader.read<Vec>());
+			}
+			_lastGhosts += _ghostsReceived[side];
+		}
+		return true;
+	}
+
+	// Densities of the particles sent as ghosts, read back in the order the ghosts were appended
+	bool exchangeHaloDensities() {
+		for (int side = 0; side < 2; side++) {
+			_outgoing[side].clear();
+			for (unsigned i : _haloSent[side]) {
+				writeMessage(_outgoing[side], &_densities[i], 1);
+				writeMessage(_outgoing[side], &_nearDensities[i], 1);
+			}
+		}
+
+		if (!exchangeWithNeighbours()) return false;
+		unsigned ghost = count();
+		for (int side = 0; side < 2; side++) {
+			MessageReader reader(_incoming[side]);
+			for (unsigned g = 0; g < _ghostsReceived[side]; g++, ghost++) {
+				_densities[ghost] = reader.read<float>();
+				_nearDensities[ghost] = reader.read<float>();
+			}
+			//A ghost without its density would push on the owned particles with a wrong pressure
+			if (reader.failed()) return false;
+		}
+		return true;
+	}
+
+	// Each pair of neighbours swaps particle counts. When one side holds rebalanceThreshold more than the other it
+	// picks a new cut that hands half the difference across, never narrowing itself below two smoothing radii,
+	// and sends it over. The particles follow through migrate on the next step.
+	bool rebalance() {
+		unsigned owned = count();
+		for (int side = 0; side < 2; side++) {
+			_outgoing[side].clear();
+			writeMessage(_outgoing[side], &owned, 1);
+		}
+		if (!exchangeWithNeighbours()) return false;
+
+		unsigned neighbourCounts[2] = {};
+		for (int side = 0; side < 2; side++) {
+			if (!hasNeighbour(side)) continue;
+			MessageReader reader(_incoming[side]);
+			neighbourCounts[side] = reader.read<unsigned>();
+			if (reader.failed()) return false;
+		}
+
+		float minWidth = params.smoothingRadius * 2;
+		std::vector<float> coords;
+		float lowerCut = _slabMin;
+		for (int side = 0; side < 2; side++) {
+			float cut = side == 0 ? _slabMin : _slabMax;
+			unsigned handOver = owned > neighbourCounts[side] ? (owned - neighbourCounts[side]) / 2 : 0;
+			//A single particle against an empty neighbour leaves nothing to hand over, the cut stays
+			if (hasNeighbour(side) && owned > neighbourCounts[side] * (1 + rebalanceThreshold) && handOver > 0) {
+				coords.resize(owned);
+				for (unsigned i = 0; i < owned; i++) coords[i] = _positions[i][axis];
+				//The handOver particles nearest the cut go, the new cut sits at the next one in
+				if (side == 0) {
+					std::nth_element(coords.begin(), coords.begin() + handOver, coords.end());
+					cut = std::min(coords[handOver], _slabMax - minWidth);
+				}
+				else {
+					std::nth_element(coords.begin(), coords.begin() + (owned - handOver), coords.end());
+					cut = std::max(coords[owned - handOver], lowerCut + minWidth);
+				}
+			}
+			if (side == 0) lowerCut = cut;
+			_outgoing[side].clear();
+			writeMessage(_outgoing[side], &cut, 1);
+		}
+		if (!exchangeWithNeighbours()) return false;
+
+		//The busier side of each cut decides, both sides reach the same answer from the same counts
+		for (int side = 0; side < 2; side++) {
+			if (!hasNeighbour(side)) continue;
+			MessageReader reader(_incoming[side]);
+			float proposed = reader.read<float>();
+			if (reader.failed()) return false;
+			if (neighbourCounts[side] > owned * (1 + rebalanceThreshold)) {
+				if (side == 0) _slabMin = proposed;
+				else _slabMax = proposed;
+			}
+			else if (owned > neighbourCounts[side] * (1 + rebalanceThreshold)) {
+				if (side == 0) _slabMin = MessageReader(_outgoing[side]).read<float>();
+				else _slabMax = MessageReader(_outgoing[side]).read<float>();
+			}
+		}
+		return true;
+	}
+
+	void resolveCollisions(Vec& position, Vec& velocity) const {
+		for (int a = 0; a < Dim; a++) {
+			if (position[a] < boundsMin[a]) {
+				position[a] = boundsMin[a];
+				velocity[a] *= -collisionDamping;
+			}
+			else if (position[a] > boundsMax[a]) {
+				position[a] = boundsMax[a];
+				velocity[a] *= -collisionDamping;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <atomic>
+#include "SparseBlockGrid.h"
+
+template <int Dim>
+SparseBlockGridT<Dim>::SparseBlockGridT(unsigned particleCount) {
+	_capacity = 0;
+	resize(particleCount);
+	growTable(16);
+}
+
+template <int Dim>
+void SparseBlockGridT<Dim>::resize(unsigned capacity) {
+	_capacity = capacity;
+	_entries.reserve(capacity);
+	_cellKeys.reserve(capacity);
+	_cellSlots.reserve(capacity);
+	//Nothing binned before is kept, like SpatialHashMapT
+	_mappedCount = 0;
+}
+
+template <int Dim>
+void SparseBlockGridT<Dim>::firstTouch(JobSystem* jobs) {
+	_entries.resize(_capacity);
+	_cellKeys.resize(_capacity);
+	_cellSlots.resize(_capacity);
+	parallelForStatic(jobs, 0, _capacity, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++) {
+			_entries[i] = 0;
+			_cellKeys[i] = 0;
+			_cellSlots[i] = 0;
+		}
+	});
+	_mappedCount = 0;
+}
+
+template <int Dim>
+void SparseBlockGridT<Dim>::growTable(unsigned tiles) {
+	unsigned size = 16;
+	while (size < tiles * 2) size *= 2;
+	_tableKeys.assign(size, (unsigned long long)EmptyKey);
+	_tableTiles.resize(size);
+	_tileCount = 0;
+}
+
+template <int Dim>
+unsigned SparseBlockGridT<Dim>::insertTile(unsigned long long key) {
+	unsigned mask = (unsigned)_tableKeys.size() - 1;
+	for (unsigned slot = hashKey(key) & mask;; slot = (slot + 1) & mask) {
+		if (_tableKeys[slot] == key) return _tableTiles[slot];
+		if (_tableKeys[slot] == EmptyKey) {
+			_tableKeys[slot] = key;
+			_tableTiles[slot] = _tileCount;
+			return _tileCount++;
+		}
+	}
+}
+
+template <int Dim>
+size_t SparseBlockGridT<Dim>::memoryUsage() const {
+	return _tableKeys.capacity() * sizeof(unsigned long long) + _tableTiles.capacity() * sizeof(unsigned)
+		+ (_cellStart.capacity() + _fill.capacity() + _entries.capacity()) * sizeof(unsigned)
+		+ _cellKeys.capacity() * sizeof(unsigned long long) + _cellSlots.capacity() * sizeof(unsigned);
+}
+
+template <int Dim>
+void SparseBlockGridT<Dim>::updateMap(const Vec* points, unsigned count, float radius, JobSystem* jobs) {
+	if (count > _capacity) resize(count);
+	_mappedCount = count;
+	_cellKeys.resize(count);
+	_cellSlots.resize(count);
+	_entries.resize(count);
+
+	parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end; i++)
+			_cellKeys[i] = packCoords(positionToCellCoord(points[i], radius));
+	});
+
+	//Tiles are numbered in the order particles first reach them. The table is refilled from empty,
+	//tiles that emptied since the last rebuild drop out, and it doubles until at most half full.
+	unsigned tiles = std::max(_tileCount, 8u);
+	bool rebuilt;
+	do {
+		rebuilt = true;
+		growTable(tiles);
+		//Neighbouring particles mostly share a tile, so the last one is remembered
+		bool haveLast = false;
+		unsigned long long lastKey = 0;
+		unsigned t = MissingTile;
+		for (unsigned i = 0; i < count; i++) {
+			Cell cell = positionToCellCoord(points[i], radius);
+			Cell tile = tileOf(cell);
+			unsigned long long key = packCoords(tile);
+			if (!haveLast || key != lastKey) {
+				haveLast = true;
+				lastKey = key;
+				t = insertTile(key);
+			}
+			if (_tileCount * 2 > _tableKeys.size()) {
+				tiles = _tileCount * 2;
+				rebuilt = false;
+				break;
+			}
+			_cellSlots[i] = t * TileCells + localCell(cell, tile);
+		}
+	} while (!rebuilt);
+
+	//Counting sort of the particles by cell, tile by tile
+	_cellStart.assign((size_t)_tileCount * TileCells + 1, 0);
+	for (unsigned i = 0; i < count; i++) _cellStart[_cellSlots[i] + 1]++;
+	for (size_t c = 1; c < _cellStart.size(); c++) _cellStart[c] += _cellStart[c - 1];
+
+	_fill.assign(_cellStart.begin(), _cellStart.end() - 1);
+	for (unsigned i = 0; i < count; i++) _entries[_fill[_cellSlots[i]]++] = i;
+}
+
+template <int Dim>
+bool SparseBlockGridT<Dim>::needsRebuild(const Vec* points, unsigned count, float radius, JobSystem* jobs) const {
+	if (count != _mappedCount) {
+		return true;
+	}
+
+	std::atomic<bool> moved(false);
+	parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+		for (unsigned i = begin; i < end && !moved.load(std::memory_order_relaxed); i++) {
+			if (packCoords(positionToCellCoord(points[i], radius)) != _cellKeys[i]) {
+				moved = true;
+			}
+		}
+	});
+
+	return moved;
+}
+
+template class SparseBlockGridT<2>;
+template class SparseBlockGridT<3>;
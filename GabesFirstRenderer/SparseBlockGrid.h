@@ -0,0 +1,207 @@
+#ifndef SPARSE_BLOCK_GRID_H
+#define SPARSE_BLOCK_GRID_H
+
+#include <vector>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+#include "Dimension.h"
+#include "JobSystem.h"
+
+// Neighbour grid for unbounded domains, an alternative to SpatialHashMapT with the same interface.
+// Space is cut into tiles of TileSize^Dim cells and only tiles holding particles exist, found through
+// an open addressed table keyed by the tile's coordinates. Inside a tile the cells are dense, so memory
+// grows with the occupied area rather than the extent of the world, cells never collide like modulo
+// hashed buckets do, and a neighbour search mostly stays within one tile.
+template <int Dim>
+class SparseBlockGridT
+{
+public:
+	typedef typename Dimension<Dim>::Vec Vec;
+	typedef glm::vec<Dim, int> Cell;
+
+	static const int TileSize = 8;
+	static const int TileCells = Dim == 2 ? TileSize * TileSize : TileSize * TileSize * TileSize;
+
+private:
+	// packCoords leaves the top bit clear, so no tile's key is ever EmptyKey
+	static const unsigned long long EmptyKey = ~0ull;
+	static const unsigned MissingTile = ~0u;
+
+	// Particles per job when building the grid
+	static const unsigned _grainSize = 2048;
+
+	unsigned _capacity;
+	unsigned _mappedCount = 0;
+
+	// Tile table, a power of two long and at most half full
+	std::vector<unsigned long long> _tableKeys;
+	std::vector<unsigned> _tableTiles;
+	unsigned _tileCount = 0;
+
+	// Cells of tile t are _cellStart[t * TileCells] onwards, a cell's particles are
+	// _entries[_cellStart[cell].._cellStart[cell + 1])
+	std::vector<unsigned> _cellStart;
+	FirstTouchVector<unsigned> _entries;
+	// Next free entry of each cell while filling
+	std::vector<unsigned> _fill;
+
+	// Packed cell of each particle at the last rebuild, and the tile and cell it landed in
+	FirstTouchVector<unsigned long long> _cellKeys;
+	FirstTouchVector<unsigned> _cellSlots;
+
+	static int floorDiv(int value, int divisor) {
+		return value >= 0 ? value / divisor : (value - divisor + 1) / divisor;
+	}
+
+	// Coordinates packed into 63 / Dim bits each
+	static unsigned long long packCoords(const Cell& coords) {
+		const int bits = 63 / Dim;
+		const unsigned long long mask = (1ull << bits) - 1;
+		unsigned long long key = 0;
+		for (int axis = 0; axis < Dim; axis++)
+			key = (key << bits) | ((unsigned long long)(long long)coords[axis] & mask);
+		return key;
+	}
+
+	static unsigned hashKey(unsigned long long key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		return (unsigned)key;
+	}
+
+	static Cell tileOf(const Cell& cell) {
+		Cell tile;
+		for (int axis = 0; axis < Dim; axis++) tile[axis] = floorDiv(cell[axis], TileSize);
+		return tile;
+	}
+
+	static int localCell(const Cell& cell, const Cell& tile) {
+		Cell local = cell - tile * TileSize;
+		int index = 0;
+		for (int axis = Dim - 1; axis >= 0; axis--) index = index * TileSize + local[axis];
+		return index;
+	}
+
+	unsigned insertTile(unsigned long long key);
+	void growTable(unsigned tiles);
+
+	unsigned findTile(unsigned long long key) const {
+		unsigned mask = (unsigned)_tableKeys.size() - 1;
+		for (unsigned slot = hashKey(key) & mask;; slot = (slot + 1) & mask) {
+			if (_tableKeys[slot] == key) return _tableTiles[slot];
+			if (_tableKeys[slot] == EmptyKey) return MissingTile;
+		}
+	}
+
+	// Global index of a cell in _cellStart, or MissingTile when its tile holds no particles.
+	// The last tile looked up is remembered, neighbouring cells usually share it.
+	unsigned cellSlot(const Cell& cell, unsigned long long& lastTileKey, unsigned& lastTile) const {
+		Cell tile = tileOf(cell);
+		unsigned long long key = packCoords(tile);
+		if (key != lastTileKey) {
+			lastTileKey = key;
+			lastTile = findTile(key);
+		}
+		if (lastTile == MissingTile) return MissingTile;
+		return lastTile * TileCells + localCell(cell, tile);
+	}
+
+	template <typename Fn>
+	void forEachInCell(const Vec* points, unsigned slot, const Vec& position, float sqrRadius, Fn& fn) const {
+		for (unsigned e = _cellStart[slot]; e < _cellStart[slot + 1]; e++) {
+			unsigned j = _entries[e];
+			Vec offset = points[j] - position;
+			float sqrDst = glm::dot(offset, offset);
+			if (sqrDst <= sqrRadius) fn(j, offset, sqrDst);
+		}
+	}
+
+public:
+	// Capacity is only a hint for the first allocation, the grid grows with the particles and tiles it is given
+	SparseBlockGridT(unsigned particleCount);
+	void resize(unsigned capacity);
+	// Sizes the per-particle arrays to the capacity and writes them with the job system's static partition,
+	// see SpatialHashMapT::firstTouch. The tiles are rebuilt every update and land wherever they are built.
+	void firstTouch(JobSystem* jobs);
+
+	// Most points the grid holds without reallocating
+	unsigned count() const {
+		return _capacity;
+	}
+
+	unsigned mappedCount() const {
+		return _mappedCount;
+	}
+
+	unsigned tileCount() const {
+		return _tileCount;
+	}
+
+	// Bytes held by the tiles, the table and the per-particle arrays
+	size_t memoryUsage() const;
+
+	static Cell positionToCellCoord(const Vec& point, float radius) {
+		return Cell(glm::floor(point / radius));
+	}
+
+	void updateMap(const Vec* points, unsigned count, float radius, JobSystem* jobs = nullptr);
+	// True once any point has left the cell it was binned into, the grid is exact until then
+	bool needsRebuild(const Vec* points, unsigned count, float radius, JobSystem* jobs = nullptr) const;
+
+	// Calls fn(neighbourIndex, offsetToNeighbour, sqrDistance) for every binned point within
+	// radius of position, itself included
+	template <typename Fn>
+	void forEachNeighbour(const Vec* points, Vec position, float radius, Fn fn) const {
+		if (_mappedCount == 0) return;
+		Cell originCell = positionToCellCoord(position, radius);
+		float sqrRadius = radius * radius;
+		unsigned long long lastTileKey = EmptyKey;
+		unsigned lastTile = MissingTile;
+
+		for (int i = 0; i < Dimension<Dim>::NeighbourCells; i++) {
+			unsigned slot = cellSlot(originCell + Cell(Dimension<Dim>::cellOffset(i)), lastTileKey, lastTile);
+			if (slot != MissingTile) forEachInCell(points, slot, position, sqrRadius, fn);
+		}
+	}
+
+	// Calls fn(i, j, offsetFromIToJ, sqrDistance) once for every unordered pair of distinct binned
+	// points within radius, in the same order as SpatialHashMapT::forEachPair. fn runs concurrently
+	// on the job system and must not write shared per-particle state.
+	template <typename Fn>
+	void forEachPair(const Vec* points, float radius, JobSystem* jobs, unsigned grainSize, Fn fn) const {
+		const int centreCell = Dimension<Dim>::NeighbourCells / 2;
+		float sqrRadius = radius * radius;
+
+		parallelFor(jobs, 0, _mappedCount, grainSize, [&](unsigned begin, unsigned end) {
+			unsigned long long lastTileKey = EmptyKey;
+			unsigned lastTile = MissingTile;
+
+			for (unsigned e = begin; e < end; e++) {
+				unsigned i = _entries[e];
+				Vec position = points[i];
+
+				//Entries are grouped by cell, the later ones of the particle's own cell come first
+				for (unsigned other = e + 1; other < _cellStart[_cellSlots[i] + 1]; other++) {
+					unsigned j = _entries[other];
+					Vec offset = points[j] - position;
+					float sqrDst = glm::dot(offset, offset);
+					if (sqrDst <= sqrRadius) fn(i, j, offset, sqrDst);
+				}
+
+				Cell originCell = positionToCellCoord(position, radius);
+				auto pair = [&](unsigned j, const Vec& offset, float sqrDst) { fn(i, j, offset, sqrDst); };
+				for (int c = centreCell + 1; c < Dimension<Dim>::NeighbourCells; c++) {
+					unsigned slot = cellSlot(originCell + Cell(Dimension<Dim>::cellOffset(c)), lastTileKey, lastTile);
+					if (slot != MissingTile) forEachInCell(points, slot, position, sqrRadius, pair);
+				}
+			}
+		});
+	}
+};
+
+typedef SparseBlockGridT<2> SparseBlockGrid;
+typedef SparseBlockGridT<3> SparseBlockGrid3D;
+
+#endif
@@ -1,31 +1,70 @@
-#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <atomic>
 #include "SpatialHashMap.h"
 #include "utils.h"
 
-SpatialHashMap::SpatialHashMap(unsigned particleCount) {
+template <int Dim>
+SpatialHashMapT<Dim>::SpatialHashMapT(unsigned particleCount) {
 	_count = particleCount;
     _spatialIndices = new glm::uvec4[_count];
 	_spatialOffsets = new unsigned[_count];
+	_cellHashes = new unsigned[_count];
 }
 
-const glm::vec2* SpatialHashMap::offsets2D = new glm::vec2[9] {
-	glm::vec2(-1, 1),
-	glm::vec2(0, 1),
-	glm::vec2(1, 1),
-	glm::vec2(-1, 0),
-	glm::vec2(0, 0),
-	glm::vec2(1, 0),
-	glm::vec2(-1, -1),
-	glm::vec2(0, -1),
-	glm::vec2(1, -1),
-};
+template <int Dim>
+void SpatialHashMapT<Dim>::resize(unsigned capacity) {
+    delete[] _spatialIndices;
+    delete[] _spatialOffsets;
+    delete[] _cellHashes;
 
-glm::uvec4* SpatialHashMap::getMap() const {
+    _count = capacity;
+    _spatialIndices = new glm::uvec4[_count];
+    _spatialOffsets = new unsigned[_count];
+    _cellHashes = new unsigned[_count];
+    //Keys depend on the table size, so nothing binned before is valid any more
+    _mappedCount = 0;
+}
+
+template <int Dim>
+void SpatialHashMapT<Dim>::firstTouch(JobSystem* jobs) {
+    parallelForStatic(jobs, 0, _count, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++) {
+            _spatialIndices[i] = glm::uvec4(0);
+            _spatialOffsets[i] = UINT_MAX;
+            _cellHashes[i] = 0;
+        }
+    });
+}
+
+template <int Dim>
+void SpatialHashMapT<Dim>::setPeriodic(const Vec& min, const Vec& size, float radius, const Vec& axes) {
+    _periodic = glm::dot(axes, axes) > 0;
+    _periodMin = min;
+    _periodSize = size;
+    _periodicAxes = axes;
+    //Cells may be wider than the radius but never narrower, and three per axis keep the stencil from visiting a cell twice
+    _periodCells = glm::max(glm::floor(size / radius), Vec(3.0f));
+    if (_periodic && glm::any(glm::lessThan(size, Vec(3 * radius)) && glm::greaterThan(axes, Vec(0.0f))))
+        std::cout << "WARNING::SPATIAL_HASH::PERIODIC_DOMAIN_SMALLER_THAN_THREE_CELLS" << std::endl;
+    //Cells are counted from the new origin, nothing binned before is valid
+    _mappedCount = 0;
+}
+
+template <int Dim>
+void SpatialHashMapT<Dim>::clearPeriodic() {
+    if (!_periodic) return;
+    _periodic = false;
+    _mappedCount = 0;
+}
+
+template <int Dim>
+glm::uvec4* SpatialHashMapT<Dim>::getMap() const {
     return _spatialIndices;
 }
 
-float* SpatialHashMap::getCells() const {
-    int i;
+template <int Dim>
+float* SpatialHashMapT<Dim>::getCells(JobSystem* jobs) const {
     
     /*int j;
     glm::vec2 root = glm::vec2(1, 0);
@@ -54,33 +93,44 @@ float* SpatialHashMap::getCells() const {
 
     delete[] captures;*/
 
-    float* res = new float[count()];
-    for (i = 0; i < count(); i++) {
-        int swapped = 0;
-        glm::uvec4 entry = get(i);
-        res[entry[0]] = (float)(entry[2]);
-    }
+    float* res = new float[_mappedCount];
+    parallelFor(jobs, 0, _mappedCount, _grainSize, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++) {
+            glm::uvec4 entry = get(i);
+            res[entry[0]] = (float)(entry[2]);
+        }
+    });
 
     return res;
 }
 
-glm::uvec4 SpatialHashMap::get(unsigned index) const {
+template <int Dim>
+glm::uvec4 SpatialHashMapT<Dim>::get(unsigned index) const {
 	assert(index < _count);
 
 	return _spatialIndices[index];
 }
 
-unsigned SpatialHashMap::getStartIndex(unsigned index) const {
+template <int Dim>
+unsigned SpatialHashMapT<Dim>::getStartIndex(unsigned index) const {
 	return _spatialOffsets[index];
 }
 
-unsigned SpatialHashMap::count() const {
+template <int Dim>
+unsigned SpatialHashMapT<Dim>::count() const {
 	return _count;
 }
 
-SpatialHashMap::~SpatialHashMap() {
+template <int Dim>
+unsigned SpatialHashMapT<Dim>::mappedCount() const {
+	return _mappedCount;
+}
+
+template <int Dim>
+SpatialHashMapT<Dim>::~SpatialHashMapT() {
     delete[] _spatialIndices;      // Then delete the array of pointers
     delete[] _spatialOffsets;      // Don't forget this one!
+    delete[] _cellHashes;
 }
 
 void merge(glm::uvec4* arr, int left, int mid, int right) {
@@ -165,62 +215,227 @@ void merge_sort(glm::uvec4* arr, int left, int right) {
     }
 }
 
-void SpatialHashMap::sort() {
-    merge_sort(_spatialIndices, 0, _count);
-}
-
+template <int Dim>
+void SpatialHashMapT<Dim>::sort(JobSystem* jobs) {
+    //Only the entries binned by the last rebuild are live, the rest of the table is spare capacity
+    unsigned count = _mappedCount;
+    if (!jobs || count < 2 * _grainSize) {
+        merge_sort(_spatialIndices, 0, count);
+        return;
+    }
 
+    //Sort one run per thread, then merge neighbouring runs pairwise until one remains
+    unsigned runs = jobs->threadCount();
+    unsigned runSize = (count + runs - 1) / runs;
+    jobs->parallelFor(0, runs, 1, [&](unsigned begin, unsigned end) {
+        for (unsigned run = begin; run < end; run++) {
+            unsigned left = std::min(count, run * runSize);
+            unsigned right = std::min(count, left + runSize);
+            merge_sort(_spatialIndices, left, right);
+        }
+    });
+
+    for (unsigned width = runSize; width < count; width *= 2) {
+        unsigned pairs = (count + 2 * width - 1) / (2 * width);
+        jobs->parallelFor(0, pairs, 1, [&](unsigned begin, unsigned end) {
+            for (unsigned pair = begin; pair < end; pair++) {
+                unsigned left = pair * 2 * width;
+                unsigned mid = std::min(count, left + width);
+                unsigned right = std::min(count, left + 2 * width);
+                if (mid < right)
+                    merge(_spatialIndices, left, mid, right);
+            }
+        });
+    }
+}
 
-void SpatialHashMap::updateMap(const glm::vec2* points, unsigned count, float radius) {
+template <int Dim>
+void SpatialHashMapT<Dim>::updateMap(const Vec* points, unsigned count, float radius, JobSystem* jobs) {
     if (count > _count) {
         return;
     }
+    _mappedCount = count;
+
+    parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++) {
+            //Create
+            unsigned cellHash = this->cellHash(cellCoord(points[i], radius));
+            unsigned cellKey = keyFromHash(cellHash, _count);
+            _spatialIndices[i] = glm::uvec4(i, cellHash, cellKey, 0);
+            _cellHashes[i] = cellHash;
+        }
+    });
+
+    //Every bucket of the table starts empty, not just the first count
+    parallelFor(jobs, 0, _count, _grainSize, [&](unsigned begin, unsigned end) {
+        std::fill(_spatialOffsets + begin, _spatialOffsets + end, UINT_MAX);
+    });
+
+    sort(jobs);
+
+    //Iterates through sorted indices, each bucket start is written by exactly one entry
+    parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++) {
+            unsigned key = _spatialIndices[i][2];
+            unsigned keyPrev = (i == 0) ? UINT_MAX : _spatialIndices[i - 1][2];
+            if (key != keyPrev)
+                _spatialOffsets[key] = i;
+        }
+    });
+}
 
-    for (unsigned i = 0; i < count; i++) {
-        //Create
-        glm::vec2 cellCoord = positionToCellCoord(points[i], radius);
-        unsigned cellHash = hashCell(cellCoord);
-        unsigned cellKey = keyFromHash(cellHash, _count);
-        _spatialIndices[i] = glm::uvec4(i, cellHash, cellKey, 0);
-        _spatialOffsets[i] = UINT_MAX;
+template <int Dim>
+void SpatialHashMapT<Dim>::warmMap(const Vec* points, unsigned count, float radius, JobSystem* jobs) {
+    if (count > _count) {
+        return;
     }
+    _mappedCount = count;
+
+    parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++) {
+            //Create
+            unsigned cellHash = this->cellHash(cellCoord(points[i], radius));
+            unsigned cellKey = keyFromHash(cellHash, _count);
+            _spatialIndices[i] = glm::uvec4(i, cellHash, cellKey, 0);
+            _cellHashes[i] = cellHash;
+        }
+    });
 
-    auto start = std::chrono::high_resolution_clock::now();
-    sort();
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    std::cout << "Sort: " << duration.count() << "ms" << std::endl;
+    //Every bucket of the table starts empty, not just the first count
+    parallelFor(jobs, 0, _count, _grainSize, [&](unsigned begin, unsigned end) {
+        std::fill(_spatialOffsets + begin, _spatialOffsets + end, UINT_MAX);
+    });
+
+    sort(jobs);
 
     //Iterates through sorted indices
-    for (unsigned i = 0; i < count; i++) {
-        unsigned key = _spatialIndices[i][2];
-        unsigned keyPrev = (i == 0) ? UINT_MAX : _spatialIndices[i - 1][2];
-        if (key != keyPrev)
-            _spatialOffsets[key] = i;
+    parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; i++) {
+            unsigned key = _spatialIndices[i][2];
+            unsigned keyPrev = (i == 0) ? UINT_MAX : _spatialIndices[i - 1][2];
+            if (key != keyPrev)
+                _spatialOffsets[key] = i;
+        }
+    });
+}
+
+template <int Dim>
+bool SpatialHashMapT<Dim>::restore(const glm::uvec4* indices, const unsigned* offsets, const unsigned* cellHashes, unsigned tableSize, unsigned mappedCount) {
+    //Keys are taken modulo the table size, a map from any other size would point into the wrong buckets
+    if (tableSize != (unsigned)_count || mappedCount > tableSize) {
+        return false;
     }
+    _mappedCount = mappedCount;
+    std::copy(indices, indices + mappedCount, _spatialIndices);
+    std::copy(offsets, offsets + tableSize, _spatialOffsets);
+    std::copy(cellHashes, cellHashes + mappedCount, _cellHashes);
+    return true;
 }
 
-void SpatialHashMap::warmMap(const glm::vec2* points, unsigned count, float radius) {
-    if (count > _count) {
-        return;
+template <int Dim>
+void SpatialHashMapT<Dim>::invalidate() {
+    _mappedCount = 0;
+}
+
+template <int Dim>
+bool SpatialHashMapT<Dim>::needsRebuild(const Vec* points, unsigned count, float radius, JobSystem* jobs) const {
+    if (count != _mappedCount) {
+        return true;
     }
 
-    for (unsigned i = 0; i < count; i++) {
-        //Create
-        glm::vec2 cellCoord = positionToCellCoord(points[i], radius);
-        unsigned cellHash = hashCell(cellCoord);
-        unsigned cellKey = keyFromHash(cellHash, _count);
-        _spatialIndices[i] = glm::uvec4(i, cellHash, cellKey, 0);
-        _spatialOffsets[i] = UINT_MAX;
+    std::atomic<bool> moved(false);
+    parallelFor(jobs, 0, count, _grainSize, [&](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end && !moved.load(std::memory_order_relaxed); i++) {
+            if (cellHash(cellCoord(points[i], radius)) != _cellHashes[i]) {
+                moved = true;
+            }
+        }
+    });
+
+    return moved;
+}
+
+static int bucketHistogramBin(unsigned bucketSize) {
+    int bin = 0;
+    unsigned upper = 1;
+    while (bucketSize > upper && bin < BUCKET_HISTOGRAM_BINS - 1) {
+        upper <<= 1;
+        bin++;
     }
+    return bin;
+}
 
-    sort();
+template <int Dim>
+void SpatialHashMapT<Dim>::gatherStats(const Vec* points, unsigned count, float radius, unsigned sampleStride, SpatialHashStats& stats) const {
+    stats = SpatialHashStats();
+    if (count == 0 || count > _count) {
+        return;
+    }
+    if (sampleStride == 0) sampleStride = 1;
+
+    //Bucket occupancy, walking the runs of equal keys in the sorted table
+    std::vector<unsigned> runHashes;
+    unsigned runStart = 0;
+    for (unsigned i = 1; i <= count; i++) {
+        if (i < count && _spatialIndices[i][2] == _spatialIndices[runStart][2])
+            continue;
+
+        unsigned bucketSize = i - runStart;
+        stats.occupiedBuckets++;
+        stats.bucketHistogram[bucketHistogramBin(bucketSize)]++;
+        stats.maxBucketSize = std::max(stats.maxBucketSize, bucketSize);
+
+        //Cells sharing a bucket are told apart by their full hash
+        runHashes.clear();
+        for (unsigned j = runStart; j < i; j++)
+            runHashes.push_back(_spatialIndices[j][1]);
+        std::sort(runHashes.begin(), runHashes.end());
+        stats.occupiedCells += (unsigned)(std::unique(runHashes.begin(), runHashes.end()) - runHashes.begin());
+
+        runStart = i;
+    }
 
-    //Iterates through sorted indices
-    for (unsigned i = 0; i < count; i++) {
-        unsigned key = _spatialIndices[i][2];
-        unsigned keyPrev = (i == 0) ? UINT_MAX : _spatialIndices[i - 1][2];
-        if (key != keyPrev)
-            _spatialOffsets[key] = i;
+    //Sampled neighbour search, mirroring the density kernel
+    float sqrRadius = radius * radius;
+    unsigned long long neighbourTotal = 0;
+    stats.minNeighbours = UINT_MAX;
+
+    for (unsigned particle = 0; particle < count; particle += sampleStride) {
+        Vec pos = points[particle];
+        Vec originCell = cellCoord(pos, radius);
+        unsigned neighbours = 0;
+
+        for (int i = 0; i < Dimension<Dim>::NeighbourCells; i++) {
+            unsigned hash = cellHash(originCell + Dimension<Dim>::cellOffset(i));
+            unsigned key = keyFromHash(hash, _count);
+            unsigned currIndex = _spatialOffsets[key];
+
+            while (currIndex < count) {
+                glm::uvec4 entry = _spatialIndices[currIndex++];
+                if (entry[2] != key) break;
+
+                stats.scannedEntries++;
+                if (entry[1] != hash) {
+                    stats.mismatchedEntries++;
+                    continue;
+                }
+
+                if (entry[0] == particle) continue;
+                Vec offset = offsetBetween(pos, points[entry[0]]);
+                if (glm::dot(offset, offset) <= sqrRadius)
+                    neighbours++;
+            }
+        }
+
+        stats.sampledParticles++;
+        neighbourTotal += neighbours;
+        stats.minNeighbours = std::min(stats.minNeighbours, neighbours);
+        stats.maxNeighbours = std::max(stats.maxNeighbours, neighbours);
     }
+
+    stats.meanNeighbours = (float)neighbourTotal / stats.sampledParticles;
+    stats.hashMismatchRatio = stats.scannedEntries > 0 ? (float)stats.mismatchedEntries / stats.scannedEntries : 0.0f;
 }
+
+template class SpatialHashMapT<2>;
+template class SpatialHashMapT<3>;
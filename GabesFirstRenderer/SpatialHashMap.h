@@ -1,48 +1,254 @@
 #pragma once
 #include "glm/vec2.hpp"
 #include "glm/vec4.hpp"
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/vector_relational.hpp>
 #include <cmath>
+#include "JobSystem.h"
+#include "Dimension.h"
 
-class SpatialHashMap
+// Bucket sizes are binned by powers of two: 1, 2, 3-4, 5-8, ... , >64
+const int BUCKET_HISTOGRAM_BINS = 8;
+
+struct SpatialHashStats
+{
+	unsigned sampledParticles = 0;
+	unsigned minNeighbours = 0;
+	unsigned maxNeighbours = 0;
+	float meanNeighbours = 0;
+
+	// Entries walked during neighbour search vs. those skipped for a mismatched hash
+	unsigned long long scannedEntries = 0;
+	unsigned long long mismatchedEntries = 0;
+	float hashMismatchRatio = 0;
+
+	unsigned occupiedBuckets = 0;
+	unsigned occupiedCells = 0;
+	unsigned maxBucketSize = 0;
+	unsigned bucketHistogram[BUCKET_HISTOGRAM_BINS] = {};
+};
+
+// Uniform grid of cells hashed into a table with one bucket per particle of capacity.
+// Entries are sorted by bucket so each bucket's points are contiguous.
+template <int Dim>
+class SpatialHashMapT
 {
+public:
+	typedef typename Dimension<Dim>::Vec Vec;
+
+private:
 	int _count;
+	// Number of points binned by the last rebuild
+	unsigned _mappedCount = 0;
+
+	// Particles per job when building the map
+	static const unsigned _grainSize = 2048;
 
-	// Constants used for hashing
-	static const unsigned _hashK1 = 15823;   // Large prime
-	static const unsigned _hashK2 = 9737333;   // Large prime
+	// Periodic domain. Cells are counted from _periodMin and wrap on the axes where
+	// _periodicAxes is 1, offsets between points take the nearest periodic image.
+	bool _periodic = false;
+	Vec _periodMin = Vec(0.0f);
+	Vec _periodSize = Vec(1.0f);
+	Vec _periodicAxes = Vec(0.0f);
+	Vec _periodCells = Vec(1.0f);
 
 
 public:
 	//index, hash, key
 	glm::uvec4* _spatialIndices;
 	unsigned* _spatialOffsets;
+	// Cell hash of each particle at the last rebuild, indexed by particle
+	unsigned* _cellHashes;
 
-	SpatialHashMap(unsigned particleCount);
-
-	static const glm::vec2* offsets2D;
+	// The table has one bucket per particle of capacity, any number of points up to it can be binned
+	SpatialHashMapT(unsigned particleCount);
+	// Reallocates for a new capacity, the map must be rebuilt afterwards
+	void resize(unsigned capacity);
+	// Writes the table once with the job system's static partition, so its pages are spread over the NUMA
+	// nodes of the workers instead of landing on whichever thread rebuilds first. Call right after allocating.
+	void firstTouch(JobSystem* jobs);
+	// Wraps [min, min + size) on each axis where axes is 1. radius must be the one the map is built with,
+	// the domain should span at least three cells on each wrapped axis. The map must be rebuilt afterwards.
+	void setPeriodic(const Vec& min, const Vec& size, float radius, const Vec& axes);
+	void clearPeriodic();
+	bool isPeriodic() const {
+		return _periodic;
+	}
+	// Cells along each axis of the periodic domain, for kernels that hash on their own
+	Vec periodCells() const {
+		return _periodCells;
+	}
 
 	glm::uvec4* getMap() const;
 	glm::uvec4 get(unsigned index) const;
-	float* getCells() const;
+	float* getCells(JobSystem* jobs = nullptr) const;
 	unsigned getStartIndex(unsigned index) const;
+	// Table size, which is also the most points the map can hold
 	unsigned count() const;
-	void sort();
-	void updateMap(const glm::vec2* points, unsigned count, float radius);
-	void warmMap(const glm::vec2* points, unsigned count, float radius);
+	unsigned mappedCount() const;
+	// What the GPU kernels read of the map: an offset for every bucket, since keys range over the whole table
+	// whatever the live count, and every binned entry
+	size_t offsetBytes() const {
+		return (size_t)_count * sizeof(unsigned);
+	}
+	size_t entryBytes() const {
+		return (size_t)_mappedCount * sizeof(glm::uvec4);
+	}
+	void sort(JobSystem* jobs = nullptr);
+	void updateMap(const Vec* points, unsigned count, float radius, JobSystem* jobs = nullptr);
+	void warmMap(const Vec* points, unsigned count, float radius, JobSystem* jobs = nullptr);
+	// Takes over a map saved from a table of tableSize buckets, for example from a checkpoint: mappedCount entries
+	// and cell hashes, and an offset per bucket. The points must be the ones it was built from. False if the sizes don't fit.
+	bool restore(const glm::uvec4* indices, const unsigned* offsets, const unsigned* cellHashes, unsigned tableSize, unsigned mappedCount);
+	// Forgets the binned points, needsRebuild is true until the next updateMap
+	void invalidate();
+	// True once any point has left the cell it was binned into, the map is exact until then
+	bool needsRebuild(const Vec* points, unsigned count, float radius, JobSystem* jobs = nullptr) const;
+	// Neighbour counts are taken from every sampleStride-th particle, table occupancy from all entries
+	void gatherStats(const Vec* points, unsigned count, float radius, unsigned sampleStride, SpatialHashStats& stats) const;
+
+	// Calls fn(neighbourIndex, offsetToNeighbour, sqrDistance) for every binned point within
+	// radius of position, itself included, walking the surrounding cells like the GPU kernels.
+	// Offsets are minimum images in a periodic domain.
+	template <typename Fn>
+	void forEachNeighbour(const Vec* points, Vec position, float radius, Fn fn) const {
+		Vec originCell = cellCoord(position, radius);
+		float sqrRadius = radius * radius;
+
+		for (int i = 0; i < Dimension<Dim>::NeighbourCells; i++) {
+			unsigned hash = cellHash(originCell + Dimension<Dim>::cellOffset(i));
+			unsigned key = keyFromHash(hash, _count);
+			unsigned currIndex = _spatialOffsets[key];
+
+			while (currIndex < _mappedCount) {
+				glm::uvec4 entry = _spatialIndices[currIndex++];
+				if (entry[2] != key) break;
+				if (entry[1] != hash) continue;
+
+				Vec offset = offsetBetween(position, points[entry[0]]);
+				float sqrDst = glm::dot(offset, offset);
+				if (sqrDst > sqrRadius) continue;
+
+				fn(entry[0], offset, sqrDst);
+			}
+		}
+	}
+
+	// forEachNeighbour for a radius other than the cell size the map was built with. Walks only
+	// the cells the ball around position overlaps, fewer than the 3^Dim stencil when radius is
+	// below cellSize and as many as it takes when above.
+	template <typename Fn>
+	void forEachWithin(const Vec* points, Vec position, float radius, float cellSize, Fn fn) const {
+		Vec originCell = cellCoord(position, cellSize);
+		//Measured from the unwrapped position so the range stays the same inside a periodic domain
+		Vec first = positionToCellCoord(position - Vec(radius), cellSize) - positionToCellCoord(position, cellSize);
+		Vec extent = positionToCellCoord(position + Vec(radius), cellSize) - positionToCellCoord(position, cellSize) - first + Vec(1.0f);
+		int cells = 1;
+		for (int axis = 0; axis < Dim; axis++) cells *= (int)extent[axis];
+		float sqrRadius = radius * radius;
 
-	~SpatialHashMap();
+		for (int c = 0; c < cells; c++) {
+			Vec cell = originCell + first;
+			int rest = c;
+			for (int axis = 0; axis < Dim; axis++) {
+				cell[axis] += (float)(rest % (int)extent[axis]);
+				rest /= (int)extent[axis];
+			}
+
+			unsigned hash = cellHash(cell);
+			unsigned key = keyFromHash(hash, _count);
+			unsigned currIndex = _spatialOffsets[key];
+
+			while (currIndex < _mappedCount) {
+				glm::uvec4 entry = _spatialIndices[currIndex++];
+				if (entry[2] != key) break;
+				if (entry[1] != hash) continue;
+
+				Vec offset = offsetBetween(position, points[entry[0]]);
+				float sqrDst = glm::dot(offset, offset);
+				if (sqrDst > sqrRadius) continue;
+
+				fn(entry[0], offset, sqrDst);
+			}
+		}
+	}
+
+	// Calls fn(i, j, offsetFromIToJ, sqrDistance) once for every unordered pair of distinct binned
+	// points within radius. Each entry pairs with the later entries of its own cell and with the
+	// forward half of the surrounding cells, whose mirror images are visited from the other side.
+	// fn runs concurrently on the job system and must not write shared per-particle state.
+	template <typename Fn>
+	void forEachPair(const Vec* points, float radius, JobSystem* jobs, unsigned grainSize, Fn fn) const {
+		const int centreCell = Dimension<Dim>::NeighbourCells / 2;
+		float sqrRadius = radius * radius;
+
+		parallelFor(jobs, 0, _mappedCount, grainSize, [&](unsigned begin, unsigned end) {
+			for (unsigned e = begin; e < end; e++) {
+				glm::uvec4 entry = _spatialIndices[e];
+				unsigned i = entry[0];
+				Vec position = points[i];
+
+				for (unsigned other = e + 1; other < _mappedCount; other++) {
+					glm::uvec4 neighbour = _spatialIndices[other];
+					if (neighbour[2] != entry[2]) break;
+					if (neighbour[1] != entry[1]) continue;
+
+					Vec offset = offsetBetween(position, points[neighbour[0]]);
+					float sqrDst = glm::dot(offset, offset);
+					if (sqrDst <= sqrRadius) fn(i, neighbour[0], offset, sqrDst);
+				}
+
+				Vec originCell = cellCoord(position, radius);
+				for (int c = centreCell + 1; c < Dimension<Dim>::NeighbourCells; c++) {
+					unsigned hash = cellHash(originCell + Dimension<Dim>::cellOffset(c));
+					unsigned key = keyFromHash(hash, _count);
+					unsigned currIndex = _spatialOffsets[key];
+
+					while (currIndex < _mappedCount) {
+						glm::uvec4 neighbour = _spatialIndices[currIndex++];
+						if (neighbour[2] != key) break;
+						if (neighbour[1] != hash) continue;
+
+						Vec offset = offsetBetween(position, points[neighbour[0]]);
+						float sqrDst = glm::dot(offset, offset);
+						if (sqrDst <= sqrRadius) fn(i, neighbour[0], offset, sqrDst);
+					}
+				}
+			}
+		});
+	}
+
+	~SpatialHashMapT();
+
+	static Vec positionToCellCoord(const Vec& point, float radius) {
+		return glm::floor(point / radius);
+	}
+
+	static unsigned hashCell(const Vec& cell) {
+		return Dimension<Dim>::hashCell(cell);
+	}
+
+	// Cell of a point. In a periodic domain the point is wrapped in first and cells are counted from
+	// its origin, the remainder when size is not a whole number of cells wraps onto cell 0.
+	Vec cellCoord(const Vec& point, float radius) const {
+		if (!_periodic) return positionToCellCoord(point, radius);
+		Vec local = point - _periodMin;
+		local -= _periodicAxes * _periodSize * glm::floor(local / _periodSize);
+		return glm::floor(local / radius);
+	}
 
-	static glm::vec2 positionToCellCoord(const glm::vec2& point, float radius) {
-		return glm::vec2(
-			std::floor(point.x / radius),
-			std::floor(point.y / radius)
-		);
+	// Hash of a cell, wrapped into the periodic domain first
+	unsigned cellHash(const Vec& cell) const {
+		if (!_periodic) return hashCell(cell);
+		return hashCell(cell - _periodicAxes * _periodCells * glm::floor(cell / _periodCells));
 	}
 
-	static unsigned hashCell(const glm::vec2& cell) {
-		unsigned a = (unsigned)cell.x * _hashK1;
-		unsigned b = (unsigned)cell.y * _hashK2;
-		return (a + b);
+	// Offset from one point to the nearest periodic image of another
+	Vec offsetBetween(const Vec& from, const Vec& to) const {
+		Vec offset = to - from;
+		if (_periodic) offset -= _periodicAxes * _periodSize * glm::round(offset / _periodSize);
+		return offset;
 	}
 
 	static unsigned keyFromHash(unsigned hash, int count) {
@@ -50,3 +256,5 @@ public:
 	}
 };
 
+typedef SpatialHashMapT<2> SpatialHashMap;
+typedef SpatialHashMapT<3> SpatialHashMap3D;
@@ -0,0 +1,308 @@
+#include "SweepRunner.h"
+#include "FluidSolver.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+// Reads every remaining value on the line, from:to:step expanding to the values it covers.
+// positive rejects zero and below, checked before the cast too since a negative count would wrap to a huge unsigned.
+template <typename T>
+static bool parseValues(std::istringstream& line, std::vector<T>& values, bool positive = false) {
+	std::vector<T> parsed;
+	std::string token;
+	while (line >> token) {
+		size_t first = token.find(':');
+		try {
+			if (first == std::string::npos) {
+				double value = std::stod(token);
+				if (positive && !(value > 0 && (T)value > 0)) return false;
+				parsed.push_back((T)value);
+				continue;
+			}
+			size_t second = token.find(':', first + 1);
+			if (second == std::string::npos) return false;
+			double from = std::stod(token.substr(0, first));
+			double to = std::stod(token.substr(first + 1, second - first - 1));
+			double step = std::stod(token.substr(second + 1));
+			if (step <= 0 || to < from || (positive && !(from > 0 && (T)from > 0))) return false;
+			//Counted rather than accumulated, so the last value isn't lost to rounding
+			unsigned count = (unsigned)std::floor((to - from) / step + 1e-6) + 1;
+			for (unsigned i = 0; i < count; i++) parsed.push_back((T)(from + step * i));
+		}
+		catch (const std::exception&) {
+			return false;
+		}
+	}
+	if (parsed.empty()) return false;
+	values.swap(parsed);
+	return true;
+}
+
+template <typename T>
+static bool parseValue(std::istringstream& line, T& value, bool positive = false) {
+	std::vector<T> values;
+	if (!parseValues(line, values, positive) || values.size() != 1) return false;
+	value = values[0];
+	return true;
+}
+
+// Particles spaced for the target density start on a grid of this pitch
+static float blockSpacing(float targetDensity) {
+	return std::sqrt(1.0f / targetDensity);
+}
+
+// Most particles the starting block holds inside the tank
+static unsigned long long blockCapacity(glm::vec2 tank, float targetDensity) {
+	float spacing = blockSpacing(targetDensity);
+	return (unsigned long long)std::max((unsigned)(tank.x / spacing), 1u) * std::max((unsigned)(tank.y / spacing), 1u);
+}
+
+bool SweepSpec::load(const std::string& path) {
+	std::ifstream file(path);
+	if (!file) {
+		std::cout << "ERROR::SWEEP_SPEC::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	std::string text;
+	unsigned lineNumber = 0;
+	while (std::getline(file, text)) {
+		lineNumber++;
+		text = text.substr(0, text.find('#'));
+		std::istringstream line(text);
+		std::string key;
+		if (!(line >> key)) continue;
+
+		bool parsed = true;
+		if (key == "particles") parsed = parseValues(line, particles, true);
+		else if (key == "smoothingRadius") parsed = parseValues(line, smoothingRadius, true);
+		else if (key == "targetDensity") parsed = parseValues(line, targetDensity, true);
+		else if (key == "pressureMultiplier") parsed = parseValues(line, pressureMultiplier);
+		else if (key == "nearPressureMultiplier") parsed = parseValues(line, nearPressureMultiplier);
+		else if (key == "viscosityStrength") parsed = parseValues(line, viscosityStrength);
+		else if (key == "steps") parsed = parseValue(line, steps, true);
+		else if (key == "timeStep") parsed = parseValue(line, timeStep, true);
+		else if (key == "gravity") parsed = parseValue(line, gravity);
+		else if (key == "repeats") parsed = parseValue(line, repeats, true);
+		else if (key == "measureFraction") parsed = parseValue(line, measureFraction);
+		else if (key == "packThreshold") parsed = parseValue(line, packThreshold);
+		else if (key == "tank") {
+			std::vector<float> size;
+			parsed = parseValues(line, size) && size.size() == 2;
+			if (parsed) tank = glm::vec2(size[0], size[1]);
+		}
+		else if (key == "output") parsed = (bool)(line >> output);
+		else {
+			std::cout << "WARNING::SWEEP_SPEC::UNKNOWN_KEY: " << key << " on line " << lineNumber << std::endl;
+			continue;
+		}
+
+		if (!parsed) {
+			std::cout << "ERROR::SWEEP_SPEC::BAD_VALUE: " << key << " on line " << lineNumber << " of " << path << std::endl;
+			return false;
+		}
+	}
+
+	//Runs that start with particles stacked on the lid would measure the overflow, not the parameters
+	for (unsigned count : particles) {
+		for (float density : targetDensity) {
+			if (count > blockCapacity(tank, density)) {
+				std::cout << "ERROR::SWEEP_SPEC::TANK_TOO_SMALL: " << count << " particles at target density " << density
+					<< " need more than " << tank.x << "x" << tank.y << " in " << path << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+std::vector<SweepConfiguration> SweepSpec::configurations() const {
+	std::vector<SweepConfiguration> configurations;
+	for (unsigned count : particles)
+		for (float radius : smoothingRadius)
+			for (float density : targetDensity)
+				for (float pressure : pressureMultiplier)
+					for (float nearPressure : nearPressureMultiplier)
+						for (float viscosity : viscosityStrength) {
+							SweepConfiguration configuration;
+							configuration.particles = count;
+							configuration.params.smoothingRadius = radius;
+							configuration.params.targetDensity = density;
+							configuration.params.pressureMultiplier = pressure;
+							configuration.params.nearPressureMultiplier = nearPressure;
+							configuration.params.viscosityStrength = viscosity;
+							configurations.push_back(configuration);
+						}
+	return configurations;
+}
+
+static bool allFinite(const glm::vec2* values, unsigned count) {
+	for (unsigned i = 0; i < count; i++)
+		if (!std::isfinite(values[i].x) || !std::isfinite(values[i].y)) return false;
+	return true;
+}
+
+SweepRunner::RunResult SweepRunner::simulate(const SweepSpec& spec, const SweepConfiguration& configuration, unsigned repeat, JobSystem* jobs) const {
+	RunResult result;
+	const SPHParameters& params = configuration.params;
+	unsigned count = configuration.particles;
+
+	FluidSolver<2> solver(count, jobs);
+	solver.params = params;
+	solver.gravity = glm::vec2(0.0f, spec.gravity);
+	solver.boundsMin = glm::vec2(0.0f);
+	solver.boundsMax = spec.tank;
+
+	//Unit masses spaced for the target density, in a block half the tank wide, or wider where that would stand
+	//taller than the tank. Repeats differ in the jitter only.
+	float spacing = blockSpacing(params.targetDensity);
+	unsigned columns = std::max((unsigned)(spec.tank.x * 0.5f / spacing), 1u);
+	unsigned rows = std::max((unsigned)(spec.tank.y / spacing), 1u);
+	if ((count + columns - 1) / columns > rows)
+		columns = std::min((count + rows - 1) / rows, std::max((unsigned)(spec.tank.x / spacing), 1u));
+	std::mt19937 rng(repeat + 1);
+	std::uniform_real_distribution<float> jitter(-0.1f * spacing, 0.1f * spacing);
+	std::vector<glm::vec2> positions(count);
+	for (unsigned i = 0; i < count; i++) {
+		glm::vec2 position = (glm::vec2((float)(i % columns), (float)(i / columns)) + 0.5f) * spacing;
+		positions[i] = glm::clamp(position + glm::vec2(jitter(rng), jitter(rng)), glm::vec2(0.0f), spec.tank);
+	}
+	solver.addParticles(positions.data(), nullptr, count);
+
+	unsigned measuredSteps = std::min((unsigned)std::ceil(spec.steps * glm::clamp(spec.measureFraction, 0.0f, 1.0f)), spec.steps);
+	unsigned measureFrom = spec.steps - measuredSteps;
+	unsigned measured = 0;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	for (unsigned step = 0; step < spec.steps; step++) {
+		solver.step(spec.timeStep);
+
+		//A blown up run is stopped early, there is nothing left to measure
+		if ((step >= measureFrom || step % 16 == 0) && !allFinite(solver.positions(), count)) {
+			result.unstable = true;
+			break;
+		}
+		if (step < measureFrom || count == 0) continue;
+
+		const float* densities = solver.densities();
+		double sum = 0, error = 0;
+		float largest = 0;
+		for (unsigned i = 0; i < count; i++) {
+			sum += densities[i];
+			error += std::abs(densities[i] - params.targetDensity);
+			largest = std::max(largest, densities[i]);
+		}
+		result.meanDensityRatio += sum / count / params.targetDensity;
+		result.densityError += error / count / params.targetDensity;
+		result.maxDensityRatio = std::max(result.maxDensityRatio, (double)largest / params.targetDensity);
+		measured++;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	result.milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+
+	if (measured > 0) {
+		result.meanDensityRatio /= measured;
+		result.densityError /= measured;
+	}
+
+	const glm::vec2* velocities = solver.velocities();
+	for (unsigned i = 0; i < count && !result.unstable; i++) {
+		float sqrSpeed = glm::dot(velocities[i], velocities[i]);
+		result.kineticEnergy += 0.5 * sqrSpeed;
+		result.maxSpeed = std::max(result.maxSpeed, (double)std::sqrt(sqrSpeed));
+	}
+	if (count > 0) result.kineticEnergy /= count;
+	return result;
+}
+
+std::vector<SweepSummary> SweepRunner::run(const SweepSpec& spec) const {
+	std::vector<SweepConfiguration> configurations = spec.configurations();
+	unsigned repeats = std::max(spec.repeats, 1u);
+	std::vector<RunResult> results(configurations.size() * repeats);
+
+	std::vector<Run> packed;
+	std::vector<Run> large;
+	for (unsigned c = 0; c < configurations.size(); c++) {
+		for (unsigned r = 0; r < repeats; r++) {
+			Run run = { c, r, (unsigned long long)configurations[c].particles * spec.steps };
+			if (configurations[c].particles < spec.packThreshold) packed.push_back(run);
+			else large.push_back(run);
+		}
+	}
+
+	//Small runs barely split across threads, so each runs whole on one worker. Handing out the most expensive
+	//first, each to the least loaded bin, evens the bins out and every worker gets one bin.
+	unsigned binCount = _jobs ? _jobs->threadCount() : 1;
+	std::sort(packed.begin(), packed.end(), [](const Run& a, const Run& b) { return a.cost > b.cost; });
+	std::vector<std::vector<Run>> bins(binCount);
+	std::vector<unsigned long long> loads(binCount, 0);
+	for (const Run& run : packed) {
+		unsigned bin = (unsigned)(std::min_element(loads.begin(), loads.end()) - loads.begin());
+		bins[bin].push_back(run);
+		loads[bin] += run.cost;
+	}
+
+	printf("Sweep: %u configurations x %u repeats, %u runs packed on %u threads, %u large runs\n",
+		(unsigned)configurations.size(), repeats, (unsigned)packed.size(), binCount, (unsigned)large.size());
+
+	auto start = std::chrono::high_resolution_clock::now();
+	parallelFor(_jobs, 0, binCount, 1, [&](unsigned begin, unsigned end) {
+		for (unsigned bin = begin; bin < end; bin++) {
+			for (const Run& run : bins[bin])
+				results[run.configuration * repeats + run.repeat] = simulate(spec, configurations[run.configuration], run.repeat, nullptr);
+		}
+	});
+	for (const Run& run : large)
+		results[run.configuration * repeats + run.repeat] = simulate(spec, configurations[run.configuration], run.repeat, _jobs);
+	auto end = std::chrono::high_resolution_clock::now();
+	printf("Sweep finished in %.1fs\n", std::chrono::duration<double>(end - start).count());
+
+	std::vector<SweepSummary> summaries;
+	for (unsigned c = 0; c < configurations.size(); c++) {
+		SweepSummary summary;
+		summary.configuration = configurations[c];
+		double meanDensityRatio = 0, densityError = 0, kineticEnergy = 0, maxSpeed = 0, milliseconds = 0;
+		for (unsigned r = 0; r < repeats; r++) {
+			const RunResult& result = results[c * repeats + r];
+			summary.unstable |= result.unstable;
+			meanDensityRatio += result.meanDensityRatio;
+			densityError += result.densityError;
+			kineticEnergy += result.kineticEnergy;
+			maxSpeed += result.maxSpeed;
+			milliseconds += result.milliseconds;
+			summary.maxDensityRatio = std::max(summary.maxDensityRatio, (float)result.maxDensityRatio);
+		}
+		summary.meanDensityRatio = (float)(meanDensityRatio / repeats);
+		summary.densityError = (float)(densityError / repeats);
+		summary.kineticEnergy = (float)(kineticEnergy / repeats);
+		summary.maxSpeed = (float)(maxSpeed / repeats);
+		summary.millisecondsPerStep = spec.steps > 0 ? (float)(milliseconds / repeats / spec.steps) : 0.0f;
+		summaries.push_back(summary);
+	}
+	return summaries;
+}
+
+bool SweepRunner::writeSummaries(const std::string& path, const std::vector<SweepSummary>& summaries) {
+	std::ofstream file(path, std::ios::trunc);
+	file << "particles,smoothingRadius,targetDensity,pressureMultiplier,nearPressureMultiplier,viscosityStrength,"
+		<< "unstable,meanDensityRatio,densityError,maxDensityRatio,kineticEnergy,maxSpeed,msPerStep\n";
+	for (const SweepSummary& summary : summaries) {
+		const SweepConfiguration& configuration = summary.configuration;
+		file << configuration.particles << ',' << configuration.params.smoothingRadius << ',' << configuration.params.targetDensity << ','
+			<< configuration.params.pressureMultiplier << ',' << configuration.params.nearPressureMultiplier << ','
+			<< configuration.params.viscosityStrength << ',' << (summary.unstable ? 1 : 0) << ',' << summary.meanDensityRatio << ','
+			<< summary.densityError << ',' << summary.maxDensityRatio << ',' << summary.kineticEnergy << ',' << summary.maxSpeed << ','
+			<< summary.millisecondsPerStep << '\n';
+	}
+
+	if (!file) {
+		std::cout << "ERROR::SWEEP_RUNNER::SUMMARY_NOT_WRITTEN: " << path << std::endl;
+		return false;
+	}
+	return true;
+}
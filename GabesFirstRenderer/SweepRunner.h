@@ -0,0 +1,115 @@
+#ifndef SWEEP_RUNNER_H
+#define SWEEP_RUNNER_H
+
+#include <string>
+#include <vector>
+#include <glm/vec2.hpp>
+#include "JobSystem.h"
+#include "SPHSolver.h"
+
+// One point of a sweep
+struct SweepConfiguration
+{
+	SPHParameters params;
+	unsigned particles;
+};
+
+// Every combination of the listed values is simulated. Read from a text file of "key value..." lines,
+// '#' starts a comment. Swept keys take any number of values, and from:to:step expands to a range:
+//
+//   particles 2000 8000
+//   smoothingRadius 8:12:2
+//   targetDensity 0.1
+//   pressureMultiplier 500 1000
+//   nearPressureMultiplier 100
+//   viscosityStrength 0
+//   steps 600
+//   timeStep 0.0041667
+//   tank 300 300
+//   gravity -300
+//   repeats 2
+//   measureFraction 0.25
+//   packThreshold 20000
+//   output sweep.csv
+struct SweepSpec
+{
+	std::vector<unsigned> particles = { 2000 };
+	std::vector<float> smoothingRadius = { 8.0f };
+	std::vector<float> targetDensity = { 0.1f };
+	std::vector<float> pressureMultiplier = { 1000.0f };
+	std::vector<float> nearPressureMultiplier = { 100.0f };
+	std::vector<float> viscosityStrength = { 0.0f };
+
+	unsigned steps = 600;
+	float timeStep = 1.0f / 240.0f;
+	// The block of particles starts in the lower left of a tank of this size, half its width or wider if that
+	// would stand taller than the tank
+	glm::vec2 tank = glm::vec2(300.0f);
+	float gravity = -300.0f;
+	// Runs per configuration, each from a differently jittered block, metrics are averaged over them
+	unsigned repeats = 1;
+	// Metrics are averaged over this last fraction of the steps, once the block has had time to settle
+	float measureFraction = 0.25f;
+	// Runs with fewer particles each take a single worker and are packed together so every worker stays busy,
+	// larger ones run one at a time spread over the whole job system
+	unsigned packThreshold = 20000;
+	std::string output = "sweep.csv";
+
+	// Reports malformed lines and unknown keys, false if the file can't be read, a value doesn't parse or
+	// some particle count doesn't fit in the tank at its target density
+	bool load(const std::string& path);
+	std::vector<SweepConfiguration> configurations() const;
+};
+
+// Averages over the repeats of one configuration
+struct SweepSummary
+{
+	SweepConfiguration configuration;
+	// Any repeat ended with positions that weren't finite
+	bool unstable = false;
+	// Mean density over the target, 1 at rest
+	float meanDensityRatio = 0;
+	// Mean of |density - target| / target
+	float densityError = 0;
+	// Largest density over the target in any measured step
+	float maxDensityRatio = 0;
+	// Per particle at the last step, 0 once settled
+	float kineticEnergy = 0;
+	float maxSpeed = 0;
+	float millisecondsPerStep = 0;
+};
+
+// Runs a sweep's headless simulations concurrently on a job system
+class SweepRunner
+{
+	struct Run {
+		unsigned configuration;
+		unsigned repeat;
+		unsigned long long cost;
+	};
+
+	struct RunResult {
+		bool unstable = false;
+		double meanDensityRatio = 0;
+		double densityError = 0;
+		double maxDensityRatio = 0;
+		double kineticEnergy = 0;
+		double maxSpeed = 0;
+		double milliseconds = 0;
+	};
+
+	JobSystem* _jobs;
+
+	// Steps one run to the end, parallel inside only when jobs isn't null
+	RunResult simulate(const SweepSpec& spec, const SweepConfiguration& configuration, unsigned repeat, JobSystem* jobs) const;
+
+public:
+	// nullptr runs everything on the calling thread
+	SweepRunner(JobSystem* jobs) : _jobs(jobs) {}
+
+	std::vector<SweepSummary> run(const SweepSpec& spec) const;
+	// One CSV row per configuration
+	static bool writeSummaries(const std::string& path, const std::vector<SweepSummary>& summaries);
+};
+
+#endif
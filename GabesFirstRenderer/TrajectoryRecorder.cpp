@@ -0,0 +1,330 @@
+#include "TrajectoryRecorder.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+static const char TRAJECTORY_MAGIC[4] = { 'G', 'R', 'T', 'R' };
+static const char INDEX_MAGIC[4] = { 'G', 'R', 'T', 'I' };
+
+struct TrajectoryHeader
+{
+	char magic[4];
+	unsigned version;
+	float positionStep;
+	float velocityStep;
+};
+
+struct TrajectoryFooter
+{
+	unsigned long long indexOffset;
+	unsigned chunkCount;
+	unsigned frameCount;
+	char magic[4];
+	unsigned reserved;
+};
+
+// Values past the range of an int are clamped, far beyond any window. NaN and infinities of a blown up
+// run are stored as 0, converting NaN to an int is undefined.
+static int quantise(float value, float step) {
+	double scaled = std::round((double)value / step);
+	if (!std::isfinite(scaled)) return 0;
+	return (int)std::max(std::min(scaled, 2147483647.0), -2147483647.0);
+}
+
+// Small deltas of either sign become small unsigned values
+static unsigned zigzag(int value) {
+	return ((unsigned)value << 1) ^ (unsigned)(value >> 31);
+}
+
+static int unzigzag(unsigned value) {
+	return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+static void writeVarint(std::vector<unsigned char>& out, unsigned value) {
+	while (value >= 0x80) {
+		out.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((unsigned char)value);
+}
+
+// Advances at, false past end
+static bool readVarint(const unsigned char*& at, const unsigned char* end, unsigned& value) {
+	value = 0;
+	for (unsigned shift = 0; shift < 35; shift += 7) {
+		if (at == end) return false;
+		unsigned char byte = *at++;
+		value |= (unsigned)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+TrajectoryRecorder::TrajectoryRecorder(const std::string& path, const TrajectoryOptions& options)
+	: _options(options), _path(path), _recordedFrames(0), _droppedFrames(0), _bytesWritten(0) {
+	_options.framesPerChunk = std::max(_options.framesPerChunk, 1u);
+	_options.bufferCount = std::max(_options.bufferCount, 1u);
+
+	_file.open(path, std::ios::binary | std::ios::trunc);
+	if (!_file) {
+		std::cout << "ERROR::TRAJECTORY_RECORDER::FILE_NOT_OPENED: " << path << std::endl;
+		return;
+	}
+
+	TrajectoryHeader header;
+	std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+	header.version = TRAJECTORY_VERSION;
+	header.positionStep = _options.positionStep;
+	header.velocityStep = _options.velocityStep;
+	writeBytes(&header, sizeof(header));
+
+	for (unsigned i = 0; i < _options.bufferCount; i++) {
+		_buffers.push_back(new FrameBuffer());
+		_free.push_back(_buffers.back());
+	}
+	_open = true;
+	_writer = std::thread(&TrajectoryRecorder::writerLoop, this);
+}
+
+TrajectoryRecorder::~TrajectoryRecorder() {
+	close();
+	for (FrameBuffer* buffer : _buffers) delete buffer;
+}
+
+bool TrajectoryRecorder::record(float time, const glm::vec2* positions, const glm::vec2* velocities, unsigned count) {
+	FrameBuffer* buffer;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (!_open || _stopping) return false;
+		if (_free.empty()) {
+			if (_options.backPressure == RecorderBackPressure::Drop) {
+				_droppedFrames++;
+				return false;
+			}
+			_bufferFreed.wait(lock, [&]() { return !_free.empty(); });
+		}
+		buffer = _free.back();
+		_free.pop_back();
+	}
+
+	//Copied outside the lock so the writer keeps encoding meanwhile. The buffers keep their capacity between frames.
+	buffer->time = time;
+	buffer->positions.assign(positions, positions + count);
+	buffer->velocities.assign(velocities, velocities + count);
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_filled.push_back(buffer);
+	}
+	_frameReady.notify_one();
+	_recordedFrames++;
+	return true;
+}
+
+void TrajectoryRecorder::close() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_open || _stopping) return;
+		_stopping = true;
+	}
+	_frameReady.notify_one();
+	_writer.join();
+	_file.close();
+}
+
+void TrajectoryRecorder::writerLoop() {
+	while (true) {
+		FrameBuffer* buffer;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			//Frames still queued when stopping are written before the index
+			_frameReady.wait(lock, [&]() { return !_filled.empty() || _stopping; });
+			if (_filled.empty()) break;
+			buffer = _filled.front();
+			_filled.pop_front();
+		}
+
+		encodeFrame(*buffer);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_free.push_back(buffer);
+		}
+		_bufferFreed.notify_one();
+	}
+
+	flushChunk();
+	writeIndex();
+}
+
+void TrajectoryRecorder::encodeFrame(const FrameBuffer& frame) {
+	unsigned count = (unsigned)frame.positions.size();
+	if (_chunkFrames > 0 && (_chunkFrames == _options.framesPerChunk || count != _chunkParticles)) flushChunk();
+
+	//The first frame of a chunk is stored against zero, which is its absolute value
+	if (_chunkFrames == 0) {
+		_chunkParticles = count;
+		_previous.assign((size_t)count * 4, 0);
+	}
+
+	size_t timeOffset = _chunk.size();
+	_chunk.resize(timeOffset + sizeof(float));
+	std::memcpy(_chunk.data() + timeOffset, &frame.time, sizeof(float));
+
+	for (unsigned i = 0; i < count; i++) {
+		int values[4] = {
+			quantise(frame.positions[i].x, _options.positionStep),
+			quantise(frame.positions[i].y, _options.positionStep),
+			quantise(frame.velocities[i].x, _options.velocityStep),
+			quantise(frame.velocities[i].y, _options.velocityStep)
+		};
+		int* previous = &_previous[(size_t)i * 4];
+		for (int c = 0; c < 4; c++) {
+			//Wrapping difference, the reader's wrapping sum gets the value back even across the whole int range
+			writeVarint(_chunk, zigzag((int)((unsigned)values[c] - (unsigned)previous[c])));
+			previous[c] = values[c];
+		}
+	}
+
+	_chunkFrames++;
+	_encodedFrames++;
+}
+
+void TrajectoryRecorder::flushChunk() {
+	if (_chunkFrames == 0) return;
+
+	TrajectoryChunk chunk;
+	chunk.firstFrame = _encodedFrames - _chunkFrames;
+	chunk.frameCount = _chunkFrames;
+	chunk.particleCount = _chunkParticles;
+	chunk.reserved = 0;
+	chunk.offset = _bytesWritten.load();
+	chunk.size = _chunk.size();
+	_index.push_back(chunk);
+
+	writeBytes(_chunk.data(), _chunk.size());
+	_chunk.clear();
+	_chunkFrames = 0;
+}
+
+void TrajectoryRecorder::writeIndex() {
+	TrajectoryFooter footer;
+	footer.indexOffset = _bytesWritten.load();
+	footer.chunkCount = (unsigned)_index.size();
+	footer.frameCount = _encodedFrames;
+	std::memcpy(footer.magic, INDEX_MAGIC, sizeof(footer.magic));
+	footer.reserved = 0;
+
+	writeBytes(_index.data(), _index.size() * sizeof(TrajectoryChunk));
+	writeBytes(&footer, sizeof(footer));
+	_file.flush();
+}
+
+void TrajectoryRecorder::writeBytes(const void* data, size_t size) {
+	_file.write((const char*)data, (std::streamsize)size);
+	_bytesWritten += size;
+	if (!_file && !_writeFailed) {
+		std::cout << "ERROR::TRAJECTORY_RECORDER::WRITE_FAILED: " << _path << std::endl;
+		_writeFailed = true;
+	}
+}
+
+bool TrajectoryReader::open(const std::string& path) {
+	_file.close();
+	_file.clear();
+	_index.clear();
+	_chunk.clear();
+	_loadedChunk = -1;
+	_frameCount = 0;
+
+	_file.open(path, std::ios::binary);
+	if (!_file) {
+		std::cout << "ERROR::TRAJECTORY_READER::FILE_NOT_OPENED: " << path << std::endl;
+		return false;
+	}
+
+	TrajectoryHeader header;
+	TrajectoryFooter footer;
+	_file.read((char*)&header, sizeof(header));
+	_file.seekg(0, std::ios::end);
+	long long size = (long long)_file.tellg();
+	_file.seekg(size - (long long)sizeof(footer));
+	_file.read((char*)&footer, sizeof(footer));
+	if (!_file || size < (long long)(sizeof(header) + sizeof(footer)) || std::memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0) {
+		std::cout << "ERROR::TRAJECTORY_READER::NOT_A_TRAJECTORY: " << path << std::endl;
+		return false;
+	}
+	if (header.version != TRAJECTORY_VERSION) {
+		std::cout << "ERROR::TRAJECTORY_READER::UNSUPPORTED_VERSION: " << header.version << " in " << path << std::endl;
+		return false;
+	}
+	if (std::memcmp(footer.magic, INDEX_MAGIC, sizeof(footer.magic)) != 0
+		|| footer.indexOffset + (unsigned long long)footer.chunkCount * sizeof(TrajectoryChunk) + sizeof(footer) != (unsigned long long)size) {
+		std::cout << "ERROR::TRAJECTORY_READER::INDEX_MISSING: " << path << std::endl;
+		return false;
+	}
+
+	_index.resize(footer.chunkCount);
+	_file.seekg((long long)footer.indexOffset);
+	_file.read((char*)_index.data(), _index.size() * sizeof(TrajectoryChunk));
+	if (!_file) {
+		std::cout << "ERROR::TRAJECTORY_READER::INDEX_MISSING: " << path << std::endl;
+		_index.clear();
+		return false;
+	}
+
+	_positionStep = header.positionStep;
+	_velocityStep = header.velocityStep;
+	_frameCount = footer.frameCount;
+	return true;
+}
+
+bool TrajectoryReader::readFrame(unsigned frame, float& time, std::vector<glm::vec2>& positions, std::vector<glm::vec2>& velocities) {
+	if (frame >= _frameCount) return false;
+
+	//Last chunk starting at or before the frame
+	auto found = std::upper_bound(_index.begin(), _index.end(), frame,
+		[](unsigned value, const TrajectoryChunk& chunk) { return value < chunk.firstFrame; });
+	if (found == _index.begin()) return false;
+	int chunkIndex = (int)(found - _index.begin()) - 1;
+	const TrajectoryChunk& chunk = _index[chunkIndex];
+	if (frame >= chunk.firstFrame + chunk.frameCount) return false;
+
+	if (chunkIndex != _loadedChunk) {
+		_chunk.resize((size_t)chunk.size);
+		_file.clear();
+		_file.seekg((long long)chunk.offset);
+		_file.read((char*)_chunk.data(), (std::streamsize)chunk.size);
+		if (!_file) {
+			_loadedChunk = -1;
+			return false;
+		}
+		_loadedChunk = chunkIndex;
+	}
+
+	//Replays the deltas from the start of the chunk up to the frame
+	std::vector<int> values((size_t)chunk.particleCount * 4, 0);
+	const unsigned char* at = _chunk.data();
+	const unsigned char* end = at + _chunk.size();
+	for (unsigned f = chunk.firstFrame; f <= frame; f++) {
+		if (end - at < (long long)sizeof(float)) return false;
+		std::memcpy(&time, at, sizeof(float));
+		at += sizeof(float);
+
+		for (int& value : values) {
+			unsigned delta;
+			if (!readVarint(at, end, delta)) return false;
+			value = (int)((unsigned)value + (unsigned)unzigzag(delta));
+		}
+	}
+
+	positions.resize(chunk.particleCount);
+	velocities.resize(chunk.particleCount);
+	for (unsigned i = 0; i < chunk.particleCount; i++) {
+		const int* particle = &values[(size_t)i * 4];
+		positions[i] = glm::vec2(particle[0], particle[1]) * _positionStep;
+		velocities[i] = glm::vec2(particle[2], particle[3]) * _velocityStep;
+	}
+	return true;
+}
@@ -0,0 +1,157 @@
+#ifndef TRAJECTORY_RECORDER_H
+#define TRAJECTORY_RECORDER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glm/vec2.hpp>
+
+// Positions and velocities of every recorded frame, quantised to a fixed step and stored as the change
+// from the previous frame. Frames are grouped in chunks that start from absolute values, so any frame
+// is decoded from the start of its chunk without reading the rest of the file.
+//
+// Layout of version 1:
+//   header  magic "GRTR", version, position step, velocity step
+//   chunks  per frame its time as a float, then per particle the zigzag varint deltas of x, y, vx and vy
+//   index   a TrajectoryChunk per chunk
+//   footer  offset of the index, chunk count, frame count, magic "GRTI"
+// A recording whose writer never closed has no index and can't be read.
+const unsigned TRAJECTORY_VERSION = 1;
+
+struct TrajectoryChunk
+{
+	unsigned firstFrame;
+	unsigned frameCount;
+	// Every frame of a chunk has the same number of particles, a change starts a new chunk
+	unsigned particleCount;
+	unsigned reserved;
+	unsigned long long offset;
+	unsigned long long size;
+};
+
+// What record does when every buffer is still waiting to be written
+enum class RecorderBackPressure
+{
+	// Waits for the writer, the simulation slows to the disk's pace but no frame is lost
+	Block,
+	// Skips the frame and counts it in droppedFrames
+	Drop
+};
+
+struct TrajectoryOptions
+{
+	// Values come back within half a step
+	float positionStep = 1.0f / 128.0f;
+	float velocityStep = 1.0f / 128.0f;
+	// Frames per chunk, the most a random access has to decode
+	unsigned framesPerChunk = 32;
+	// Frame copies in flight between record and the writer, which bounds the memory to this many frames
+	unsigned bufferCount = 4;
+	RecorderBackPressure backPressure = RecorderBackPressure::Block;
+};
+
+// Streams frames to disk from a background thread. record only copies the frame into a free buffer
+// from a fixed pool, quantising, encoding and writing happen on the writer thread.
+class TrajectoryRecorder
+{
+	struct FrameBuffer {
+		float time;
+		std::vector<glm::vec2> positions;
+		std::vector<glm::vec2> velocities;
+	};
+
+	TrajectoryOptions _options;
+	std::string _path;
+	std::ofstream _file;
+	bool _open = false;
+
+	std::vector<FrameBuffer*> _buffers;
+	std::vector<FrameBuffer*> _free;
+	std::deque<FrameBuffer*> _filled;
+	std::mutex _mutex;
+	std::condition_variable _frameReady;
+	std::condition_variable _bufferFreed;
+	bool _stopping = false;
+	std::thread _writer;
+
+	std::atomic<unsigned> _recordedFrames;
+	std::atomic<unsigned> _droppedFrames;
+	std::atomic<unsigned long long> _bytesWritten;
+
+	// Writer thread only
+	std::vector<unsigned char> _chunk;
+	std::vector<TrajectoryChunk> _index;
+	unsigned _chunkFrames = 0;
+	unsigned _chunkParticles = 0;
+	unsigned _encodedFrames = 0;
+	// Quantised values of the previous frame in the chunk, deltas are taken against these so errors don't add up
+	std::vector<int> _previous;
+	bool _writeFailed = false;
+
+	void writerLoop();
+	void encodeFrame(const FrameBuffer& frame);
+	void flushChunk();
+	void writeIndex();
+	void writeBytes(const void* data, size_t size);
+
+public:
+	// Starts the writer thread. A file that can't be created is reported and every record then fails.
+	TrajectoryRecorder(const std::string& path, const TrajectoryOptions& options = TrajectoryOptions());
+	// Writes every pending frame and the index
+	~TrajectoryRecorder();
+
+	TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+	TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+
+	// Queues a copy of one frame, false if it was dropped. Call from one thread at a time.
+	bool record(float time, const glm::vec2* positions, const glm::vec2* velocities, unsigned count);
+	// Finishes the file, later records fail. Called by the destructor.
+	void close();
+
+	unsigned recordedFrames() const {
+		return _recordedFrames.load();
+	}
+
+	unsigned droppedFrames() const {
+		return _droppedFrames.load();
+	}
+
+	unsigned long long bytesWritten() const {
+		return _bytesWritten.load();
+	}
+};
+
+// Random access to the frames of a finished recording
+class TrajectoryReader
+{
+	std::ifstream _file;
+	float _positionStep = 0;
+	float _velocityStep = 0;
+	unsigned _frameCount = 0;
+	std::vector<TrajectoryChunk> _index;
+	// Bytes of the chunk read last, consecutive frames of one chunk are read from memory
+	std::vector<unsigned char> _chunk;
+	int _loadedChunk = -1;
+
+public:
+	// False and reported if the file isn't a finished recording of this version
+	bool open(const std::string& path);
+
+	unsigned frameCount() const {
+		return _frameCount;
+	}
+
+	const std::vector<TrajectoryChunk>& chunks() const {
+		return _index;
+	}
+
+	// Decodes one frame into the arrays, resizing them to its particle count
+	bool readFrame(unsigned frame, float& time, std::vector<glm::vec2>& positions, std::vector<glm::vec2>& velocities);
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+// Lock-free single producer, single consumer hand-off of the latest value.
+// The writer fills its private slot and publishes it by swapping it with the shared
+// middle slot, the reader swaps the middle slot for its own when something new is there.
+// Neither side ever waits and the reader always sees the most recently published value.
+template <typename T>
+class TripleBuffer
+{
+	static const unsigned INDEX_MASK = 3;
+	// Set on the middle slot when it holds data the reader has not taken yet
+	static const unsigned FRESH_BIT = 4;
+
+	T _slots[3];
+	std::atomic<unsigned> _middle;
+	unsigned _write;
+	unsigned _read;
+
+public:
+	TripleBuffer() : _middle(1), _write(0), _read(2) {}
+
+	TripleBuffer(const TripleBuffer&) = delete;
+	TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+	// Writer side
+	T& writeSlot() {
+		return _slots[_write];
+	}
+
+	void publish() {
+		unsigned previous = _middle.exchange(_write | FRESH_BIT, std::memory_order_acq_rel);
+		_write = previous & INDEX_MASK;
+	}
+
+	// Reader side. Returns true if a newer value was swapped in.
+	bool acquire() {
+		if (!(_middle.load(std::memory_order_acquire) & FRESH_BIT)) return false;
+
+		unsigned previous = _middle.exchange(_read, std::memory_order_acq_rel);
+		_read = previous & INDEX_MASK;
+		return true;
+	}
+
+	const T& readSlot() const {
+		return _slots[_read];
+	}
+};
+
+#endif
@@ -7,16 +7,28 @@
 #include "Scene.h"
 #include "Renderer.h"
 #include "Shader.h"
+#include "SimulationThread.h"
+#include "Benchmarks.h"
+#include "SelfChecks.h"
+#include "SweepRunner.h"
 
 using namespace std;
 
 GLFWwindow* window;
+// Hidden window whose context shares GL objects with the main one, used by the simulation thread
+GLFWwindow* simContext;
+SimulationThread* simThread;
 Renderer renderer;
 Scene* scene;
 Shader* densityShader;
 Shader* particleShader;
 
 float prevTime, currTime, deltaTime;
+// The particles resume from here if it exists and are saved back on exit, off unless set with --checkpoint
+std::string checkpointPath;
+// Trajectory of every frame is streamed here when set, see --record
+std::string recordPath;
+TrajectoryRecorder* recorder = nullptr;
 
 void processInput(GLFWwindow* window);
 void initGLAD(), initGeometry(), setupDefaultShader();
@@ -45,7 +57,6 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
 	renderer.updateScreenSize(*scene, width, height);
-	scene->update(deltaTime);
 	renderer.renderLoop(*scene);
 
 	glfwSwapBuffers(window);
@@ -54,7 +65,6 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 void window_pos_callback(GLFWwindow* window, int x, int y)
 {
 	renderer.updateWindowPosition(*scene, x, y);
-	scene->update(deltaTime);
 	renderer.renderLoop(*scene);
 
 	glfwSwapBuffers(window);
@@ -119,14 +129,67 @@ Scene* particleScene() {
 	int x, y;
 	glfwGetWindowPos(window, &x, &y);
 
-	partScene->add(new ParticleSystem(pCount, particleShader, width, height, x, y));
+	ParticleSystem* ps = new ParticleSystem(pCount, particleShader, width, height, x, y);
+	ps->setTimeStep(1.0f / 240.0f, 8);
+	ps->setAdaptiveTimeStep(true);
+	ps->enableSleeping(true);
+	ps->setViscosityStrength(10.0f);
+	partScene->add(ps);
+
+	// Round obstacle below the spawn block, in the same screen space as the particles
+	SDFGrid* boundary = new SDFGrid(glm::vec2(x, y), glm::vec2(width, height), 4.0f);
+	boundary->addCircle(glm::vec2(x + width * 0.5f, y + height * 0.2f), 60.0f);
+	partScene->add(boundary, "boundary.sdf");
+	ps->setBoundary(boundary);
+
+	// Skips settling the spawn block when a previous run left its state behind
+	if (!checkpointPath.empty()) ps->loadCheckpoint(checkpointPath);
+
+	if (!recordPath.empty()) {
+		recorder = new TrajectoryRecorder(recordPath);
+		ps->setRecorder(recorder);
+	}
 
 	return partScene;
 }
 
-int main() {
+int main(int argc, char** argv) {
+	// Headless benchmarks need no window, other options are read on the way
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--benchmark-kernels") {
+			runKernelTableBenchmark(25.0f);
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-numa") {
+			runNumaScalingBenchmark(100000, 20);
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-slabs") {
+			runSlabComparison(8000, 200, 4);
+			return 0;
+		}
+		if (std::string(argv[i]) == "--self-check") {
+			return runSelfChecks() ? 0 : 1;
+		}
+		// Headless simulations of every configuration in the spec, spread over the job system
+		if (std::string(argv[i]) == "--sweep" && i + 1 < argc) {
+			SweepSpec spec;
+			if (!spec.load(argv[i + 1])) return 1;
+			JobSystem jobs;
+			SweepRunner runner(&jobs);
+			return SweepRunner::writeSummaries(spec.output, runner.run(spec)) ? 0 : 1;
+		}
+		if (std::string(argv[i]) == "--checkpoint" && i + 1 < argc) {
+			checkpointPath = argv[++i];
+		}
+		if (std::string(argv[i]) == "--record" && i + 1 < argc) {
+			recordPath = argv[++i];
+		}
+	}
+
 	float lastTime = (float)glfwGetTime();
 	int nbFrames = 0;
+	unsigned long long lastParticleSteps = 0;
 	currTime = 0;
 
 	/*
@@ -139,6 +202,10 @@ int main() {
 
 	window = create_window(800, 600);
 
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	simContext = glfwCreateWindow(1, 1, "Simulation", NULL, window);
+	glfwMakeContextCurrent(window);
+
 	initGLAD();
 
 	glViewport(0, 0, 800, 600);
@@ -156,12 +223,16 @@ int main() {
 	setupDefaultShader();
 
 	initGeometry();
+
+	// Objects created above must be complete before the simulation context uses them
+	glFinish();
+	simThread = new SimulationThread(scene, simContext, 60.0f);
+	simThread->start();
 	/*
 	 * Render Loop!
 	 */
 	while (!glfwWindowShouldClose(window))
 	{
-		std::cout << "------------------- START FRAME -------------------" << std::endl;
 		// Measure speed
 		prevTime = currTime;
 		currTime = (float)glfwGetTime();
@@ -169,20 +240,34 @@ int main() {
 		nbFrames++;
 		if (currTime - lastTime >= 1.0) { // If last prinf() was more than 1 sec ago
 			// printf and reset timer
-			printf("%f ms/frame\n", 1000.0 / double(nbFrames));
+			unsigned long long particleSteps = 0;
+			const std::vector<ParticleSystem*>& psList = scene->getParticleSystems();
+			for (int i = 0; i < psList.size(); i++) {
+				particleSteps += psList[i]->getParticleSteps();
+			}
+			printf("%.0f particle-steps/s, %f ms/frame\n", double(particleSteps - lastParticleSteps), 1000.0 / double(nbFrames));
+			lastParticleSteps = particleSteps;
 			nbFrames = 0;
 			lastTime += 1.0;
 		}
 
 		processInput(window);
 
-		scene->update(deltaTime);
 		renderer.renderLoop(*scene);
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 
+	simThread->stop();
+	delete simThread;
+
+	// The simulation thread is stopped, nothing else touches the particles now
+	const std::vector<ParticleSystem*>& psList = scene->getParticleSystems();
+	if (!checkpointPath.empty() && !psList.empty()) psList[0]->saveCheckpoint(checkpointPath);
+	// Flushes the frames still queued and writes the index
+	delete recorder;
+
 	/* Clean up all resources associated with our window */
 	//TODO: Make this an actual function for when I have my own resources to clean up
 	glfwTerminate();